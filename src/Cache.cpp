@@ -7,6 +7,9 @@
 #include "Cache.h"
 #include "Cache_p.h"
 
+#include <algorithm>
+#include <chrono>
+#include <iterator>
 #include <stdexcept>
 #include <unordered_set>
 #include <variant>
@@ -17,7 +20,10 @@
 #include <QFile>
 #include <QHash>
 #include <QMap>
+#include <QSemaphore>
 #include <QStandardPaths>
+#include <QThread>
+#include <QThreadPool>
 #include <QDebug>
 
 #include <mtx/responses/common.hpp>
@@ -33,7 +39,7 @@
 
 //! Should be changed when a breaking change occurs in the cache format.
 //! This will reset client's data.
-static const std::string CURRENT_CACHE_FORMAT_VERSION{"2022.04.08"};
+static const std::string CURRENT_CACHE_FORMAT_VERSION{"2023.02.15"};
 
 //! Keys used for the DB
 static const std::string_view NEXT_BATCH_KEY("next_batch");
@@ -42,6 +48,12 @@ static const std::string_view CACHE_FORMAT_VERSION_KEY("cache_format_version");
 static const std::string_view CURRENT_ONLINE_BACKUP_VERSION("current_online_backup_version");
 
 constexpr size_t MAX_RESTORED_MESSAGES = 30'000;
+//! Signature checks remembered by the verification status engine.
+constexpr std::size_t MAX_MEMOIZED_SIGNATURES = 50'000;
+//! Bytes of a user directory search term, longer display names are only indexed by a prefix.
+constexpr std::size_t MAX_USER_DIRECTORY_TERM_SIZE = 128;
+//! Matches of a user directory search, that are ranked by shared rooms.
+constexpr std::size_t MAX_USER_DIRECTORY_CANDIDATES = 1'000;
 
 // Adjust the DB size to be  multiplication of 32MB
 // https://git.pantherx.org/development/mobile/matrix-client/-/issues/67#note_42854
@@ -71,7 +83,7 @@ constexpr auto BATCH_SIZE = 100;
 //! Cache databases and their format.
 //!
 //! Contains UI information for the joined rooms. (i.e name, topic, avatar url etc).
-//! Format: room_id -> RoomInfo
+//! Format: room_id -> RoomInfo (binary, see Cache::encodeStoredEvent)
 constexpr auto ROOMS_DB("rooms");
 constexpr auto INVITES_DB("invites");
 //! maps each room to its parent space (id->id)
@@ -84,6 +96,12 @@ constexpr auto SYNC_STATE_DB("sync_state");
 constexpr auto READ_RECEIPTS_DB("read_receipts");
 constexpr auto NOTIFICATIONS_DB("sent_notifications");
 constexpr auto PRESENCE_DB("presence");
+//! Users of the joined rooms.
+//! Format: user_id -> UserDirectoryEntry (json, without the user id)
+constexpr auto USER_DIRECTORY_DB("user_directory");
+//! Search terms of the user directory, see userDirectoryTerms.
+//! Format: term '\0' user_id -> ""
+constexpr auto USER_DIRECTORY_INDEX_DB("user_directory_index");
 
 //! Encryption related databases.
 
@@ -94,12 +112,16 @@ constexpr auto DEVICE_KEYS_DB("device_keys");
 //! room_ids that have encryption enabled.
 constexpr auto ENCRYPTED_ROOMS_DB("encrypted_rooms");
 
-//! room_id -> pickled OlmInboundGroupSession
+//! MegolmSessionIndex (see Cache::megolmSessionKey) -> pickled OlmInboundGroupSession
 constexpr auto INBOUND_MEGOLM_SESSIONS_DB("inbound_megolm_sessions");
-//! MegolmSessionIndex -> pickled OlmOutboundGroupSession
+//! room_id -> pickled OlmOutboundGroupSession
 constexpr auto OUTBOUND_MEGOLM_SESSIONS_DB("outbound_megolm_sessions");
-//! MegolmSessionIndex -> session data about which devices have access to this
+//! MegolmSessionIndex (see Cache::megolmSessionKey) -> GroupSessionData (binary, see
+//! Cache::encodeStoredEvent)
 constexpr auto MEGOLM_SESSIONS_DATA_DB("megolm_sessions_data_db");
+//! The olm sessions of all devices ordered by last use, see olmSessionUseKey.
+//! Format: curve25519 '\0' last use '\0' session_id -> ""
+constexpr auto OLM_SESSIONS_BY_USE_DB("olm_sessions_by_use");
 
 using CachedReceipts = std::multimap<uint64_t, std::string, std::greater<uint64_t>>;
 using Receipts       = std::map<std::string, std::map<std::string, uint64_t>>;
@@ -167,26 +189,166 @@ containsStateUpdates(const mtx::events::collections::StrippedEvents &e)
            std::holds_alternative<StrippedEvent<Topic>>(e);
 }
 
+namespace {
+constexpr char STORED_EVENT_MARKER           = '\0';
+constexpr uint8_t STORED_EVENT_FORMAT_MSGPACK = 1;
+constexpr size_t STORED_EVENT_HEADER_SIZE     = 6;
+}
+
 bool
-Cache::isHiddenEvent(lmdb::txn &txn,
-                     mtx::events::collections::TimelineEvents e,
-                     const std::string &room_id)
+Cache::isEncodedStoredEvent(std::string_view data)
 {
-    using namespace mtx::events;
+    return data.size() >= STORED_EVENT_HEADER_SIZE && data[0] == STORED_EVENT_MARKER;
+}
 
-    // Always hide edits
-    if (mtx::accessors::relations(e).replaces())
-        return true;
+std::string
+Cache::encodeStoredEvent(const nlohmann::json &event)
+{
+    auto payload = nlohmann::json::to_msgpack(event);
+    auto size    = static_cast<uint32_t>(payload.size());
 
-    if (auto encryptedEvent = std::get_if<EncryptedEvent<msg::Encrypted>>(&e)) {
-        MegolmSessionIndex index;
-        index.room_id    = room_id;
-        index.session_id = encryptedEvent->content.session_id;
+    std::string data;
+    data.reserve(STORED_EVENT_HEADER_SIZE + payload.size());
+    data.push_back(STORED_EVENT_MARKER);
+    data.push_back(static_cast<char>(STORED_EVENT_FORMAT_MSGPACK));
+    for (int i = 0; i < 4; i++)
+        data.push_back(static_cast<char>((size >> (8 * i)) & 0xff));
+    data.append(payload.begin(), payload.end());
+    return data;
+}
+
+nlohmann::json
+Cache::decodeStoredEvent(std::string_view data)
+{
+    // events stored before the binary format are plain json
+    if (!isEncodedStoredEvent(data))
+        return nlohmann::json::parse(data);
+
+    auto version = static_cast<uint8_t>(data[1]);
+    if (version != STORED_EVENT_FORMAT_MSGPACK)
+        throw std::runtime_error("unknown stored event format " + std::to_string(version));
+
+    uint32_t size = 0;
+    for (int i = 0; i < 4; i++)
+        size |= static_cast<uint32_t>(static_cast<uint8_t>(data[2 + i])) << (8 * i);
+
+    if (data.size() - STORED_EVENT_HEADER_SIZE != size)
+        throw std::runtime_error("truncated stored event");
+
+    auto payload = reinterpret_cast<const uint8_t *>(data.data() + STORED_EVENT_HEADER_SIZE);
+    return nlohmann::json::from_msgpack(payload, payload + size);
+}
+
+namespace {
+struct RoomDbSpec
+{
+    const char *suffix;
+    unsigned int flags;
+};
+
+//! Indexed by Cache::RoomDb
+constexpr RoomDbSpec ROOM_DB_SPECS[] = {
+  {"/events", MDB_CREATE},
+  {"/event_order", MDB_CREATE | MDB_INTEGERKEY},
+  {"/event2order", MDB_CREATE},
+  {"/msg2order", MDB_CREATE},
+  {"/order2msg", MDB_CREATE | MDB_INTEGERKEY},
+  {"/pending", MDB_CREATE | MDB_INTEGERKEY},
+  {"/pending_index", MDB_CREATE},
+  {"/related", MDB_CREATE | MDB_DUPSORT},
+  {"/aggregations", MDB_CREATE},
+  {"/state", MDB_CREATE},
+  {"/state_by_key.v2", MDB_CREATE},
+  {"/members", MDB_CREATE},
+  {"/mentions", MDB_CREATE},
+};
+}
+
+lmdb::dbi
+Cache::roomDb(lmdb::txn &txn, const std::string &room_id, RoomDb db)
+{
+    static_assert(std::size(ROOM_DB_SPECS) == static_cast<size_t>(RoomDb::Count));
+
+    {
+        std::lock_guard<std::mutex> lock(room_dbis_mtx_);
+        if (auto it = room_dbis_.find(room_id); it != room_dbis_.end()) {
+            room_dbi_hits_++;
+            return lmdb::dbi(it->second[static_cast<size_t>(db)]);
+        }
+    }
+
+    room_dbi_misses_++;
+    const auto &spec = ROOM_DB_SPECS[static_cast<size_t>(db)];
+    auto dbi         = openDbi(txn, room_id + spec.suffix, spec.flags);
+
+    std::lock_guard<std::mutex> lock(room_dbis_mtx_);
+    pending_room_dbis_.insert(room_id);
+    return dbi;
+}
+
+void
+Cache::registerPendingRoomDbis()
+{
+    std::set<std::string> pending;
+    {
+        std::lock_guard<std::mutex> lock(room_dbis_mtx_);
+        pending.swap(pending_room_dbis_);
+    }
+
+    if (pending.empty())
+        return;
+
+    try {
+        auto txn = lmdb::txn::begin(env_);
+
+        std::unordered_map<std::string, RoomDbis> opened;
+        for (const auto &room_id : pending) {
+            // don't create dbs for rooms we are not in
+            std::string_view unused;
+            if (!roomsDb_.get(txn, room_id, unused))
+                continue;
+
+            RoomDbis handles;
+            for (size_t i = 0; i < handles.size(); i++) {
+                const auto &spec = ROOM_DB_SPECS[i];
+                handles[i]       = openDbi(txn, room_id + spec.suffix, spec.flags).handle();
+            }
+            opened.emplace(room_id, handles);
+        }
 
-        auto result = olm::decryptEvent(index, *encryptedEvent, true);
-        if (!result.error)
-            e = result.event.value();
+        txn.commit();
+
+        std::lock_guard<std::mutex> lock(room_dbis_mtx_);
+        room_dbis_.merge(opened);
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("failed to register room db handles: {}", e.what());
     }
+}
+
+void
+Cache::dropRoomDbis(const std::string &room_id)
+{
+    std::lock_guard<std::mutex> lock(room_dbis_mtx_);
+    room_dbis_.erase(room_id);
+    pending_room_dbis_.erase(room_id);
+}
+
+Cache::RoomDbiStats
+Cache::roomDbiStats()
+{
+    RoomDbiStats stats;
+    stats.hits   = room_dbi_hits_;
+    stats.misses = room_dbi_misses_;
+
+    std::lock_guard<std::mutex> lock(room_dbis_mtx_);
+    stats.rooms = room_dbis_.size();
+    return stats;
+}
+
+std::vector<mtx::events::EventType>
+Cache::hiddenEventTypes(lmdb::txn &txn, const std::string &room_id)
+{
+    using namespace mtx::events;
 
     mtx::events::account_data::nheko_extensions::HiddenEvents hiddenEvents;
     hiddenEvents.hidden_event_types = std::vector{
@@ -210,20 +372,150 @@ Cache::isHiddenEvent(lmdb::txn &txn,
             hiddenEvents = std::move(h.content);
     }
 
-    return std::visit(
-      [hiddenEvents](const auto &ev) {
-          return std::any_of(hiddenEvents.hidden_event_types->begin(),
-                             hiddenEvents.hidden_event_types->end(),
-                             [ev](EventType type) { return type == ev.type; });
-      },
-      e);
+    return std::move(*hiddenEvents.hidden_event_types);
+}
+
+bool
+Cache::classifyEvent(nlohmann::json &orderEntry,
+                     const mtx::events::collections::TimelineEvents &e,
+                     const std::string &room_id,
+                     const std::vector<mtx::events::EventType> &hiddenTypes,
+                     olm::SyncDecryptionBatch *decrypted)
+{
+    using namespace mtx::events;
+
+    auto relations = mtx::accessors::relations(e);
+
+    // Always hide edits
+    if (relations.replaces()) {
+        orderEntry["edit"]   = true;
+        orderEntry["hidden"] = true;
+        return true;
+    }
+
+    auto type = std::visit([](const auto &ev) { return ev.type; }, e);
+    if (auto encryptedEvent = std::get_if<EncryptedEvent<msg::Encrypted>>(&e)) {
+        // the relation of a reaction is not encrypted, no need to decrypt it
+        if (relations.annotates()) {
+            type = EventType::Reaction;
+        } else if (decrypted) {
+            // decrypted before the sync was stored, an event, that wasn't decryptable then,
+            // keeps its encrypted type
+            if (auto result = decrypted->find(encryptedEvent->event_id);
+                result && !result->error)
+                type = std::visit([](const auto &ev) { return ev.type; }, *result->event);
+        } else {
+            MegolmSessionIndex index;
+            index.room_id    = room_id;
+            index.session_id = encryptedEvent->content.session_id;
+
+            auto result = olm::decryptEvent(index, *encryptedEvent, true);
+            if (!result.error)
+                type = std::visit([](const auto &ev) { return ev.type; }, *result.event);
+        }
+    }
+
+    orderEntry["type"] = to_string(type);
+
+    bool hidden = std::find(hiddenTypes.begin(), hiddenTypes.end(), type) != hiddenTypes.end();
+    if (hidden)
+        orderEntry["hidden"] = true;
+    return hidden;
+}
+
+bool
+Cache::reclassifyHiddenEvents(lmdb::txn &txn, const std::string &room_id)
+{
+    auto hiddenTypes = hiddenEventTypes(txn, room_id);
+
+    auto orderDb     = getEventOrderDb(txn, room_id);
+    auto msg2orderDb = getMessageToOrderDb(txn, room_id);
+    auto order2msgDb = getOrderToMessageDb(txn, room_id);
+
+    std::string_view indexVal, val;
+
+    uint64_t msgIndex = std::numeric_limits<uint64_t>::max() / 2;
+    {
+        auto msgCursor = lmdb::cursor::open(txn, order2msgDb);
+        if (msgCursor.get(indexVal, val, MDB_FIRST))
+            msgIndex = lmdb::from_sv<uint64_t>(indexVal);
+    }
+
+    bool changed = false;
+    std::vector<std::string> visible;
+
+    auto cursor = lmdb::cursor::open(txn, orderDb);
+    while (cursor.get(indexVal, val, MDB_NEXT)) {
+        nlohmann::json orderEntry;
+        try {
+            orderEntry = nlohmann::json::parse(val);
+        } catch (const std::exception &) {
+            continue;
+        }
+
+        auto event_id = orderEntry.value("event_id", "");
+        if (event_id.empty())
+            continue;
+
+        if (orderEntry.value("edit", false))
+            continue;
+
+        // entries stored before the classification keep their visibility
+        if (!orderEntry.contains("type")) {
+            std::string_view unused;
+            if (msg2orderDb.get(txn, event_id, unused))
+                visible.push_back(std::move(event_id));
+            continue;
+        }
+
+        auto type   = mtx::events::getEventType(orderEntry["type"].get<std::string>());
+        bool hidden = std::find(hiddenTypes.begin(), hiddenTypes.end(), type) != hiddenTypes.end();
+        if (hidden != orderEntry.value("hidden", false)) {
+            changed = true;
+            if (hidden)
+                orderEntry["hidden"] = true;
+            else
+                orderEntry.erase("hidden");
+            cursor.put(indexVal, orderEntry.dump(), MDB_CURRENT);
+        }
+
+        if (!hidden)
+            visible.push_back(std::move(event_id));
+    }
+    cursor.close();
+
+    if (!changed)
+        return false;
+
+    lmdb::dbi_drop(txn, msg2orderDb, false);
+    lmdb::dbi_drop(txn, order2msgDb, false);
+
+    auto msgCursor = lmdb::cursor::open(txn, order2msgDb);
+    for (const auto &event_id : visible) {
+        msgCursor.put(lmdb::to_sv(msgIndex), event_id, MDB_APPEND);
+        msg2orderDb.put(txn, event_id, lmdb::to_sv(msgIndex));
+        ++msgIndex;
+    }
+    msgCursor.close();
+
+    return true;
 }
 
 Cache::Cache(const QString &userId, QObject *parent)
   : QObject{parent}
   , env_{nullptr}
+  , megolmSessionCache_{
+      static_cast<std::size_t>(std::max(UserSettings::instance()->megolmSessionCacheSize(), 0)) *
+      1024}
   , localUserId_{userId}
 {
+    connect(UserSettings::instance().data(),
+            &UserSettings::megolmSessionCacheSizeChanged,
+            this,
+            [this](int size) {
+                megolmSessionCache_.setMaxBytes(static_cast<std::size_t>(std::max(size, 0)) *
+                                                1024);
+            });
     connect(this, &Cache::userKeysUpdate, this, &Cache::updateUserKeys, Qt::QueuedConnection);
     connect(
       this,
@@ -294,6 +586,9 @@ Cache::setup()
     notificationsDb_  = lmdb::dbi::open(txn, NOTIFICATIONS_DB, MDB_CREATE);
     presenceDb_       = lmdb::dbi::open(txn, PRESENCE_DB, MDB_CREATE);
 
+    userDirectoryDb_      = lmdb::dbi::open(txn, USER_DIRECTORY_DB, MDB_CREATE);
+    userDirectoryIndexDb_ = lmdb::dbi::open(txn, USER_DIRECTORY_INDEX_DB, MDB_CREATE);
+
     // Device management
     devicesDb_    = lmdb::dbi::open(txn, DEVICES_DB, MDB_CREATE);
     deviceKeysDb_ = lmdb::dbi::open(txn, DEVICE_KEYS_DB, MDB_CREATE);
@@ -302,6 +597,7 @@ Cache::setup()
     inboundMegolmSessionDb_  = lmdb::dbi::open(txn, INBOUND_MEGOLM_SESSIONS_DB, MDB_CREATE);
     outboundMegolmSessionDb_ = lmdb::dbi::open(txn, OUTBOUND_MEGOLM_SESSIONS_DB, MDB_CREATE);
     megolmSessionDataDb_     = lmdb::dbi::open(txn, MEGOLM_SESSIONS_DATA_DB, MDB_CREATE);
+    olmSessionsByUseDb_      = lmdb::dbi::open(txn, OLM_SESSIONS_BY_USE_DB, MDB_CREATE);
 
     // What rooms are encrypted
     encryptedRooms_                      = lmdb::dbi::open(txn, ENCRYPTED_ROOMS_DB, MDB_CREATE);
@@ -453,71 +749,236 @@ Cache::roomEncryptionSettings(const std::string &room_id)
     return std::nullopt;
 }
 
+namespace {
+QThreadPool *
+sessionKeyPool()
+{
+    static auto *pool = [] {
+        auto p = new QThreadPool;
+        p->setMaxThreadCount(std::clamp(QThread::idealThreadCount(), 1, 8));
+        return p;
+    }();
+    return pool;
+}
+
+//! Calls f(i) for every i < n on the session key pool. The calling thread helps, so this
+//! must not be called from the pool itself.
+template<class F>
+void
+parallelFor(std::size_t n, F f)
+{
+    auto workers = static_cast<int>(std::min<std::size_t>(sessionKeyPool()->maxThreadCount(), n));
+    std::atomic<std::size_t> next{0};
+    auto work = [&f, &next, n] {
+        for (std::size_t i = next++; i < n; i = next++)
+            f(i);
+    };
+
+    QSemaphore done;
+    for (int i = 1; i < workers; i++)
+        sessionKeyPool()->start(QRunnable::create([&work, &done] {
+            work();
+            done.release();
+        }));
+    work();
+    if (workers > 1)
+        done.acquire(workers - 1);
+}
+
+void
+logTransfer(const char *what, const SessionKeyTransferStats &stats)
+{
+    nhlog::crypto()->info("{} {} sessions ({} skipped) in {} chunks in {}ms, {:.0f} sessions/s",
+                          what,
+                          stats.sessions,
+                          stats.skipped,
+                          stats.chunks,
+                          stats.elapsed.count(),
+                          stats.sessionsPerSecond());
+}
+}
+
 mtx::crypto::ExportedSessionKeys
 Cache::exportSessionKeys()
 {
-    using namespace mtx::crypto;
+    mtx::crypto::ExportedSessionKeys keys;
+    exportSessionKeys([&keys](mtx::crypto::ExportedSessionKeys &&chunk) {
+        std::move(chunk.sessions.begin(), chunk.sessions.end(), std::back_inserter(keys.sessions));
+        return true;
+    });
+    return keys;
+}
 
-    ExportedSessionKeys keys;
+SessionKeyTransferStats
+Cache::exportSessionKeys(
+  const std::function<bool(mtx::crypto::ExportedSessionKeys &&)> &sink,
+  std::size_t chunkSize)
+{
+    using namespace mtx::crypto;
 
-    auto txn    = ro_txn(env_);
-    auto cursor = lmdb::cursor::open(txn, inboundMegolmSessionDb_);
+    const auto started = std::chrono::steady_clock::now();
+    SessionKeyTransferStats stats;
 
-    std::string_view key, value;
-    while (cursor.get(key, value, MDB_NEXT)) {
-        ExportedSession exported;
+    struct Record
+    {
         MegolmSessionIndex index;
+        std::string pickled;
+        std::string data;
+    };
 
-        auto saved_session = unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
+    std::string lastKey;
+    bool first = true;
+    chunkSize  = std::max<std::size_t>(chunkSize, 1);
 
-        try {
-            index = nlohmann::json::parse(key).get<MegolmSessionIndex>();
-        } catch (const nlohmann::json::exception &e) {
-            nhlog::db()->critical("failed to export megolm session: {}", e.what());
-            continue;
-        }
+    while (true) {
+        std::vector<Record> records;
+        records.reserve(chunkSize);
 
-        try {
-            using namespace mtx::crypto;
+        // Only the raw records are copied while the read transaction is open, it is reopened
+        // for every chunk after the last key, so writers are never blocked for long.
+        {
+            auto txn    = ro_txn(env_);
+            auto cursor = lmdb::cursor::open(txn, inboundMegolmSessionDb_);
+
+            std::string_view key = lastKey, value;
+            bool found           = cursor.get(key, value, first ? MDB_FIRST : MDB_SET_RANGE);
+            if (found && !first && key == lastKey)
+                found = cursor.get(key, value, MDB_NEXT);
+
+            while (found && records.size() < chunkSize) {
+                lastKey = key;
+
+                Record record;
+                std::string_view data;
+                if (!parseMegolmSessionKey(key, record.index)) {
+                    nhlog::db()->critical("failed to export megolm session: invalid key");
+                    stats.skipped++;
+                } else if (!megolmSessionDataDb_.get(txn, key, data)) {
+                    stats.skipped++;
+                } else {
+                    record.pickled = std::string(value);
+                    record.data    = std::string(data);
+                    records.push_back(std::move(record));
+                }
 
-            std::string_view v;
-            if (megolmSessionDataDb_.get(txn, nlohmann::json(index).dump(), v)) {
-                auto data           = nlohmann::json::parse(v).get<GroupSessionData>();
-                exported.sender_key = data.sender_key;
-                if (!data.sender_claimed_ed25519_key.empty())
-                    exported.sender_claimed_keys["ed25519"] = data.sender_claimed_ed25519_key;
-                exported.forwarding_curve25519_key_chain = data.forwarding_curve25519_key_chain;
-            } else {
-                continue;
+                found = cursor.get(key, value, MDB_NEXT);
             }
+            cursor.close();
 
-        } catch (std::exception &e) {
-            nhlog::db()->error("Failed to retrieve Megolm Session Data: {}", e.what());
-            continue;
+            if (!found && records.empty())
+                break;
         }
+        first = false;
 
-        exported.room_id     = index.room_id;
-        exported.session_id  = index.session_id;
-        exported.session_key = export_session(saved_session.get(), -1);
+        std::vector<std::optional<ExportedSession>> exported(records.size());
+        parallelFor(records.size(), [this, &records, &exported](std::size_t i) {
+            const auto &record = records[i];
+            try {
+                auto data = decodeStoredEvent(record.data).get<GroupSessionData>();
 
-        keys.sessions.push_back(exported);
-    }
+                ExportedSession session;
+                session.sender_key = data.sender_key;
+                if (!data.sender_claimed_ed25519_key.empty())
+                    session.sender_claimed_keys["ed25519"] = data.sender_claimed_ed25519_key;
+                session.forwarding_curve25519_key_chain = data.forwarding_curve25519_key_chain;
+
+                auto saved_session =
+                  unpickle<InboundSessionObject>(record.pickled, pickle_secret_);
+                session.room_id     = record.index.room_id;
+                session.session_id  = record.index.session_id;
+                session.session_key = export_session(saved_session.get(), -1);
+
+                exported[i] = std::move(session);
+            } catch (const std::exception &e) {
+                nhlog::db()->error(
+                  "Failed to export megolm session {}: {}", record.index.session_id, e.what());
+            }
+        });
+
+        ExportedSessionKeys chunk;
+        chunk.sessions.reserve(exported.size());
+        for (auto &session : exported) {
+            if (session)
+                chunk.sessions.push_back(std::move(*session));
+            else
+                stats.skipped++;
+        }
 
-    cursor.close();
+        stats.sessions += chunk.sessions.size();
+        stats.chunks++;
+        if (!chunk.sessions.empty() && !sink(std::move(chunk)))
+            break;
+    }
 
-    return keys;
+    stats.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - started);
+    logTransfer("Exported", stats);
+    return stats;
 }
 
-void
+std::size_t
 Cache::importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys)
 {
-    std::size_t importCount = 0;
+    std::size_t next = 0;
+    return importSessionKeys([&keys, &next](mtx::crypto::ExportedSessionKeys &chunk) {
+               if (next >= keys.sessions.size())
+                   return false;
 
-    auto txn = lmdb::txn::begin(env_);
-    for (const auto &s : keys.sessions) {
+               auto end = std::min(next + SessionKeyChunkSize, keys.sessions.size());
+               chunk.sessions.assign(keys.sessions.begin() + next, keys.sessions.begin() + end);
+               next = end;
+               return true;
+           })
+      .sessions;
+}
+
+SessionKeyTransferStats
+Cache::importSessionKeys(const std::function<bool(mtx::crypto::ExportedSessionKeys &)> &source)
+{
+    const auto started = std::chrono::steady_clock::now();
+    SessionKeyTransferStats stats;
+
+    mtx::crypto::ExportedSessionKeys chunk;
+    while (source(chunk)) {
+        auto stored = importSessionKeyChunk(chunk);
+        stats.sessions += stored;
+        stats.skipped += chunk.sessions.size() - stored;
+        stats.chunks++;
+        chunk.sessions.clear();
+    }
+
+    stats.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - started);
+    logTransfer("Imported", stats);
+    return stats;
+}
+
+std::size_t
+Cache::importSessionKeyChunk(const mtx::crypto::ExportedSessionKeys &keys)
+{
+    using namespace mtx::crypto;
+
+    struct Prepared
+    {
         MegolmSessionIndex index;
-        index.room_id    = s.room_id;
-        index.session_id = s.session_id;
+        std::string key;
+        std::string pickled;
+        std::string data;
+        uint32_t first_known_index = 0;
+        //! the stored session, that was compared against, if any
+        std::optional<std::string> previous;
+        bool valid = false;
+    };
+
+    // Importing and pickling is independent per session, so it runs in parallel.
+    std::vector<Prepared> prepared(keys.sessions.size());
+    parallelFor(keys.sessions.size(), [this, &keys, &prepared](std::size_t i) {
+        const auto &s = keys.sessions[i];
+        auto &p       = prepared[i];
+
+        p.index.room_id    = s.room_id;
+        p.index.session_id = s.session_id;
+        p.key              = megolmSessionKey(p.index);
 
         GroupSessionData data{};
         data.sender_key                      = s.sender_key;
@@ -528,43 +989,98 @@ Cache::importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys)
             data.sender_claimed_ed25519_key = s.sender_claimed_keys.at("ed25519");
 
         try {
-        auto exported_session = mtx::crypto::import_session(s.session_key);
-
-            using namespace mtx::crypto;
-            const auto key = nlohmann::json(index).dump();
-            const auto pickled =
-              pickle<InboundSessionObject>(exported_session.get(), pickle_secret_);
+            auto session        = import_session(s.session_key);
+            p.first_known_index = olm_inbound_group_session_first_known_index(session.get());
+            p.pickled           = pickle<InboundSessionObject>(session.get(), pickle_secret_);
+            p.data              = encodeStoredEvent(nlohmann::json(data));
+            p.valid             = true;
+        } catch (const std::exception &e) {
+            nhlog::crypto()->critical(
+              "failed to import inbound megolm session {}: {}", s.session_id, e.what());
+        }
+    });
 
+    {
+        auto txn = ro_txn(env_);
+        for (auto &p : prepared) {
             std::string_view value;
-            if (inboundMegolmSessionDb_.get(txn, key, value)) {
-                auto oldSession =
-                  unpickle<InboundSessionObject>(std::string(value), pickle_secret_);
-                if (olm_inbound_group_session_first_known_index(exported_session.get()) >=
-                    olm_inbound_group_session_first_known_index(oldSession.get())) {
-                    nhlog::crypto()->warn(
-                      "Not storing inbound session with newer or equal first known index");
-                    continue;
+            if (p.valid && inboundMegolmSessionDb_.get(txn, p.key, value))
+                p.previous = std::string(value);
+        }
     }
-}
 
-            inboundMegolmSessionDb_.put(txn, key, pickled);
-            megolmSessionDataDb_.put(txn, key, nlohmann::json(data).dump());
+    // Only keep sessions, that are older than the stored ones.
+    auto isOlder = [this](const Prepared &p, const std::string &stored) {
+        auto oldSession = unpickle<InboundSessionObject>(stored, pickle_secret_);
+        return p.first_known_index < olm_inbound_group_session_first_known_index(oldSession.get());
+    };
+    parallelFor(prepared.size(), [&prepared, &isOlder](std::size_t i) {
+        auto &p = prepared[i];
+        if (!p.valid || !p.previous)
+            return;
 
-            ChatPage::instance()->receivedSessionKey(QString::fromStdString(index.room_id), QString::fromStdString(index.session_id));
-            importCount++;
+        try {
+            if (!isOlder(p, *p.previous)) {
+                nhlog::crypto()->warn(
+                  "Not storing inbound session with newer or equal first known index");
+                p.valid = false;
+            }
+        } catch (const olm_exception &e) {
+            nhlog::crypto()->warn("Replacing unreadable inbound session {}: {}",
+                                  p.index.session_id,
+                                  e.what());
+        }
+    });
+
+    std::vector<MegolmSessionIndex> imported;
+
+    auto txn = lmdb::txn::begin(env_);
+    MegolmSessionCache::WriteGuard guard(megolmSessionCache_);
+    for (auto &p : prepared) {
+        if (!p.valid)
+            continue;
+
+        try {
+            // a session may have been stored since it was compared above
+            std::string_view value;
+            bool exists = inboundMegolmSessionDb_.get(txn, p.key, value);
+            if (exists && (!p.previous || value != *p.previous) &&
+                !isOlder(p, std::string(value)))
+                continue;
+
+            // while holding the writer lock, so that no write back can overwrite the import
+            megolmSessionCache_.invalidate(p.index);
+            inboundMegolmSessionDb_.put(txn, p.key, p.pickled);
+            megolmSessionDataDb_.put(txn, p.key, p.data);
+
+            imported.push_back(std::move(p.index));
         } catch (const mtx::crypto::olm_exception &e) {
             nhlog::crypto()->critical(
-              "failed to import inbound megolm session {}: {}", index.session_id, e.what());
+              "failed to import inbound megolm session {}: {}", p.index.session_id, e.what());
             continue;
         } catch (const lmdb::error &e) {
             nhlog::crypto()->critical(
-              "failed to save inbound megolm session {}: {}", index.session_id, e.what());
+              "failed to save inbound megolm session {}: {}", p.index.session_id, e.what());
             continue;
         }
     }
     txn.commit();
 
-    nhlog::crypto()->info("Imported {} out of {} keys", importCount, keys.sessions.size());
+    nhlog::crypto()->debug("Imported {} out of {} keys", imported.size(), keys.sessions.size());
+
+    auto importCount = imported.size();
+    // the timelines live on the ui thread, while keys may be imported from a worker
+    if (!imported.empty())
+        QMetaObject::invokeMethod(
+          ChatPage::instance(),
+          [imported = std::move(imported)] {
+              for (const auto &index : imported)
+                  ChatPage::instance()->receivedSessionKey(
+                    QString::fromStdString(index.room_id), QString::fromStdString(index.session_id));
+          },
+          Qt::QueuedConnection);
+
+    return importCount;
 }
 
 //
@@ -577,10 +1093,11 @@ Cache::saveInboundMegolmSession(const MegolmSessionIndex &index,
                                 const GroupSessionData &data)
 {
     using namespace mtx::crypto;
-    const auto key     = nlohmann::json(index).dump();
+    const auto key     = megolmSessionKey(index);
     const auto pickled = pickle<InboundSessionObject>(session.get(), pickle_secret_);
 
     auto txn = lmdb::txn::begin(env_);
+    MegolmSessionCache::WriteGuard guard(megolmSessionCache_);
 
     std::string_view value;
     if (inboundMegolmSessionDb_.get(txn, key, value)) {
@@ -593,8 +1110,17 @@ Cache::saveInboundMegolmSession(const MegolmSessionIndex &index,
     }
 
     inboundMegolmSessionDb_.put(txn, key, pickled);
-    megolmSessionDataDb_.put(txn, key, nlohmann::json(data).dump());
-    txn.commit();
+    megolmSessionDataDb_.put(txn, key, encodeStoredEvent(nlohmann::json(data)));
+
+    // Replace the cached session while holding the writer lock, so that a write back, which
+    // takes the lock after us, sees the old entry invalidated.
+    megolmSessionCache_.put(index, std::move(session));
+    try {
+        txn.commit();
+    } catch (...) {
+        megolmSessionCache_.invalidate(index);
+        throw;
+    }
 }
 
 mtx::crypto::InboundGroupSessionPtr
@@ -604,7 +1130,7 @@ Cache::getInboundMegolmSession(const MegolmSessionIndex &index)
 
     try {
         auto txn        = ro_txn(env_);
-        std::string key = nlohmann::json(index).dump();
+        std::string key = megolmSessionKey(index);
         std::string_view value;
 
         if (inboundMegolmSessionDb_.get(txn, key, value)) {
@@ -618,6 +1144,63 @@ Cache::getInboundMegolmSession(const MegolmSessionIndex &index)
     return nullptr;
 }
 
+MegolmSessionCache::EntryPtr
+Cache::getCachedInboundMegolmSession(const MegolmSessionIndex &index)
+{
+    using namespace mtx::crypto;
+
+    if (auto session = megolmSessionCache_.get(index))
+        return session;
+
+    // before the read transaction starts, see MegolmSessionCache::putLoaded()
+    const auto sequence = megolmSessionCache_.writeSequence();
+
+    auto txn        = ro_txn(env_);
+    std::string key = megolmSessionKey(index);
+    std::string_view value;
+
+    if (!inboundMegolmSessionDb_.get(txn, key, value))
+        return nullptr;
+
+    try {
+        return megolmSessionCache_.putLoaded(
+          index, unpickle<InboundSessionObject>(std::string(value), pickle_secret_), sequence);
+    } catch (const olm_exception &e) {
+        nhlog::db()->error("Failed to unpickle inbound megolm session {}", e.what());
+        return nullptr;
+    }
+}
+
+void
+Cache::writeBackInboundMegolmSession(const MegolmSessionIndex &index,
+                                     const MegolmSessionCache::EntryPtr &session,
+                                     const GroupSessionData &data)
+{
+    using namespace mtx::crypto;
+
+    // The session was replaced in the mean time, don't overwrite the new one.
+    if (session->invalidated) {
+        nhlog::db()->debug("Not writing back replaced inbound session {}", index.session_id);
+        return;
+    }
+
+    const auto key     = megolmSessionKey(index);
+    const auto pickled = pickle<InboundSessionObject>(session->session.get(), pickle_secret_);
+
+    auto txn = lmdb::txn::begin(env_);
+
+    // Writers invalidate the entry while holding the writer lock, so this check is final now.
+    if (session->invalidated) {
+        nhlog::db()->debug("Not writing back replaced inbound session {}", index.session_id);
+        txn.abort();
+        return;
+    }
+
+    inboundMegolmSessionDb_.put(txn, key, pickled);
+    megolmSessionDataDb_.put(txn, key, encodeStoredEvent(nlohmann::json(data)));
+    txn.commit();
+}
+
 bool
 Cache::inboundMegolmSessionExists(const MegolmSessionIndex &index)
 {
@@ -625,7 +1208,7 @@ Cache::inboundMegolmSessionExists(const MegolmSessionIndex &index)
 
     try {
         auto txn        = ro_txn(env_);
-        std::string key = nlohmann::json(index).dump();
+        std::string key = megolmSessionKey(index);
         std::string_view value;
 
         return inboundMegolmSessionDb_.get(txn, key, value);
@@ -658,7 +1241,8 @@ Cache::updateOutboundMegolmSession(const std::string &room_id,
 
     auto txn = lmdb::txn::begin(env_);
     outboundMegolmSessionDb_.put(txn, room_id, j.dump());
-    megolmSessionDataDb_.put(txn, nlohmann::json(index).dump(), nlohmann::json(data).dump());
+    megolmSessionDataDb_.put(
+      txn, megolmSessionKey(index), encodeStoredEvent(nlohmann::json(data)));
     txn.commit();
 }
 
@@ -697,7 +1281,8 @@ Cache::saveOutboundMegolmSession(const std::string &room_id,
 
     auto txn = lmdb::txn::begin(env_);
     outboundMegolmSessionDb_.put(txn, room_id, j.dump());
-    megolmSessionDataDb_.put(txn, nlohmann::json(index).dump(), nlohmann::json(data).dump());
+    megolmSessionDataDb_.put(
+      txn, megolmSessionKey(index), encodeStoredEvent(nlohmann::json(data)));
     txn.commit();
 }
 
@@ -733,8 +1318,8 @@ Cache::getOutboundMegolmSession(const std::string &room_id)
         index.room_id    = room_id;
         index.session_id = mtx::crypto::session_id(ref.session.get());
 
-        if (megolmSessionDataDb_.get(txn, nlohmann::json(index).dump(), value)) {
-            ref.data = nlohmann::json::parse(value).get<GroupSessionData>();
+        if (megolmSessionDataDb_.get(txn, megolmSessionKey(index), value)) {
+            ref.data = decodeStoredEvent(value).get<GroupSessionData>();
         }
 
         return ref;
@@ -744,49 +1329,219 @@ Cache::getOutboundMegolmSession(const std::string &room_id)
     }
 }
 
-std::optional<GroupSessionData>
-Cache::getMegolmSessionData(const MegolmSessionIndex &index)
+std::optional<GroupSessionData>
+Cache::getMegolmSessionData(const MegolmSessionIndex &index)
+{
+    try {
+        using namespace mtx::crypto;
+
+        auto txn = ro_txn(env_);
+
+        std::string_view value;
+        if (megolmSessionDataDb_.get(txn, megolmSessionKey(index), value)) {
+            return decodeStoredEvent(value).get<GroupSessionData>();
+        }
+
+        return std::nullopt;
+    } catch (std::exception &e) {
+        nhlog::db()->error("Failed to retrieve Megolm Session Data: {}", e.what());
+        return std::nullopt;
+    }
+}
+
+//
+// OLM sessions.
+//
+
+namespace {
+//! Key of the olm session index. The timestamp is stored inverted and big endian, so that
+//! the sessions of a device sort by descending last use.
+std::string
+olmSessionUseKey(std::string_view curve25519, uint64_t last_use, std::string_view session_id)
+{
+    std::string key;
+    key.reserve(curve25519.size() + 10 + session_id.size());
+    key.append(curve25519);
+    key.push_back('\0');
+    for (int shift = 56; shift >= 0; shift -= 8)
+        key.push_back(static_cast<char>((~last_use >> shift) & 0xff));
+    key.push_back('\0');
+    key.append(session_id);
+    return key;
+}
+
+std::string
+olmSessionUsePrefix(std::string_view curve25519)
+{
+    std::string prefix(curve25519);
+    prefix.push_back('\0');
+    return prefix;
+}
+
+//! Length of the key of a session, that follows the prefix of its device.
+constexpr std::size_t olmSessionUseTimestampSize = 9;
+}
+
+namespace {
+//! Cuts the term to MAX_USER_DIRECTORY_TERM_SIZE bytes without splitting a UTF-8 sequence.
+std::string
+userDirectoryTerm(std::string term)
+{
+    if (term.size() <= MAX_USER_DIRECTORY_TERM_SIZE)
+        return term;
+
+    auto size = MAX_USER_DIRECTORY_TERM_SIZE;
+    while (size > 0 && (static_cast<unsigned char>(term[size]) & 0xC0) == 0x80)
+        size--;
+    term.resize(size);
+    return term;
+}
+
+//! The user id without sigil, the display name and each of its words, all lowercase and cut
+//! to MAX_USER_DIRECTORY_TERM_SIZE.
+std::set<std::string>
+userDirectoryTerms(const std::string &user_id, const std::string &display_name)
+{
+    std::set<std::string> terms;
+    terms.insert(
+      userDirectoryTerm(QString::fromStdString(user_id).mid(1).toLower().toStdString()));
+
+    auto name = QString::fromStdString(display_name).toLower();
+    if (!name.isEmpty()) {
+        terms.insert(userDirectoryTerm(name.toStdString()));
+        for (const auto &word : name.split(QLatin1Char(' ')))
+            if (!word.isEmpty())
+                terms.insert(userDirectoryTerm(word.toStdString()));
+    }
+    return terms;
+}
+
+std::string
+userDirectoryIndexKey(const std::string &term, std::string_view user_id)
+{
+    std::string key;
+    key.reserve(term.size() + 1 + user_id.size());
+    key.append(term);
+    key.push_back('\0');
+    key.append(user_id);
+    return key;
+}
+}
+
+std::optional<lmdb::dbi>
+Cache::olmSessionsDb(const std::string &curve25519_key)
 {
-    try {
-        using namespace mtx::crypto;
-
-        auto txn = ro_txn(env_);
-
-        std::string_view value;
-        if (megolmSessionDataDb_.get(txn, nlohmann::json(index).dump(), value)) {
-            return nlohmann::json::parse(value).get<GroupSessionData>();
+    {
+        std::lock_guard<std::mutex> lock(olm_session_dbis_mtx_);
+        if (auto it = olm_session_dbis_.find(curve25519_key); it != olm_session_dbis_.end()) {
+            if (it->second)
+                return lmdb::dbi(*it->second);
+            return std::nullopt;
         }
+    }
 
-        return std::nullopt;
-    } catch (std::exception &e) {
-        nhlog::db()->error("Failed to retrieve Megolm Session Data: {}", e.what());
-        return std::nullopt;
+    // Handles are closed again, when their transaction ends without a commit, so the shared
+    // read transaction can't open it. A read only transaction of its own can be committed as
+    // well and doesn't wait for the writer, i.e. behind saveState.
+    std::optional<MDB_dbi> handle;
+    auto txn = lmdb::txn::begin(env_, nullptr, MDB_RDONLY);
+    try {
+        handle = openDbi(txn, "olm_sessions.v2/" + curve25519_key).handle();
+        txn.commit();
+    } catch (const lmdb::not_found_error &) {
+        txn.abort();
     }
+
+    std::lock_guard<std::mutex> lock(olm_session_dbis_mtx_);
+    // a concurrent save may have created and registered the db since the lookup above
+    auto entry = olm_session_dbis_.try_emplace(curve25519_key, handle).first;
+    if (handle)
+        entry->second = handle;
+    if (entry->second)
+        return lmdb::dbi(*entry->second);
+    return std::nullopt;
 }
-//
-// OLM sessions.
-//
 
 void
 Cache::saveOlmSession(const std::string &curve25519,
                       mtx::crypto::OlmSessionPtr session,
                       uint64_t timestamp)
+{
+    std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessions;
+    sessions.emplace_back(curve25519, std::move(session));
+    saveOlmSessions(std::move(sessions), timestamp);
+}
+
+void
+Cache::saveOlmSessions(std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessions,
+                       uint64_t timestamp)
 {
     using namespace mtx::crypto;
 
+    struct Pickled
+    {
+        std::string session_id;
+        std::string value;
+    };
+    std::vector<std::optional<Pickled>> pickled(sessions.size());
+    for (std::size_t i = 0; i < sessions.size(); i++) {
+        try {
+            StoredOlmSession stored_session;
+            stored_session.pickled_session =
+              pickle<SessionObject>(sessions[i].second.get(), pickle_secret_);
+            stored_session.last_message_ts = timestamp;
+
+            pickled[i] = Pickled{mtx::crypto::session_id(sessions[i].second.get()),
+                                 nlohmann::json(stored_session).dump()};
+        } catch (const olm_exception &e) {
+            nhlog::crypto()->critical("failed to pickle olm session with {}: {}",
+                                      sessions[i].first,
+                                      e.what());
+        }
+    }
+
+    std::map<std::string, MDB_dbi> dbis;
+
     auto txn = lmdb::txn::begin(env_);
-    auto db  = getOlmSessionsDb(txn, curve25519);
+    for (std::size_t i = 0; i < sessions.size(); i++) {
+        if (!pickled[i])
+            continue;
 
-    const auto pickled    = pickle<SessionObject>(session.get(), pickle_secret_);
-    const auto session_id = mtx::crypto::session_id(session.get());
+        const auto &curve25519 = sessions[i].first;
+        const auto &session_id = pickled[i]->session_id;
 
-    StoredOlmSession stored_session;
-    stored_session.pickled_session = pickled;
-    stored_session.last_message_ts = timestamp;
+        auto dbi = dbis.find(curve25519);
+        if (dbi == dbis.end())
+            dbi = dbis.emplace(curve25519, getOlmSessionsDb(txn, curve25519).handle()).first;
+        auto db = lmdb::dbi(dbi->second);
 
-    db.put(txn, session_id, nlohmann::json(stored_session).dump());
+        std::string_view previous;
+        if (db.get(txn, session_id, previous)) {
+            try {
+                auto last_use =
+                  nlohmann::json::parse(previous).get<StoredOlmSession>().last_message_ts;
+                olmSessionsByUseDb_.del(txn, olmSessionUseKey(curve25519, last_use, session_id));
+            } catch (const nlohmann::json::exception &e) {
+                nhlog::db()->warn(
+                  "Failed to parse stored olm session {}: {}", session_id, e.what());
+            }
+        }
 
+        db.put(txn, session_id, pickled[i]->value);
+        olmSessionsByUseDb_.put(txn, olmSessionUseKey(curve25519, timestamp, session_id), "");
+    }
     txn.commit();
+
+    {
+        std::lock_guard<std::mutex> lock(olm_session_dbis_mtx_);
+        for (const auto &[curve25519, handle] : dbis)
+            olm_session_dbis_[curve25519] = handle;
+    }
+
+    for (std::size_t i = 0; i < sessions.size(); i++)
+        if (pickled[i])
+            olmSessionCache_.put(
+              sessions[i].first, pickled[i]->session_id, std::move(sessions[i].second));
 }
 
 std::optional<mtx::crypto::OlmSessionPtr>
@@ -794,15 +1549,17 @@ Cache::getOlmSession(const std::string &curve25519, const std::string &session_i
 {
     using namespace mtx::crypto;
 
-    auto txn = lmdb::txn::begin(env_);
-    auto db  = getOlmSessionsDb(txn, curve25519);
+    if (auto session = olmSessionCache_.take(curve25519, session_id))
+        return session;
 
-    std::string_view pickled;
-    bool found = db.get(txn, session_id, pickled);
+    auto db = olmSessionsDb(curve25519);
+    if (!db)
+        return std::nullopt;
 
-    txn.commit();
+    auto txn = ro_txn(env_);
 
-    if (found) {
+    std::string_view pickled;
+    if (db->get(txn, session_id, pickled)) {
         auto data = nlohmann::json::parse(pickled).get<StoredOlmSession>();
         return unpickle<SessionObject>(data.pickled_session, pickle_secret_);
     }
@@ -813,47 +1570,44 @@ Cache::getOlmSession(const std::string &curve25519, const std::string &session_i
 std::optional<mtx::crypto::OlmSessionPtr>
 Cache::getLatestOlmSession(const std::string &curve25519)
 {
-    using namespace mtx::crypto;
-
-    auto txn = lmdb::txn::begin(env_);
-    auto db  = getOlmSessionsDb(txn, curve25519);
-
-    std::string_view session_id, pickled_session;
-
-    std::optional<StoredOlmSession> currentNewest;
-
-    auto cursor = lmdb::cursor::open(txn, db);
-    while (cursor.get(session_id, pickled_session, MDB_NEXT)) {
-        auto data = nlohmann::json::parse(pickled_session).get<StoredOlmSession>();
-        if (!currentNewest || currentNewest->last_message_ts < data.last_message_ts)
-            currentNewest = data;
+    std::string session_id;
+    {
+        auto txn          = ro_txn(env_);
+        const auto prefix = olmSessionUsePrefix(curve25519);
+
+        std::string_view key = prefix, unused;
+        auto cursor          = lmdb::cursor::open(txn, olmSessionsByUseDb_);
+        if (cursor.get(key, unused, MDB_SET_RANGE) &&
+            key.size() > prefix.size() + olmSessionUseTimestampSize &&
+            key.substr(0, prefix.size()) == prefix)
+            session_id = key.substr(prefix.size() + olmSessionUseTimestampSize);
+        cursor.close();
     }
-    cursor.close();
-
-    txn.commit();
 
-    return currentNewest ? std::optional(unpickle<SessionObject>(currentNewest->pickled_session,
-                                                                 pickle_secret_))
-                         : std::nullopt;
+    // getOlmSession may need a transaction of its own to open the db, so the read above is
+    // closed.
+    if (session_id.empty())
+        return std::nullopt;
+    return getOlmSession(curve25519, session_id);
 }
 
 std::vector<std::string>
 Cache::getOlmSessions(const std::string &curve25519)
 {
-    using namespace mtx::crypto;
-
-    auto txn = lmdb::txn::begin(env_);
-    auto db  = getOlmSessionsDb(txn, curve25519);
-
-    std::string_view session_id, unused;
     std::vector<std::string> res;
 
-    auto cursor = lmdb::cursor::open(txn, db);
-    while (cursor.get(session_id, unused, MDB_NEXT))
-        res.emplace_back(session_id);
-    cursor.close();
+    auto txn          = ro_txn(env_);
+    const auto prefix = olmSessionUsePrefix(curve25519);
 
-    txn.commit();
+    std::string_view key = prefix, unused;
+    auto cursor          = lmdb::cursor::open(txn, olmSessionsByUseDb_);
+    bool found           = cursor.get(key, unused, MDB_SET_RANGE);
+    while (found && key.substr(0, prefix.size()) == prefix) {
+        if (key.size() > prefix.size() + olmSessionUseTimestampSize)
+            res.emplace_back(key.substr(prefix.size() + olmSessionUseTimestampSize));
+        found = cursor.get(key, unused, MDB_NEXT);
+    }
+    cursor.close();
 
     return res;
 }
@@ -927,17 +1681,31 @@ void
 Cache::removeRoom(lmdb::txn &txn, const std::string &roomid)
 {
     roomsDb_.del(txn, roomid);
+    pending_room_infos_[roomid] = std::nullopt;
     getStatesDb(txn, roomid).drop(txn, true);
     getAccountDataDb(txn, roomid).drop(txn, true);
-    getMembersDb(txn, roomid).drop(txn, true);
+
+    auto membersdb = getMembersDb(txn, roomid);
+    {
+        auto cursor = lmdb::cursor::open(txn, membersdb);
+        std::string_view user_id, ignored;
+        while (cursor.get(user_id, ignored, MDB_NEXT))
+            removeFromUserDirectory(txn, std::string(user_id));
+    }
+    membersdb.drop(txn, true);
+
+    // dropping closes the handles
+    dropRoomDbis(roomid);
 }
 
 void
 Cache::removeRoom(const std::string &roomid)
 {
     auto txn = lmdb::txn::begin(env_, nullptr, 0);
+    pending_room_infos_.clear();
     roomsDb_.del(txn, roomid);
-    txn.commit();
+    pending_room_infos_[roomid] = std::nullopt;
+    commitRoomInfos(txn);
 }
 
 void
@@ -995,10 +1763,33 @@ Cache::deleteData()
         lmdb::dbi_close(env_, inboundMegolmSessionDb_);
         lmdb::dbi_close(env_, outboundMegolmSessionDb_);
         lmdb::dbi_close(env_, megolmSessionDataDb_);
+        lmdb::dbi_close(env_, olmSessionsByUseDb_);
 
         env_.close();
 
-        verification_storage.status.clear();
+        {
+            std::lock_guard<std::mutex> lock(room_dbis_mtx_);
+            room_dbis_.clear();
+            pending_room_dbis_.clear();
+        }
+        megolmSessionCache_.clear();
+        olmSessionCache_.clear();
+        {
+            std::lock_guard<std::mutex> lock(room_infos_mtx_);
+            room_infos_.clear();
+            room_infos_loaded_ = false;
+            pending_room_infos_.clear();
+        }
+        {
+            std::lock_guard<std::mutex> lock(olm_session_dbis_mtx_);
+            olm_session_dbis_.clear();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(verification_storage.verification_storage_mtx);
+            verification_storage.status.clear();
+            verification_storage.signatures.clear();
+        }
         deleteSecret(mtx::secret_storage::secrets::megolm_backup_v1);
         deleteSecret(mtx::secret_storage::secrets::cross_signing_master);
         deleteSecret(mtx::secret_storage::secrets::cross_signing_user_signing);
@@ -1025,6 +1816,56 @@ Cache::runMigrations()
         stored_version = std::string(current_version);
     }
 
+    //! Replays the stored timelines in arrival order into the relation aggregations. Events
+    //! already aggregated are only updated, so it can run again after the format changed.
+    auto aggregateStoredRelations = [this]() {
+        try {
+            std::vector<std::string> room_ids;
+            {
+                auto txn = ro_txn(env_);
+                room_ids = getRoomIds(txn);
+            }
+
+            for (const auto &room_id : room_ids) {
+                auto txn            = lmdb::txn::begin(env_);
+                auto eventsDb       = getEventsDb(txn, room_id);
+                auto orderDb        = getEventOrderDb(txn, room_id);
+                auto aggregationsDb = getRelationAggregationsDb(txn, room_id);
+
+                std::string_view indexVal, orderEntry;
+                auto cursor = lmdb::cursor::open(txn, orderDb);
+                while (cursor.get(indexVal, orderEntry, MDB_NEXT)) {
+                    try {
+                        auto event_id = nlohmann::json::parse(orderEntry).value("event_id", "");
+
+                        std::string_view event;
+                        if (event_id.empty() || !eventsDb.get(txn, event_id, event))
+                            continue;
+
+                        mtx::events::collections::TimelineEvent te;
+                        from_json(decodeStoredEvent(event), te);
+                        aggregateRelations(txn, aggregationsDb, te.data);
+                    } catch (const std::exception &e) {
+                        nhlog::db()->warn(
+                          "Skipping invalid event while aggregating relations in {}: {}",
+                          room_id,
+                          e.what());
+                    }
+                }
+                cursor.close();
+
+                txn.commit();
+            }
+            registerPendingRoomDbis();
+        } catch (const lmdb::error &e) {
+            nhlog::db()->critical("Failed to aggregate relations: {}", e.what());
+            return false;
+        }
+
+        nhlog::db()->info("Successfully aggregated relations.");
+        return true;
+    };
+
     std::vector<std::pair<std::string, std::function<bool()>>> migrations{
       {"2020.05.01",
        [this]() {
@@ -1242,32 +2083,383 @@ Cache::runMigrations()
                    auto sender_key = indexVal["sender_key"].get<std::string>();
                    indexVal.erase("sender_key");
 
-                   std::string_view dataVal;
-                   bool res = megolmSessionDataDb.get(txn, key, dataVal);
-                   if (res) {
-                       auto data                          = nlohmann::json::parse(dataVal);
-                       data["sender_key"]                 = sender_key;
-                       inboundSessions[indexVal.dump()]   = std::string(value);
-                       megolmSessionData[indexVal.dump()] = data.dump();
+                   std::string_view dataVal;
+                   bool res = megolmSessionDataDb.get(txn, key, dataVal);
+                   if (res) {
+                       auto data                          = nlohmann::json::parse(dataVal);
+                       data["sender_key"]                 = sender_key;
+                       inboundSessions[indexVal.dump()]   = std::string(value);
+                       megolmSessionData[indexVal.dump()] = data.dump();
+                   }
+               }
+               cursor.close();
+               inboundMegolmSessionDb.drop(txn, false);
+               megolmSessionDataDb.drop(txn, false);
+
+               for (const auto &[k, v] : inboundSessions) {
+                   inboundMegolmSessionDb.put(txn, k, v);
+               }
+               for (const auto &[k, v] : megolmSessionData) {
+                   megolmSessionDataDb.put(txn, k, v);
+               }
+               txn.commit();
+               return true;
+           } catch (std::exception &e) {
+               nhlog::db()->warn(
+                 "Failed to migrate stored megolm session to have no sender key: {}", e.what());
+               return false;
+           }
+       }},
+      {"2022.10.01",
+       [this]() {
+           try {
+               std::vector<std::string> room_ids;
+               {
+                   auto txn = ro_txn(env_);
+                   room_ids = getRoomIds(txn);
+               }
+
+               // one transaction per room, so that the dirty pages of big accounts stay bounded
+               for (const auto &room_id : room_ids) {
+                   auto txn      = lmdb::txn::begin(env_);
+                   auto eventsDb = getEventsDb(txn, room_id);
+
+                   std::vector<std::pair<std::string, std::string>> reencoded;
+                   std::string_view event_id, value;
+                   auto cursor = lmdb::cursor::open(txn, eventsDb);
+                   while (cursor.get(event_id, value, MDB_NEXT)) {
+                       if (isEncodedStoredEvent(value))
+                           continue;
+
+                       try {
+                           reencoded.emplace_back(
+                             event_id, encodeStoredEvent(nlohmann::json::parse(value)));
+                       } catch (const nlohmann::json::exception &e) {
+                           nhlog::db()->warn(
+                             "Dropping unparsable event {} in {}: {}", event_id, room_id, e.what());
+                           reencoded.emplace_back(event_id, "");
+                       }
+                   }
+                   cursor.close();
+
+                   for (const auto &[id, data] : reencoded) {
+                       if (data.empty())
+                           eventsDb.del(txn, id);
+                       else
+                           eventsDb.put(txn, id, data);
+                   }
+
+                   txn.commit();
+               }
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to convert stored events to binary format: {}",
+                                     e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully converted stored events to binary format.");
+           return true;
+       }},
+      {"2022.10.15",
+       [this]() {
+           // The old index stored {"key":..,"id":..} json as duplicates per event type and
+           // needs its json parsing comparator to be read.
+           auto compare_state_key = [](const MDB_val *a, const MDB_val *b) {
+               auto get_skey = [](const MDB_val *v) {
+                   return nlohmann::json::parse(
+                            std::string_view(static_cast<const char *>(v->mv_data), v->mv_size))
+                     .value("key", "");
+               };
+
+               return get_skey(a).compare(get_skey(b));
+           };
+
+           try {
+               std::vector<std::string> room_ids;
+               {
+                   auto txn = ro_txn(env_);
+                   room_ids = getRoomIds(txn);
+               }
+
+               for (const auto &room_id : room_ids) {
+                   auto txn = lmdb::txn::begin(env_);
+
+                   lmdb::dbi oldDb;
+                   try {
+                       oldDb = lmdb::dbi::open(
+                         txn, std::string(room_id + "/state_by_key").c_str(), MDB_DUPSORT);
+                       lmdb::dbi_set_dupsort(txn, oldDb, +compare_state_key);
+                   } catch (const lmdb::not_found_error &) {
+                       continue;
+                   }
+
+                   auto newDb = getStatesKeyDb(txn, room_id);
+
+                   std::string_view type, data;
+                   auto cursor = lmdb::cursor::open(txn, oldDb);
+                   while (cursor.get(type, data, MDB_NEXT)) {
+                       try {
+                           auto obj = nlohmann::json::parse(data);
+                           newDb.put(txn,
+                                     stateKeyIndexKey(type, obj.at("key").get<std::string>()),
+                                     obj.at("id").get<std::string>());
+                       } catch (const nlohmann::json::exception &e) {
+                           nhlog::db()->warn(
+                             "Skipping invalid state key entry in {}: {}", room_id, e.what());
+                       }
+                   }
+                   cursor.close();
+
+                   oldDb.drop(txn, true);
+                   txn.commit();
+               }
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to migrate state key index: {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully migrated state key index.");
+           return true;
+       }},
+      {"2022.11.01",
+       [this]() {
+           // Room summaries now also store the member count, join rule and guest access,
+           // which were calculated on every query before.
+           try {
+               auto txn = lmdb::txn::begin(env_);
+               for (const auto &room_id : getRoomIds(txn)) {
+                   RoomInfo info;
+                   std::string_view data;
+                   if (roomsDb_.get(txn, room_id, data)) {
+                       try {
+                           info = decodeStoredEvent(data).get<RoomInfo>();
+                       } catch (const std::exception &e) {
+                           nhlog::db()->warn(
+                             "failed to parse room info: room_id ({}), {}", room_id, e.what());
+                       }
+                   }
+
+                   updateRoomInfo(txn, room_id, info, RoomInfoAll);
+                   roomsDb_.put(txn, room_id, encodeStoredEvent(nlohmann::json(info)));
+               }
+               txn.commit();
+               registerPendingRoomDbis();
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to convert room summaries: {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully converted room summaries.");
+           return true;
+       }},
+      {"2022.11.15",
+       [aggregateStoredRelations]() {
+           // Edits and reactions were collected from the relations db on every render, now
+           // they are aggregated while storing.
+           return aggregateStoredRelations();
+       }},
+      {"2022.12.01",
+       [this]() {
+           // The pending messages are now a queue with an index from transaction id to
+           // position, instead of being searched on every remote echo.
+           try {
+               auto txn = lmdb::txn::begin(env_);
+               for (const auto &room_id : getRoomIds(txn)) {
+                   auto pending      = getPendingMessagesDb(txn, room_id);
+                   auto pendingIndex = getPendingIndexDb(txn, room_id);
+
+                   std::string_view seq, pendingTxn;
+                   auto cursor = lmdb::cursor::open(txn, pending);
+                   while (cursor.get(seq, pendingTxn, MDB_NEXT))
+                       pendingIndex.put(txn, pendingTxn, seq);
+                   cursor.close();
+               }
+               txn.commit();
+               registerPendingRoomDbis();
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to index pending messages: {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully indexed pending messages.");
+           return true;
+       }},
+      {"2022.12.15",
+       [this]() {
+           // Users are searched in a directory maintained while saving member events, instead
+           // of paging through the members of every room.
+           try {
+               auto txn = lmdb::txn::begin(env_);
+               userDirectoryDb_.drop(txn, false);
+               userDirectoryIndexDb_.drop(txn, false);
+
+               for (const auto &room_id : getRoomIds(txn)) {
+                   auto membersdb = getMembersDb(txn, room_id);
+
+                   std::string_view user_id, member_data;
+                   auto cursor = lmdb::cursor::open(txn, membersdb);
+                   while (cursor.get(user_id, member_data, MDB_NEXT)) {
+                       try {
+                           addToUserDirectory(
+                             txn,
+                             std::string(user_id),
+                             nlohmann::json::parse(member_data).get<MemberInfo>(),
+                             true);
+                       } catch (const nlohmann::json::exception &e) {
+                           nhlog::db()->warn("Skipping member {} of {}: {}",
+                                             user_id,
+                                             room_id,
+                                             e.what());
+                       }
+                   }
+                   cursor.close();
+               }
+               txn.commit();
+               registerPendingRoomDbis();
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to build the user directory: {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully built the user directory.");
+           return true;
+       }},
+      {"2023.01.01",
+       [this]() {
+           // Megolm sessions are keyed by room_id '\0' session_id instead of the index as JSON
+           // and their data is stored in the binary format of the events dbs.
+           try {
+               auto txn = lmdb::txn::begin(env_);
+
+               auto rekey = [&txn](lmdb::dbi &db, bool reencode) {
+                   std::vector<std::pair<std::string, std::string>> records;
+
+                   std::string_view key, value;
+                   auto cursor = lmdb::cursor::open(txn, db);
+                   while (cursor.get(key, value, MDB_NEXT)) {
+                       MegolmSessionIndex index;
+                       try {
+                           index = nlohmann::json::parse(key).get<MegolmSessionIndex>();
+                           records.emplace_back(
+                             megolmSessionKey(index),
+                             reencode ? encodeStoredEvent(nlohmann::json::parse(value))
+                                      : std::string(value));
+                       } catch (const nlohmann::json::exception &e) {
+                           nhlog::db()->warn("Dropping megolm session with invalid key: {}",
+                                             e.what());
+                       }
+                   }
+                   cursor.close();
+
+                   db.drop(txn, false);
+                   for (const auto &[k, v] : records)
+                       db.put(txn, k, v);
+               };
+
+               rekey(inboundMegolmSessionDb_, false);
+               rekey(megolmSessionDataDb_, true);
+
+               txn.commit();
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to convert the megolm session keys: {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully converted the megolm session keys.");
+           return true;
+       }},
+      {"2023.01.15",
+       [this]() {
+           // Index the olm sessions of every device by their last use, so that the newest one
+           // can be found without parsing all of them.
+           try {
+               auto txn = lmdb::txn::begin(env_);
+               olmSessionsByUseDb_.drop(txn, false);
+
+               constexpr std::string_view olmDbPrefix = "olm_sessions.v2/";
+
+               std::vector<std::string> olmDbs;
+               std::string_view dbName, ignored;
+               auto mainDb      = lmdb::dbi::open(txn, nullptr);
+               auto olmDbCursor = lmdb::cursor::open(txn, mainDb);
+               dbName           = olmDbPrefix;
+               bool found       = olmDbCursor.get(dbName, ignored, MDB_SET_RANGE);
+               while (found && dbName.substr(0, olmDbPrefix.size()) == olmDbPrefix) {
+                   olmDbs.emplace_back(dbName);
+                   found = olmDbCursor.get(dbName, ignored, MDB_NEXT);
+               }
+               olmDbCursor.close();
+
+               for (const auto &name : olmDbs) {
+                   auto curve25519 = std::string_view(name).substr(olmDbPrefix.size());
+                   auto olmDb      = lmdb::dbi::open(txn, name.c_str());
+
+                   std::string_view session_id, session_value;
+                   auto cursor = lmdb::cursor::open(txn, olmDb);
+                   while (cursor.get(session_id, session_value, MDB_NEXT)) {
+                       try {
+                           auto last_use = nlohmann::json::parse(session_value)
+                                             .get<StoredOlmSession>()
+                                             .last_message_ts;
+                           olmSessionsByUseDb_.put(
+                             txn, olmSessionUseKey(curve25519, last_use, session_id), "");
+                       } catch (const nlohmann::json::exception &e) {
+                           nhlog::db()->warn(
+                             "Skipping olm session {}: {}", session_id, e.what());
+                       }
+                   }
+                   cursor.close();
+               }
+
+               txn.commit();
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to index the olm sessions: {}", e.what());
+               return false;
+           }
+
+           nhlog::db()->info("Successfully indexed the olm sessions.");
+           return true;
+       }},
+      {"2023.02.01",
+       [this]() {
+           // Long display names are only indexed by a prefix, rebuild the index, so that the
+           // entries of names indexed in full don't become stale.
+           try {
+               auto txn = lmdb::txn::begin(env_);
+               userDirectoryIndexDb_.drop(txn, false);
+
+               const auto maxKeySize =
+                 static_cast<std::size_t>(mdb_env_get_maxkeysize(env_.handle()));
+
+               std::string_view user_id, data;
+               auto cursor = lmdb::cursor::open(txn, userDirectoryDb_);
+               while (cursor.get(user_id, data, MDB_NEXT)) {
+                   try {
+                       auto entry = nlohmann::json::parse(data).get<UserDirectoryEntry>();
+                       for (const auto &term :
+                            userDirectoryTerms(std::string(user_id), entry.display_name))
+                           if (auto key = userDirectoryIndexKey(term, user_id);
+                               key.size() <= maxKeySize)
+                               userDirectoryIndexDb_.put(txn, key, "");
+                   } catch (const nlohmann::json::exception &e) {
+                       nhlog::db()->warn("Skipping user {}: {}", user_id, e.what());
                    }
                }
                cursor.close();
-               inboundMegolmSessionDb.drop(txn, false);
-               megolmSessionDataDb.drop(txn, false);
 
-               for (const auto &[k, v] : inboundSessions) {
-                   inboundMegolmSessionDb.put(txn, k, v);
-               }
-               for (const auto &[k, v] : megolmSessionData) {
-                   megolmSessionDataDb.put(txn, k, v);
-               }
                txn.commit();
-               return true;
-           } catch (std::exception &e) {
-               nhlog::db()->warn(
-                 "Failed to migrate stored megolm session to have no sender key: {}", e.what());
+           } catch (const lmdb::error &e) {
+               nhlog::db()->critical("Failed to rebuild the user directory index: {}", e.what());
                return false;
            }
+
+           nhlog::db()->info("Successfully rebuilt the user directory index.");
+           return true;
+       }},
+      {"2023.02.15",
+       [aggregateStoredRelations]() {
+           // Duplicate reactions of a sender used to collapse into one, add the older ones.
+           return aggregateStoredRelations();
        }},
     };
 
@@ -1456,6 +2648,8 @@ Cache::updateState(const std::string &room, const mtx::responses::StateEvents &s
     auto membersdb   = getMembersDb(txn, room);
     auto eventsDb    = getEventsDb(txn, room);
 
+    pending_room_infos_.clear();
+
     saveStateEvents(txn, statesdb, stateskeydb, membersdb, eventsDb, room, state.events);
 
     RoomInfo updatedInfo;
@@ -1464,26 +2658,130 @@ Cache::updateState(const std::string &room, const mtx::responses::StateEvents &s
         std::string_view data;
         if (roomsDb_.get(txn, room, data)) {
             try {
-                updatedInfo =
-                  nlohmann::json::parse(std::string_view(data.data(), data.size())).get<RoomInfo>();
-            } catch (const nlohmann::json::exception &e) {
-                nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
-                                  room,
-                                  std::string(data.data(), data.size()),
-                                  e.what());
+                updatedInfo = decodeStoredEvent(data).get<RoomInfo>();
+            } catch (const std::exception &e) {
+                nhlog::db()->warn("failed to parse room info: room_id ({}), {}", room, e.what());
             }
         }
     }
 
-    updatedInfo.name       = getRoomName(txn, statesdb, membersdb);
-    updatedInfo.topic      = getRoomTopic(txn, statesdb);
-    updatedInfo.avatar_url = getRoomAvatarUrl(txn, statesdb, membersdb);
-    updatedInfo.version    = getRoomVersion(txn, statesdb);
-    updatedInfo.is_space   = getRoomIsSpace(txn, statesdb);
+    updateRoomInfo(txn, room, updatedInfo, RoomInfoAll);
 
-    roomsDb_.put(txn, room, nlohmann::json(updatedInfo).dump());
+    putRoomInfo(txn, room, updatedInfo);
     updateSpaces(txn, {room}, {room});
+    commitRoomInfos(txn);
+}
+
+uint32_t
+Cache::roomInfoChanges(const mtx::responses::JoinedRoom &room)
+{
+    using namespace mtx::events;
+
+    auto changes = [](const auto &e) -> uint32_t {
+        using T = std::decay_t<decltype(e)>;
+        if constexpr (std::is_same_v<T, StateEvent<state::Name>> ||
+                      std::is_same_v<T, StateEvent<state::CanonicalAlias>>)
+            return RoomInfoName;
+        else if constexpr (std::is_same_v<T, StateEvent<state::Topic>>)
+            return RoomInfoTopic;
+        else if constexpr (std::is_same_v<T, StateEvent<state::Avatar>>)
+            return RoomInfoAvatar;
+        else if constexpr (std::is_same_v<T, StateEvent<state::Create>>)
+            return RoomInfoCreate;
+        else if constexpr (std::is_same_v<T, StateEvent<state::Member>>)
+            // members are used for the name and avatar of rooms without one
+            return RoomInfoName | RoomInfoAvatar | RoomInfoMembers;
+        else if constexpr (std::is_same_v<T, StateEvent<state::JoinRules>>)
+            return RoomInfoJoinRule;
+        else if constexpr (std::is_same_v<T, StateEvent<state::GuestAccess>>)
+            return RoomInfoGuestAccess;
+        else
+            return 0;
+    };
+
+    uint32_t fields = 0;
+    for (const auto &e : room.state.events)
+        fields |= std::visit(changes, e);
+    for (const auto &e : room.timeline.events)
+        fields |= std::visit(changes, e);
+    return fields;
+}
+
+void
+Cache::updateRoomInfo(lmdb::txn &txn, const std::string &room_id, RoomInfo &info, uint32_t fields)
+{
+    if (!fields)
+        return;
+
+    auto statesdb  = getStatesDb(txn, room_id);
+    auto membersdb = getMembersDb(txn, room_id);
+
+    if (fields & RoomInfoName)
+        info.name = getRoomName(txn, statesdb, membersdb);
+    if (fields & RoomInfoTopic)
+        info.topic = getRoomTopic(txn, statesdb);
+    if (fields & RoomInfoAvatar)
+        info.avatar_url = getRoomAvatarUrl(txn, statesdb, membersdb);
+    if (fields & RoomInfoCreate) {
+        info.version  = getRoomVersion(txn, statesdb);
+        info.is_space = getRoomIsSpace(txn, statesdb);
+    }
+    if (fields & RoomInfoMembers)
+        info.member_count = membersdb.size(txn);
+    if (fields & RoomInfoJoinRule)
+        info.join_rule = getRoomJoinRule(txn, statesdb);
+    if (fields & RoomInfoGuestAccess)
+        info.guest_access = getRoomGuestAccess(txn, statesdb);
+}
+
+void
+Cache::putRoomInfo(lmdb::txn &txn, const std::string &room_id, const RoomInfo &info)
+{
+    roomsDb_.put(txn, room_id, encodeStoredEvent(nlohmann::json(info)));
+    pending_room_infos_[room_id] = info;
+}
+
+void
+Cache::commitRoomInfos(lmdb::txn &txn)
+{
+    std::lock_guard<std::mutex> lock(room_infos_mtx_);
+
+    auto changes = std::move(pending_room_infos_);
+    pending_room_infos_.clear();
+
     txn.commit();
+
+    if (!room_infos_loaded_)
+        return;
+
+    for (auto &[room_id, info] : changes) {
+        if (info)
+            room_infos_[room_id] = std::move(*info);
+        else
+            room_infos_.erase(room_id);
+    }
+}
+
+void
+Cache::loadRoomInfos()
+{
+    if (room_infos_loaded_)
+        return;
+
+    auto txn    = ro_txn(env_);
+    auto cursor = lmdb::cursor::open(txn, roomsDb_);
+
+    std::string_view room_id, room_data;
+    while (cursor.get(room_id, room_data, MDB_NEXT)) {
+        try {
+            room_infos_[std::string(room_id)] = decodeStoredEvent(room_data).get<RoomInfo>();
+        } catch (const std::exception &e) {
+            nhlog::db()->warn("failed to parse room info: room_id ({}), {}", room_id, e.what());
+        }
+    }
+    cursor.close();
+
+    room_infos_loaded_ = true;
 }
 
 namespace {
@@ -1528,7 +2826,8 @@ isMessage(const mtx::events::RoomEvent<mtx::events::voip::CallHangUp> &)
 }
 
 void
-Cache::saveState(const mtx::responses::Sync &res)
+Cache::saveState(const mtx::responses::Sync &res,
+                 std::map<std::string, olm::SyncDecryptionBatch> *decrypted)
 {
     using namespace mtx::events;
     auto local_user_id = this->localUserId_.toStdString();
@@ -1537,21 +2836,35 @@ Cache::saveState(const mtx::responses::Sync &res)
 
     auto txn = lmdb::txn::begin(env_);
 
+    // left over by an aborted transaction
+    pending_room_infos_.clear();
+
     setNextBatchToken(txn, res.next_batch);
 
+    // rooms, whose hidden event types changed, need their message order rebuilt
+    bool globalHiddenEventsChanged = false;
+    std::vector<std::string> roomsWithHiddenEventsChanges;
+
     if (!res.account_data.events.empty()) {
         auto accountDataDb = getAccountDataDb(txn, "");
         for (const auto &ev : res.account_data.events)
             std::visit(
-              [&txn, &accountDataDb](const auto &event) {
+              [&txn, &accountDataDb, &globalHiddenEventsChanged](const auto &event) {
                   if constexpr (std::is_same_v<
                                   std::remove_cv_t<std::remove_reference_t<decltype(event)>>,
                                   AccountDataEvent<
                                     mtx::events::account_data::nheko_extensions::HiddenEvents>>) {
                       if (!event.content.hidden_event_types) {
-                          accountDataDb.del(txn, "im.nheko.hidden_events");
+                          if (accountDataDb.del(txn, "im.nheko.hidden_events"))
+                              globalHiddenEventsChanged = true;
                           return;
                       }
+
+                      auto content = nlohmann::json(event).dump();
+                      std::string_view old;
+                      if (!accountDataDb.get(txn, "im.nheko.hidden_events", old) ||
+                          old != content)
+                          globalHiddenEventsChanged = true;
                   }
 
                   auto j = nlohmann::json(event);
@@ -1577,34 +2890,29 @@ Cache::saveState(const mtx::responses::Sync &res)
         saveStateEvents(
           txn, statesdb, stateskeydb, membersdb, eventsDb, room.first, room.second.timeline.events);
 
-        saveTimelineMessages(txn, eventsDb, room.first, room.second.timeline);
+        olm::SyncDecryptionBatch *roomDecrypted = nullptr;
+        if (decrypted)
+            if (auto batch = decrypted->find(room.first); batch != decrypted->end())
+                roomDecrypted = &batch->second;
+        saveTimelineMessages(txn, eventsDb, room.first, room.second.timeline, roomDecrypted);
 
+        // only recalculate what the state events of this sync can have changed
         RoomInfo updatedInfo;
+        uint32_t changedFields = RoomInfoAll;
         {
-            // retrieve the old tags and modification ts
             std::string_view data;
             if (roomsDb_.get(txn, room.first, data)) {
                 try {
-                    RoomInfo tmp = nlohmann::json::parse(std::string_view(data.data(), data.size()))
-                                     .get<RoomInfo>();
-                    updatedInfo.tags = std::move(tmp.tags);
-
-                    updatedInfo.approximate_last_modification_ts =
-                      tmp.approximate_last_modification_ts;
-                } catch (const nlohmann::json::exception &e) {
-                    nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
-                                      room.first,
-                                      std::string(data.data(), data.size()),
-                                      e.what());
+                    updatedInfo   = decodeStoredEvent(data).get<RoomInfo>();
+                    changedFields = roomInfoChanges(room.second);
+                } catch (const std::exception &e) {
+                    nhlog::db()->warn(
+                      "failed to parse room info: room_id ({}), {}", room.first, e.what());
                 }
             }
         }
 
-        updatedInfo.name       = getRoomName(txn, statesdb, membersdb);
-        updatedInfo.topic      = getRoomTopic(txn, statesdb);
-        updatedInfo.avatar_url = getRoomAvatarUrl(txn, statesdb, membersdb);
-        updatedInfo.version    = getRoomVersion(txn, statesdb);
-        updatedInfo.is_space   = getRoomIsSpace(txn, statesdb);
+        updateRoomInfo(txn, room.first, updatedInfo, changedFields);
 
         updatedInfo.notification_count = room.second.unread_notifications.notification_count;
         updatedInfo.highlight_count    = room.second.unread_notifications.highlight_count;
@@ -1647,17 +2955,25 @@ Cache::saveState(const mtx::responses::Sync &res)
         if (!room.second.account_data.events.empty()) {
             auto accountDataDb = getAccountDataDb(txn, room.first);
 
+            bool hiddenEventsChanged = false;
             for (const auto &evt : room.second.account_data.events) {
                 std::visit(
-                  [&txn, &accountDataDb](const auto &event) {
+                  [&txn, &accountDataDb, &hiddenEventsChanged](const auto &event) {
                       if constexpr (std::is_same_v<
                                       std::remove_cv_t<std::remove_reference_t<decltype(event)>>,
                                       AccountDataEvent<mtx::events::account_data::nheko_extensions::
                                                          HiddenEvents>>) {
                           if (!event.content.hidden_event_types) {
-                              accountDataDb.del(txn, "im.nheko.hidden_events");
+                              if (accountDataDb.del(txn, "im.nheko.hidden_events"))
+                                  hiddenEventsChanged = true;
                               return;
                           }
+
+                          auto content = nlohmann::json(event).dump();
+                          std::string_view old;
+                          if (!accountDataDb.get(txn, "im.nheko.hidden_events", old) ||
+                              old != content)
+                              hiddenEventsChanged = true;
                       }
                       auto j = nlohmann::json(event);
                       accountDataDb.put(txn, j["type"].get<std::string>(), j.dump());
@@ -1680,6 +2996,9 @@ Cache::saveState(const mtx::responses::Sync &res)
                                             QString::fromStdString(fr->content.event_id));
                 }
             }
+
+            if (hiddenEventsChanged)
+                roomsWithHiddenEventsChanges.push_back(room.first);
         }
 
         for (const auto &e : room.second.timeline.events) {
@@ -1689,7 +3008,7 @@ Cache::saveState(const mtx::responses::Sync &res)
               std::visit([](const auto &e) -> uint64_t { return e.origin_server_ts; }, e);
         }
 
-        roomsDb_.put(txn, room.first, nlohmann::json(updatedInfo).dump());
+        putRoomInfo(txn, room.first, updatedInfo);
 
         for (const auto &e : room.second.ephemeral.events) {
             if (auto receiptsEv =
@@ -1729,7 +3048,18 @@ Cache::saveState(const mtx::responses::Sync &res)
 
     updateSpaces(txn, spaces_with_updates, std::move(rooms_with_space_updates));
 
-    txn.commit();
+    std::vector<std::string> reclassifiedRooms;
+    for (const auto &room_id :
+         globalHiddenEventsChanged ? getRoomIds(txn) : roomsWithHiddenEventsChanges)
+        if (reclassifyHiddenEvents(txn, room_id))
+            reclassifiedRooms.push_back(room_id);
+
+    commitRoomInfos(txn);
+
+    registerPendingRoomDbis();
+
+    for (const auto &room_id : reclassifiedRooms)
+        emit hiddenEventsReclassified(QString::fromStdString(room_id));
 
     std::map<QString, bool> readStatus;
 
@@ -1862,29 +3192,13 @@ Cache::roomsWithStateUpdates(const mtx::responses::Sync &res)
 RoomInfo
 Cache::singleRoomInfo(const std::string &room_id)
 {
-    auto txn = ro_txn(env_);
-
     try {
-        auto statesdb = getStatesDb(txn, room_id);
-
-        std::string_view data;
+        std::lock_guard<std::mutex> lock(room_infos_mtx_);
+        loadRoomInfos();
 
         // Check if the room is joined.
-        if (roomsDb_.get(txn, room_id, data)) {
-            try {
-                RoomInfo tmp     = nlohmann::json::parse(data).get<RoomInfo>();
-                tmp.member_count = getMembersDb(txn, room_id).size(txn);
-                tmp.join_rule    = getRoomJoinRule(txn, statesdb);
-                tmp.guest_access = getRoomGuestAccess(txn, statesdb);
-
-                return tmp;
-            } catch (const nlohmann::json::exception &e) {
-                nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
-                                  room_id,
-                                  std::string(data.data(), data.size()),
-                                  e.what());
-            }
-        }
+        if (auto info = room_infos_.find(room_id); info != room_infos_.end())
+            return info->second;
     } catch (const lmdb::error &e) {
         nhlog::db()->warn("failed to read room info from db: room_id ({}), {}", room_id, e.what());
     }
@@ -1895,25 +3209,22 @@ void
 Cache::updateLastMessageTimestamp(const std::string &room_id, uint64_t ts)
 {
     auto txn = lmdb::txn::begin(env_);
+    pending_room_infos_.clear();
 
     try {
-        auto statesdb = getStatesDb(txn, room_id);
-
         std::string_view data;
 
         // Check if the room is joined.
         if (roomsDb_.get(txn, room_id, data)) {
             try {
-                RoomInfo tmp                         = nlohmann::json::parse(data).get<RoomInfo>();
+                RoomInfo tmp                         = decodeStoredEvent(data).get<RoomInfo>();
                 tmp.approximate_last_modification_ts = ts;
-                roomsDb_.put(txn, room_id, nlohmann::json(tmp).dump());
-                txn.commit();
+                putRoomInfo(txn, room_id, tmp);
+                commitRoomInfos(txn);
                 return;
-            } catch (const nlohmann::json::exception &e) {
-                nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
-                                  room_id,
-                                  std::string(data.data(), data.size()),
-                                  e.what());
+            } catch (const std::exception &e) {
+                nhlog::db()->warn(
+                  "failed to parse room info: room_id ({}), {}", room_id, e.what());
             }
         }
     } catch (const lmdb::error &e) {
@@ -1925,50 +3236,49 @@ QMap<QString, RoomInfo>
 Cache::getRoomInfo(const std::vector<std::string> &rooms)
 {
     QMap<QString, RoomInfo> room_info;
+    std::vector<std::string> other_rooms;
 
-    // TODO This should be read only.
-    auto txn = lmdb::txn::begin(env_);
+    {
+        std::lock_guard<std::mutex> lock(room_infos_mtx_);
+        loadRoomInfos();
+
+        for (const auto &room : rooms) {
+            // Check if the room is joined.
+            if (auto info = room_infos_.find(room); info != room_infos_.end())
+                room_info.insert(QString::fromStdString(room), info->second);
+            else
+                other_rooms.push_back(room);
+        }
+    }
 
-    for (const auto &room : rooms) {
+    if (other_rooms.empty())
+        return room_info;
+
+    auto txn = ro_txn(env_);
+
+    for (const auto &room : other_rooms) {
         std::string_view data;
-        auto statesdb = getStatesDb(txn, room);
 
-        // Check if the room is joined.
-        if (roomsDb_.get(txn, room, data)) {
+        // Check if the room is an invite.
+        if (invitesDb_.get(txn, room, data)) {
             try {
-                RoomInfo tmp     = nlohmann::json::parse(data).get<RoomInfo>();
-                tmp.member_count = getMembersDb(txn, room).size(txn);
-                tmp.join_rule    = getRoomJoinRule(txn, statesdb);
-                tmp.guest_access = getRoomGuestAccess(txn, statesdb);
+                RoomInfo tmp     = nlohmann::json::parse(std::string_view(data)).get<RoomInfo>();
+                tmp.member_count = getInviteMembersDb(txn, room).size(txn);
 
                 room_info.insert(QString::fromStdString(room), std::move(tmp));
             } catch (const nlohmann::json::exception &e) {
-                nhlog::db()->warn("failed to parse room info: room_id ({}), {}: {}",
+                nhlog::db()->warn("failed to parse room info for invite: "
+                                  "room_id ({}), {}: {}",
                                   room,
                                   std::string(data.data(), data.size()),
                                   e.what());
-            }
-        } else {
-            // Check if the room is an invite.
-            if (invitesDb_.get(txn, room, data)) {
-                try {
-                    RoomInfo tmp = nlohmann::json::parse(std::string_view(data)).get<RoomInfo>();
-                    tmp.member_count = getInviteMembersDb(txn, room).size(txn);
-
-                    room_info.insert(QString::fromStdString(room), std::move(tmp));
-                } catch (const nlohmann::json::exception &e) {
-                    nhlog::db()->warn("failed to parse room info for invite: "
-                                      "room_id ({}), {}: {}",
-                                      room,
-                                      std::string(data.data(), data.size()),
-                                      e.what());
-                }
+            } catch (const lmdb::error &e) {
+                nhlog::db()->warn(
+                  "failed to read invite members: room_id ({}), {}", room, e.what());
             }
         }
     }
 
-    txn.commit();
-
     return room_info;
 }
 
@@ -2066,7 +3376,7 @@ Cache::getTimelineMessages(lmdb::txn &txn, const std::string &room_id, uint64_t
 
         mtx::events::collections::TimelineEvent te;
         try {
-            from_json(nlohmann::json::parse(event), te);
+            from_json(decodeStoredEvent(event), te);
         } catch (std::exception &e) {
             nhlog::db()->error("Failed to parse message from cache {}", e.what());
             continue;
@@ -2096,7 +3406,7 @@ Cache::getEvent(const std::string &room_id, const std::string &event_id)
 
     mtx::events::collections::TimelineEvent te;
     try {
-        from_json(nlohmann::json::parse(event), te);
+        from_json(decodeStoredEvent(event), te);
     } catch (std::exception &e) {
         nhlog::db()->error("Failed to parse message from cache {}", e.what());
         return std::nullopt;
@@ -2112,7 +3422,7 @@ Cache::storeEvent(const std::string &room_id,
     auto txn        = lmdb::txn::begin(env_);
     auto eventsDb   = getEventsDb(txn, room_id);
     auto event_json = mtx::accessors::serialize_event(event.data);
-    eventsDb.put(txn, event_id, event_json.dump());
+    eventsDb.put(txn, event_id, encodeStoredEvent(event_json));
     txn.commit();
 }
 
@@ -2124,7 +3434,7 @@ Cache::replaceEvent(const std::string &room_id,
     auto txn         = lmdb::txn::begin(env_);
     auto eventsDb    = getEventsDb(txn, room_id);
     auto relationsDb = getRelationsDb(txn, room_id);
-    auto event_json  = mtx::accessors::serialize_event(event.data).dump();
+    auto event_json  = encodeStoredEvent(mtx::accessors::serialize_event(event.data));
 
     {
         eventsDb.del(txn, event_id);
@@ -2132,6 +3442,9 @@ Cache::replaceEvent(const std::string &room_id,
         for (const auto &relation : mtx::accessors::relations(event.data).relations) {
             relationsDb.put(txn, relation.event_id, event_id);
         }
+
+        auto aggregationsDb = getRelationAggregationsDb(txn, room_id);
+        aggregateRelations(txn, aggregationsDb, event.data);
     }
 
     txn.commit();
@@ -2168,6 +3481,155 @@ Cache::relatedEvents(const std::string &room_id, const std::string &event_id)
     return related_ids;
 }
 
+namespace {
+RelationAggregation
+readRelationAggregation(lmdb::txn &txn, lmdb::dbi &aggregationsDb, std::string_view event_id)
+{
+    std::string_view data;
+    if (!aggregationsDb.get(txn, event_id, data))
+        return {};
+
+    try {
+        return Cache::decodeStoredEvent(data).get<RelationAggregation>();
+    } catch (const std::exception &e) {
+        nhlog::db()->warn("failed to parse relation aggregation of {}: {}", event_id, e.what());
+        return {};
+    }
+}
+
+void
+writeRelationAggregation(lmdb::txn &txn,
+                         lmdb::dbi &aggregationsDb,
+                         std::string_view event_id,
+                         const RelationAggregation &aggregation)
+{
+    if (aggregation.empty())
+        aggregationsDb.del(txn, event_id);
+    else
+        aggregationsDb.put(txn, event_id, Cache::encodeStoredEvent(nlohmann::json(aggregation)));
+}
+}
+
+void
+Cache::aggregateRelations(lmdb::txn &txn,
+                          lmdb::dbi &aggregationsDb,
+                          const mtx::events::collections::TimelineEvents &e,
+                          std::string_view replaced_id,
+                          bool backfilled)
+{
+    using mtx::common::RelationType;
+
+    auto event_id = mtx::accessors::event_id(e);
+    auto sender   = mtx::accessors::sender(e);
+    auto matches  = [&event_id, replaced_id](const std::string &id) {
+        return id == event_id || (!replaced_id.empty() && id == replaced_id);
+    };
+
+    for (const auto &r : mtx::accessors::relations(e).relations) {
+        if (r.event_id.empty() || r.event_id == event_id)
+            continue;
+
+        bool is_edit     = r.rel_type == RelationType::Replace;
+        bool is_reaction = r.rel_type == RelationType::Annotation && r.key;
+        if (!is_edit && !is_reaction)
+            continue;
+
+        auto aggregation = readRelationAggregation(txn, aggregationsDb, r.event_id);
+
+        if (is_edit) {
+            auto &edits = aggregation.edits;
+            auto edit   = std::find_if(edits.begin(), edits.end(), [&matches](const auto &edit) {
+                return matches(edit.event_id);
+            });
+
+            if (edit != edits.end())
+                edit->event_id = event_id;
+            else
+                edits.insert(backfilled ? edits.begin() : edits.end(), {event_id, sender});
+        } else {
+            auto &all_reactions = aggregation.reactions;
+            auto reactions      = std::find_if(
+              all_reactions.begin(), all_reactions.end(), [&r](const auto &reactions) {
+                  return reactions.key == *r.key;
+              });
+            if (reactions == all_reactions.end())
+                reactions = all_reactions.insert(
+                  backfilled ? all_reactions.begin() : all_reactions.end(), {*r.key, {}});
+
+            // Every reaction is kept, even a duplicate from the same sender, so that redacting
+            // one of them leaves the others.
+            auto &senders = reactions->senders;
+            auto reaction =
+              std::find_if(senders.begin(), senders.end(), [&matches](const auto &s) {
+                  return matches(s.second);
+              });
+            if (reaction == senders.end())
+                senders.insert(backfilled ? senders.begin() : senders.end(), {sender, event_id});
+            else
+                reaction->second = event_id;
+        }
+
+        writeRelationAggregation(txn, aggregationsDb, r.event_id, aggregation);
+    }
+}
+
+void
+Cache::removeAggregatedRelations(lmdb::txn &txn,
+                                 lmdb::dbi &aggregationsDb,
+                                 const mtx::common::Relations &relations,
+                                 const std::string &event_id)
+{
+    for (const auto &r : relations.relations) {
+        if (r.event_id.empty())
+            continue;
+
+        auto aggregation = readRelationAggregation(txn, aggregationsDb, r.event_id);
+        if (aggregation.empty())
+            continue;
+
+        auto &edits = aggregation.edits;
+        edits.erase(std::remove_if(edits.begin(),
+                                   edits.end(),
+                                   [&event_id](const auto &edit) {
+                                       return edit.event_id == event_id;
+                                   }),
+                    edits.end());
+
+        auto &all_reactions = aggregation.reactions;
+        for (auto &reactions : all_reactions) {
+            auto &senders = reactions.senders;
+            senders.erase(std::remove_if(senders.begin(),
+                                         senders.end(),
+                                         [&event_id](const auto &s) {
+                                             return s.second == event_id;
+                                         }),
+                          senders.end());
+        }
+        all_reactions.erase(std::remove_if(all_reactions.begin(),
+                                           all_reactions.end(),
+                                           [](const auto &reactions) {
+                                               return reactions.senders.empty();
+                                           }),
+                            all_reactions.end());
+
+        writeRelationAggregation(txn, aggregationsDb, r.event_id, aggregation);
+    }
+}
+
+RelationAggregation
+Cache::relationAggregation(const std::string &room_id, const std::string &event_id)
+{
+    auto txn = ro_txn(env_);
+
+    try {
+        auto aggregationsDb = getRelationAggregationsDb(txn, room_id);
+        return readRelationAggregation(txn, aggregationsDb, event_id);
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("relation aggregation error: {}", e.what());
+        return {};
+    }
+}
+
 size_t
 Cache::memberCount(const std::string &room_id)
 {
@@ -2180,21 +3642,21 @@ Cache::roomInfo(bool withInvites)
 {
     QMap<QString, RoomInfo> result;
 
-    auto txn = ro_txn(env_);
-
-    std::string_view room_id;
-    std::string_view room_data;
-
     // Gather info about the joined rooms.
-    auto roomsCursor = lmdb::cursor::open(txn, roomsDb_);
-    while (roomsCursor.get(room_id, room_data, MDB_NEXT)) {
-        RoomInfo tmp     = nlohmann::json::parse(std::move(room_data)).get<RoomInfo>();
-        tmp.member_count = getMembersDb(txn, std::string(room_id)).size(txn);
-        result.insert(QString::fromStdString(std::string(room_id)), std::move(tmp));
+    {
+        std::lock_guard<std::mutex> lock(room_infos_mtx_);
+        loadRoomInfos();
+
+        for (const auto &[room_id, info] : room_infos_)
+            result.insert(QString::fromStdString(room_id), info);
     }
-    roomsCursor.close();
 
     if (withInvites) {
+        auto txn = ro_txn(env_);
+
+        std::string_view room_id;
+        std::string_view room_data;
+
         // Gather info about the invites.
         auto invitesCursor = lmdb::cursor::open(txn, invitesDb_);
         while (invitesCursor.get(room_id, room_data, MDB_NEXT)) {
@@ -2349,9 +3811,14 @@ Cache::lastInvisibleEventAfter(const std::string &room_id, std::string_view even
         auto cursor = lmdb::cursor::open(txn, eventOrderDb);
         cursor.get(indexVal, MDB_SET);
         while (cursor.get(indexVal, event_id, MDB_NEXT)) {
-            std::string evId = nlohmann::json::parse(event_id)["event_id"].get<std::string>();
+            auto orderEntry  = nlohmann::json::parse(event_id);
+            std::string evId = orderEntry["event_id"].get<std::string>();
+
+            // classified entries know if they are hidden, older ones need a lookup
             std::string_view temp;
-            if (timelineDb.get(txn, evId, temp)) {
+            bool visible = orderEntry.contains("type") ? !orderEntry.value("hidden", false)
+                                                       : timelineDb.get(txn, evId, temp);
+            if (visible) {
                 return std::pair{prevIdx, std::string(prevId)};
             } else {
                 prevIdx = lmdb::from_sv<uint64_t>(indexVal);
@@ -2413,6 +3880,34 @@ Cache::getTimelineEventId(const std::string &room_id, uint64_t index)
     return std::string(val);
 }
 
+std::optional<mtx::events::EventType>
+Cache::getTimelineEventType(const std::string &room_id, uint64_t index)
+{
+    auto txn = ro_txn(env_);
+
+    try {
+        auto order2msgDb = getOrderToMessageDb(txn, room_id);
+        auto evToOrderDb = getEventToOrderDb(txn, room_id);
+        auto orderDb     = getEventOrderDb(txn, room_id);
+
+        std::string_view event_id, order, orderEntry;
+        if (!order2msgDb.get(txn, lmdb::to_sv(index), event_id) ||
+            !evToOrderDb.get(txn, event_id, order) || !orderDb.get(txn, order, orderEntry))
+            return {};
+
+        auto obj = nlohmann::json::parse(orderEntry);
+        if (!obj.contains("type"))
+            return {};
+        return mtx::events::getEventType(obj["type"].get<std::string>());
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error(
+          "Can't open db for room '{}', probably doesn't exist yet. ({})", room_id, e.what());
+    } catch (const nlohmann::json::exception &e) {
+        nhlog::db()->warn("invalid order entry in {}: {}", room_id, e.what());
+    }
+    return {};
+}
+
 QMap<QString, RoomInfo>
 Cache::invites()
 {
@@ -2877,6 +4372,115 @@ Cache::joinedRooms()
     return room_ids;
 }
 
+void
+Cache::addToUserDirectory(lmdb::txn &txn,
+                          const std::string &user_id,
+                          const MemberInfo &member,
+                          bool joinedRoom)
+{
+    UserDirectoryEntry entry;
+    std::string_view data;
+    bool known = userDirectoryDb_.get(txn, user_id, data);
+    if (known)
+        entry = nlohmann::json::parse(data).get<UserDirectoryEntry>();
+
+    if (!known || entry.display_name != member.name) {
+        // user ids are not bounded as strictly as the terms, so skip keys LMDB can't store
+        const auto maxKeySize = static_cast<std::size_t>(mdb_env_get_maxkeysize(env_.handle()));
+
+        if (known)
+            for (const auto &term : userDirectoryTerms(user_id, entry.display_name))
+                if (auto key = userDirectoryIndexKey(term, user_id); key.size() <= maxKeySize)
+                    userDirectoryIndexDb_.del(txn, key);
+        for (const auto &term : userDirectoryTerms(user_id, member.name))
+            if (auto key = userDirectoryIndexKey(term, user_id); key.size() <= maxKeySize)
+                userDirectoryIndexDb_.put(txn, key, "");
+    }
+
+    entry.display_name = member.name;
+    entry.avatar_url   = member.avatar_url;
+    if (joinedRoom)
+        entry.shared_rooms++;
+    userDirectoryDb_.put(txn, user_id, nlohmann::json(entry).dump());
+}
+
+void
+Cache::removeFromUserDirectory(lmdb::txn &txn, const std::string &user_id)
+{
+    std::string_view data;
+    if (!userDirectoryDb_.get(txn, user_id, data))
+        return;
+
+    auto entry = nlohmann::json::parse(data).get<UserDirectoryEntry>();
+    if (entry.shared_rooms > 1) {
+        entry.shared_rooms--;
+        userDirectoryDb_.put(txn, user_id, nlohmann::json(entry).dump());
+        return;
+    }
+
+    const auto maxKeySize = static_cast<std::size_t>(mdb_env_get_maxkeysize(env_.handle()));
+    for (const auto &term : userDirectoryTerms(user_id, entry.display_name))
+        if (auto key = userDirectoryIndexKey(term, user_id); key.size() <= maxKeySize)
+            userDirectoryIndexDb_.del(txn, key);
+    userDirectoryDb_.del(txn, user_id);
+}
+
+std::vector<UserDirectoryEntry>
+Cache::searchUserDirectory(const std::string &prefix, std::size_t limit)
+{
+    std::vector<UserDirectoryEntry> users;
+    if (limit == 0)
+        return users;
+
+    auto term = QString::fromStdString(prefix).toLower().toStdString();
+    if (!term.empty() && term.front() == '@')
+        term.erase(0, 1);
+    // the index only knows the beginning of long terms
+    term = userDirectoryTerm(std::move(term));
+
+    // Matches are visited in key order, so collect more than asked for and rank those. With
+    // more matches than that, e.g. for an empty prefix, the ranking only covers the first
+    // MAX_USER_DIRECTORY_CANDIDATES of them in key order.
+    const auto candidates = std::max(limit, MAX_USER_DIRECTORY_CANDIDATES);
+
+    try {
+        auto txn    = ro_txn(env_);
+        auto cursor = lmdb::cursor::open(txn, userDirectoryIndexDb_);
+
+        // a user may match with several terms
+        std::set<std::string, std::less<>> seen;
+        std::string_view key = term, ignored;
+        bool found = cursor.get(key, ignored, term.empty() ? MDB_FIRST : MDB_SET_RANGE);
+        for (; found && users.size() < candidates;
+             found = cursor.get(key, ignored, MDB_NEXT)) {
+            if (key.substr(0, term.size()) != term)
+                break;
+
+            auto user_id = key.substr(key.rfind('\0') + 1);
+            if (seen.count(user_id))
+                continue;
+            seen.emplace(user_id);
+
+            std::string_view data;
+            if (!userDirectoryDb_.get(txn, user_id, data))
+                continue;
+
+            auto entry    = nlohmann::json::parse(data).get<UserDirectoryEntry>();
+            entry.user_id = std::string(user_id);
+            users.push_back(std::move(entry));
+        }
+    } catch (const std::exception &e) {
+        nhlog::db()->warn("Failed to search the user directory for {}: {}", prefix, e.what());
+    }
+
+    std::stable_sort(users.begin(), users.end(), [](const auto &a, const auto &b) {
+        return a.shared_rooms > b.shared_rooms;
+    });
+    if (users.size() > limit)
+        users.resize(limit);
+    return users;
+}
+
 std::optional<MemberInfo>
 Cache::getMember(const std::string &room_id, const std::string &user_id)
 {
@@ -3011,19 +4615,60 @@ void
 Cache::savePendingMessage(const std::string &room_id,
                           const mtx::events::collections::TimelineEvent &message)
 {
-    auto txn      = lmdb::txn::begin(env_);
-    auto eventsDb = getEventsDb(txn, room_id);
+    auto txn      = lmdb::txn::begin(env_);
+    auto eventsDb = getEventsDb(txn, room_id);
+
+    mtx::responses::Timeline timeline;
+    timeline.events.push_back(message.data);
+    saveTimelineMessages(txn, eventsDb, room_id, timeline);
+
+    auto pending      = getPendingMessagesDb(txn, room_id);
+    auto pendingIndex = getPendingIndexDb(txn, room_id);
+
+    // append to the queue. Older entries are keyed by their timestamp, so continuing after the
+    // last key keeps the order.
+    uint64_t seq = 0;
+    {
+        auto pendingCursor = lmdb::cursor::open(txn, pending);
+        std::string_view lastSeq, unused;
+        if (pendingCursor.get(lastSeq, unused, MDB_LAST))
+            seq = lmdb::from_sv<uint64_t>(lastSeq) + 1;
+        auto txn_id = mtx::accessors::event_id(message.data);
+        pendingCursor.put(lmdb::to_sv(seq), txn_id, MDB_APPEND);
+        pendingIndex.put(txn, txn_id, lmdb::to_sv(seq));
+    }
+
+    txn.commit();
+}
+
+bool
+Cache::removePending(lmdb::txn &txn, const std::string &room_id, std::string_view txn_id)
+{
+    auto pending      = getPendingMessagesDb(txn, room_id);
+    auto pendingIndex = getPendingIndexDb(txn, room_id);
 
-    mtx::responses::Timeline timeline;
-    timeline.events.push_back(message.data);
-    saveTimelineMessages(txn, eventsDb, room_id, timeline);
+    std::string_view seqVal;
+    if (!pendingIndex.get(txn, txn_id, seqVal))
+        return false;
 
-    auto pending = getPendingMessagesDb(txn, room_id);
+    auto seq = lmdb::from_sv<uint64_t>(seqVal);
+    pending.del(txn, lmdb::to_sv(seq));
+    pendingIndex.del(txn, txn_id);
+    return true;
+}
 
-    int64_t now = QDateTime::currentMSecsSinceEpoch();
-    pending.put(txn, lmdb::to_sv(now), mtx::accessors::event_id(message.data));
+bool
+Cache::isPendingMessage(const std::string &room_id, std::string_view txn_id)
+{
+    auto txn = ro_txn(env_);
 
-    txn.commit();
+    try {
+        std::string_view unused;
+        return getPendingIndexDb(txn, room_id).get(txn, txn_id, unused);
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("pending index error: {}", e.what());
+        return false;
+    }
 }
 std::vector<std::string>
 Cache::pendingEvents(const std::string &room_id)
@@ -3051,55 +4696,89 @@ Cache::pendingEvents(const std::string &room_id)
 std::optional<mtx::events::collections::TimelineEvent>
 Cache::firstPendingMessage(const std::string &room_id)
 {
-    auto txn     = lmdb::txn::begin(env_);
-    auto pending = getPendingMessagesDb(txn, room_id);
+    auto txn          = lmdb::txn::begin(env_);
+    auto pending      = getPendingMessagesDb(txn, room_id);
+    auto pendingIndex = getPendingIndexDb(txn, room_id);
+    auto eventsDb     = getEventsDb(txn, room_id);
 
     {
         auto pendingCursor = lmdb::cursor::open(txn, pending);
-        std::string_view tsIgnored, pendingTxn;
-        while (pendingCursor.get(tsIgnored, pendingTxn, MDB_NEXT)) {
-            auto eventsDb = getEventsDb(txn, room_id);
+        std::string_view seqIgnored, pendingTxn;
+        while (pendingCursor.get(seqIgnored, pendingTxn, MDB_FIRST)) {
+            std::string_view event;
+            if (eventsDb.get(txn, pendingTxn, event)) {
+                try {
+                    mtx::events::collections::TimelineEvent te;
+                    from_json(decodeStoredEvent(event), te);
+
+                    pendingCursor.close();
+                    txn.commit();
+                    return te;
+                } catch (std::exception &e) {
+                    nhlog::db()->error("Failed to parse message from cache {}", e.what());
+                }
+            }
+
+            pendingIndex.del(txn, pendingTxn);
+            lmdb::cursor_del(pendingCursor);
+        }
+    }
+
+    txn.commit();
+
+    return std::nullopt;
+}
+
+std::vector<mtx::events::collections::TimelineEvent>
+Cache::pendingMessages(const std::string &room_id, size_t limit)
+{
+    std::vector<mtx::events::collections::TimelineEvent> messages;
+    std::vector<std::string> stale;
+
+    try {
+        auto txn      = ro_txn(env_);
+        auto pending  = getPendingMessagesDb(txn, room_id);
+        auto eventsDb = getEventsDb(txn, room_id);
+
+        auto pendingCursor = lmdb::cursor::open(txn, pending);
+        std::string_view seqIgnored, pendingTxn;
+        bool first = true;
+        while (messages.size() < limit &&
+               pendingCursor.get(seqIgnored, pendingTxn, first ? MDB_FIRST : MDB_NEXT)) {
+            first = false;
+
             std::string_view event;
             if (!eventsDb.get(txn, pendingTxn, event)) {
-                pending.del(txn, tsIgnored, pendingTxn);
+                stale.emplace_back(pendingTxn);
                 continue;
             }
 
             try {
                 mtx::events::collections::TimelineEvent te;
-                from_json(nlohmann::json::parse(event), te);
-
-                pendingCursor.close();
-                txn.commit();
-                return te;
+                from_json(decodeStoredEvent(event), te);
+                messages.push_back(std::move(te));
             } catch (std::exception &e) {
                 nhlog::db()->error("Failed to parse message from cache {}", e.what());
-                pending.del(txn, tsIgnored, pendingTxn);
-                continue;
             }
         }
+    } catch (const lmdb::error &) {
     }
 
-    txn.commit();
+    if (!stale.empty()) {
+        auto txn = lmdb::txn::begin(env_);
+        for (const auto &txn_id : stale)
+            removePending(txn, room_id, txn_id);
+        txn.commit();
+    }
 
-    return std::nullopt;
+    return messages;
 }
 
 void
 Cache::removePendingStatus(const std::string &room_id, const std::string &txn_id)
 {
-    auto txn     = lmdb::txn::begin(env_);
-    auto pending = getPendingMessagesDb(txn, room_id);
-
-    {
-        auto pendingCursor = lmdb::cursor::open(txn, pending);
-        std::string_view tsIgnored, pendingTxn;
-        while (pendingCursor.get(tsIgnored, pendingTxn, MDB_NEXT)) {
-            if (std::string_view(pendingTxn.data(), pendingTxn.size()) == txn_id)
-                lmdb::cursor_del(pendingCursor);
-        }
-    }
-
+    auto txn = lmdb::txn::begin(env_);
+    removePending(txn, room_id, txn_id);
     txn.commit();
 }
 
@@ -3107,25 +4786,30 @@ void
 Cache::saveTimelineMessages(lmdb::txn &txn,
                             lmdb::dbi &eventsDb,
                             const std::string &room_id,
-                            const mtx::responses::Timeline &res)
+                            const mtx::responses::Timeline &res,
+                            olm::SyncDecryptionBatch *decrypted)
 {
     if (res.events.empty())
         return;
 
-    auto relationsDb = getRelationsDb(txn, room_id);
+    auto relationsDb    = getRelationsDb(txn, room_id);
+    auto aggregationsDb = getRelationAggregationsDb(txn, room_id);
 
     auto orderDb     = getEventOrderDb(txn, room_id);
     auto evToOrderDb = getEventToOrderDb(txn, room_id);
     auto msg2orderDb = getMessageToOrderDb(txn, room_id);
     auto order2msgDb = getOrderToMessageDb(txn, room_id);
-    auto pending     = getPendingMessagesDb(txn, room_id);
 
     if (res.limited) {
+        auto pending      = getPendingMessagesDb(txn, room_id);
+        auto pendingIndex = getPendingIndexDb(txn, room_id);
+
         lmdb::dbi_drop(txn, orderDb, false);
         lmdb::dbi_drop(txn, evToOrderDb, false);
         lmdb::dbi_drop(txn, msg2orderDb, false);
         lmdb::dbi_drop(txn, order2msgDb, false);
-        lmdb::dbi_drop(txn, pending, true);
+        lmdb::dbi_drop(txn, pending, false);
+        lmdb::dbi_drop(txn, pendingIndex, false);
     }
 
     using namespace mtx::events;
@@ -3144,6 +4828,8 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
         msgIndex = lmdb::from_sv<uint64_t>(indexVal);
     }
 
+    auto hiddenTypes = hiddenEventTypes(txn, room_id);
+
     bool first = true;
     for (const auto &e : res.events) {
         auto event  = mtx::accessors::serialize_event(e);
@@ -3164,9 +4850,21 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 
         std::string_view txn_order;
         if (!txn_id.empty() && evToOrderDb.get(txn, txn_id, txn_order)) {
-            eventsDb.put(txn, event_id, event.dump());
+            eventsDb.put(txn, event_id, encodeStoredEvent(event));
             eventsDb.del(txn, txn_id);
 
+            // the local echo was already classified
+            std::string_view pendingEntry;
+            if (orderDb.get(txn, txn_order, pendingEntry)) {
+                try {
+                    auto pendingObj = nlohmann::json::parse(pendingEntry);
+                    for (const auto key : {"type", "hidden", "edit"})
+                        if (pendingObj.contains(key))
+                            orderEntry[key] = pendingObj[key];
+                } catch (const std::exception &) {
+                }
+            }
+
             std::string_view msg_txn_order;
             if (msg2orderDb.get(txn, txn_id, msg_txn_order)) {
                 order2msgDb.put(txn, msg_txn_order, event_id);
@@ -3187,13 +4885,9 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                     }
                 }
             }
+            aggregateRelations(txn, aggregationsDb, e, txn_id);
 
-            auto pendingCursor = lmdb::cursor::open(txn, pending);
-            std::string_view tsIgnored, pendingTxn;
-            while (pendingCursor.get(tsIgnored, pendingTxn, MDB_NEXT)) {
-                if (std::string_view(pendingTxn.data(), pendingTxn.size()) == txn_id)
-                    lmdb::cursor_del(pendingCursor);
-            }
+            removePending(txn, room_id, txn_id);
         } else if (auto redaction =
                      std::get_if<mtx::events::RedactionEvent<mtx::events::msg::Redaction>>(&e)) {
             if (redaction->redacts.empty())
@@ -3206,8 +4900,10 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 
             mtx::events::collections::TimelineEvent te;
             try {
-                from_json(nlohmann::json::parse(std::string_view(oldEvent.data(), oldEvent.size())),
-                          te);
+                from_json(decodeStoredEvent(oldEvent), te);
+                removeAggregatedRelations(
+                  txn, aggregationsDb, mtx::accessors::relations(te.data), redaction->redacts);
+
                 // overwrite the content and add redation data
                 std::visit(
                   [redaction](auto &ev) {
@@ -3223,8 +4919,8 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                 continue;
             }
 
-            eventsDb.put(txn, redaction->redacts, event.dump());
-            eventsDb.put(txn, redaction->event_id, nlohmann::json(*redaction).dump());
+            eventsDb.put(txn, redaction->redacts, encodeStoredEvent(event));
+            eventsDb.put(txn, redaction->event_id, encodeStoredEvent(nlohmann::json(*redaction)));
         } else {
             first = false;
 
@@ -3235,13 +4931,14 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
             if (!evToOrderDb.get(txn, event_id, unused_read)) {
                 ++index;
 
+                bool hidden = classifyEvent(orderEntry, e, room_id, hiddenTypes, decrypted);
+
                 nhlog::db()->debug("saving '{}'", orderEntry.dump());
 
                 cursor.put(lmdb::to_sv(index), orderEntry.dump(), MDB_APPEND);
                 evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
 
-                // TODO(Nico): Allow blacklisting more event types in UI
-                if (!isHiddenEvent(txn, e, room_id)) {
+                if (!hidden) {
                     ++msgIndex;
                     msgCursor.put(lmdb::to_sv(msgIndex), event_id, MDB_APPEND);
 
@@ -3250,7 +4947,7 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
             } else {
                 nhlog::db()->warn("duplicate event '{}'", orderEntry.dump());
             }
-            eventsDb.put(txn, event_id, event.dump());
+            eventsDb.put(txn, event_id, encodeStoredEvent(event));
 
             auto relations = mtx::accessors::relations(e);
             if (!relations.relations.empty()) {
@@ -3260,6 +4957,7 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
                     }
                 }
             }
+            aggregateRelations(txn, aggregationsDb, e);
         }
     }
 }
@@ -3267,9 +4965,10 @@ Cache::saveTimelineMessages(lmdb::txn &txn,
 uint64_t
 Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Messages &res)
 {
-    auto txn         = lmdb::txn::begin(env_);
-    auto eventsDb    = getEventsDb(txn, room_id);
-    auto relationsDb = getRelationsDb(txn, room_id);
+    auto txn            = lmdb::txn::begin(env_);
+    auto eventsDb       = getEventsDb(txn, room_id);
+    auto relationsDb    = getRelationsDb(txn, room_id);
+    auto aggregationsDb = getRelationAggregationsDb(txn, room_id);
 
     auto orderDb     = getEventOrderDb(txn, room_id);
     auto evToOrderDb = getEventToOrderDb(txn, room_id);
@@ -3293,6 +4992,8 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
         }
     }
 
+    auto hiddenTypes = hiddenEventTypes(txn, room_id);
+
     if (res.chunk.empty()) {
         if (orderDb.get(txn, lmdb::to_sv(index), val)) {
             auto orderEntry          = nlohmann::json::parse(val);
@@ -3322,18 +5023,19 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
             nlohmann::json orderEntry = nlohmann::json::object();
             orderEntry["event_id"]    = event_id_val;
 
+            bool hidden = classifyEvent(orderEntry, e, room_id, hiddenTypes, nullptr);
+
             orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
             evToOrderDb.put(txn, event_id, lmdb::to_sv(index));
 
-            // TODO(Nico): Allow blacklisting more event types in UI
-            if (!isHiddenEvent(txn, e, room_id)) {
+            if (!hidden) {
                 --msgIndex;
                 order2msgDb.put(txn, lmdb::to_sv(msgIndex), event_id);
 
                 msg2orderDb.put(txn, event_id, lmdb::to_sv(msgIndex));
             }
         }
-        eventsDb.put(txn, event_id, event.dump());
+        eventsDb.put(txn, event_id, encodeStoredEvent(event));
 
         auto relations = mtx::accessors::relations(e);
         if (!relations.relations.empty()) {
@@ -3343,11 +5045,21 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
                 }
             }
         }
+        aggregateRelations(txn, aggregationsDb, e, {}, true);
     }
 
+    // keep the classification of the entry
     nlohmann::json orderEntry = nlohmann::json::object();
-    orderEntry["event_id"]    = event_id_val;
-    orderEntry["prev_batch"]  = res.end;
+    if (orderDb.get(txn, lmdb::to_sv(index), val)) {
+        try {
+            auto stored = nlohmann::json::parse(val);
+            if (stored.value("event_id", "") == event_id_val)
+                orderEntry = std::move(stored);
+        } catch (const std::exception &) {
+        }
+    }
+    orderEntry["event_id"]   = event_id_val;
+    orderEntry["prev_batch"] = res.end;
     orderDb.put(txn, lmdb::to_sv(index), orderEntry.dump());
 
     txn.commit();
@@ -3356,95 +5068,136 @@ Cache::saveOldMessages(const std::string &room_id, const mtx::responses::Message
 }
 
 void
-Cache::clearTimeline(const std::string &room_id)
+Cache::pruneTimelineRange(lmdb::txn &txn,
+                          const std::string &room_id,
+                          uint64_t end,
+                          std::chrono::steady_clock::time_point deadline,
+                          PruneStats &stats)
 {
-    auto txn         = lmdb::txn::begin(env_);
-    auto eventsDb    = getEventsDb(txn, room_id);
-    auto relationsDb = getRelationsDb(txn, room_id);
+    auto eventsDb       = getEventsDb(txn, room_id);
+    auto relationsDb    = getRelationsDb(txn, room_id);
+    auto aggregationsDb = getRelationAggregationsDb(txn, room_id);
 
     auto orderDb     = getEventOrderDb(txn, room_id);
     auto evToOrderDb = getEventToOrderDb(txn, room_id);
     auto msg2orderDb = getMessageToOrderDb(txn, room_id);
     auto order2msgDb = getOrderToMessageDb(txn, room_id);
 
+    auto del = [&txn, &stats](lmdb::dbi &db, std::string_view key) {
+        std::string_view value;
+        if (db.get(txn, key, value)) {
+            stats.bytes += key.size() + value.size();
+            db.del(txn, key);
+        }
+    };
+
     std::string_view indexVal, val;
     auto cursor = lmdb::cursor::open(txn, orderDb);
 
-    bool start                   = true;
-    bool passed_pagination_token = false;
-    while (cursor.get(indexVal, val, start ? MDB_LAST : MDB_PREV)) {
+    bool start = true;
+    while (cursor.get(indexVal, val, start ? MDB_FIRST : MDB_NEXT)) {
         start = false;
-        nlohmann::json obj;
+        if (lmdb::from_sv<uint64_t>(indexVal) >= end)
+            break;
+
+        // checking the clock is not free, so only do it every few entries
+        if (stats.events % 64 == 0 && std::chrono::steady_clock::now() >= deadline) {
+            stats.done = false;
+            break;
+        }
 
+        std::string event_id;
         try {
-            obj = nlohmann::json::parse(std::string_view(val.data(), val.size()));
+            event_id = nlohmann::json::parse(val).value("event_id", "");
         } catch (std::exception &) {
             // workaround bug in the initial db format, where we sometimes didn't store
             // json...
-            obj = {{"event_id", std::string(val.data(), val.size())}};
+            event_id = std::string(val.data(), val.size());
         }
 
-        if (passed_pagination_token) {
-            if (obj.count("event_id") != 0) {
-                std::string event_id = obj["event_id"].get<std::string>();
-
-                if (!event_id.empty()) {
-                    evToOrderDb.del(txn, event_id);
-                    eventsDb.del(txn, event_id);
-                    relationsDb.del(txn, event_id);
-
-                    std::string_view order{};
-                    bool exists = msg2orderDb.get(txn, event_id, order);
-                    if (exists) {
-                        order2msgDb.del(txn, order);
-                        msg2orderDb.del(txn, event_id);
-                    }
-                }
+        if (!event_id.empty()) {
+            del(evToOrderDb, event_id);
+            del(eventsDb, event_id);
+            del(relationsDb, event_id);
+            del(aggregationsDb, event_id);
+
+            std::string_view order;
+            if (msg2orderDb.get(txn, event_id, order)) {
+                auto msgIndex = lmdb::from_sv<uint64_t>(order);
+                del(order2msgDb, lmdb::to_sv(msgIndex));
+                del(msg2orderDb, event_id);
             }
-            lmdb::cursor_del(cursor);
-        } else {
-            if (obj.count("prev_batch") != 0)
-                passed_pagination_token = true;
         }
+
+        stats.bytes += indexVal.size() + val.size();
+        stats.events++;
+        lmdb::cursor_del(cursor);
     }
+    cursor.close();
+}
 
-    auto msgCursor = lmdb::cursor::open(txn, order2msgDb);
-    start          = true;
-    while (msgCursor.get(indexVal, val, start ? MDB_LAST : MDB_PREV)) {
-        start = false;
+void
+Cache::clearTimeline(const std::string &room_id)
+{
+    auto started = std::chrono::steady_clock::now();
+
+    auto txn         = lmdb::txn::begin(env_);
+    auto orderDb     = getEventOrderDb(txn, room_id);
+    auto evToOrderDb = getEventToOrderDb(txn, room_id);
+    auto msg2orderDb = getMessageToOrderDb(txn, room_id);
+    auto order2msgDb = getOrderToMessageDb(txn, room_id);
 
-        std::string_view eventId;
-        bool innerStart = true;
-        bool found      = false;
-        while (cursor.get(indexVal, eventId, innerStart ? MDB_LAST : MDB_PREV)) {
-            innerStart = false;
+    std::string_view indexVal, val;
 
-            nlohmann::json obj;
+    // keep everything from the latest batch with a pagination token
+    std::optional<uint64_t> latestBatch;
+    {
+        auto cursor = lmdb::cursor::open(txn, orderDb);
+        bool start  = true;
+        while (cursor.get(indexVal, val, start ? MDB_LAST : MDB_PREV)) {
+            start = false;
             try {
-                obj = nlohmann::json::parse(std::string_view(eventId.data(), eventId.size()));
+                if (nlohmann::json::parse(val).count("prev_batch") != 0) {
+                    latestBatch = lmdb::from_sv<uint64_t>(indexVal);
+                    break;
+                }
             } catch (std::exception &) {
-                obj = {{"event_id", std::string(eventId.data(), eventId.size())}};
-            }
-
-            if (obj["event_id"] == std::string(val.data(), val.size())) {
-                found = true;
-                break;
             }
         }
-
-        if (!found)
-            break;
+        cursor.close();
     }
 
-    if (!start) {
-        do {
-            lmdb::cursor_del(msgCursor);
-        } while (msgCursor.get(indexVal, val, MDB_PREV));
-    }
+    PruneStats stats;
+    if (latestBatch)
+        pruneTimelineRange(
+          txn, room_id, *latestBatch, std::chrono::steady_clock::time_point::max(), stats);
 
-    cursor.close();
+    // drop the messages older than the first one, that lost its timeline entry
+    auto msgCursor = lmdb::cursor::open(txn, order2msgDb);
+    bool start     = true;
+    bool orphaned  = false;
+    while (msgCursor.get(indexVal, val, start ? MDB_LAST : MDB_PREV)) {
+        start = false;
+
+        std::string_view unused;
+        if (!orphaned && evToOrderDb.get(txn, val, unused))
+            continue;
+
+        orphaned = true;
+        msg2orderDb.del(txn, val);
+        lmdb::cursor_del(msgCursor);
+    }
     msgCursor.close();
+
     txn.commit();
+
+    stats.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - started);
+    nhlog::db()->info("cleared timeline of {}: {} events, {} bytes in {}us",
+                      room_id,
+                      stats.events,
+                      stats.bytes,
+                      stats.elapsed.count());
 }
 
 mtx::responses::Notifications
@@ -3574,73 +5327,72 @@ Cache::getRoomIds(lmdb::txn &txn)
     return rooms;
 }
 
-void
-Cache::deleteOldMessages()
+Cache::PruneStats
+Cache::deleteOldMessages(std::chrono::milliseconds budget)
 {
-    std::string_view indexVal, val;
+    using clock  = std::chrono::steady_clock;
+    auto started = clock::now();
+    auto deadline =
+      budget == std::chrono::milliseconds::max() ? clock::time_point::max() : started + budget;
+
+    PruneStats stats;
 
     auto txn      = lmdb::txn::begin(env_);
     auto room_ids = getRoomIds(txn);
 
-    for (const auto &room_id : room_ids) {
-        auto orderDb     = getEventOrderDb(txn, room_id);
-        auto evToOrderDb = getEventToOrderDb(txn, room_id);
-        auto o2m         = getOrderToMessageDb(txn, room_id);
-        auto m2o         = getMessageToOrderDb(txn, room_id);
-        auto eventsDb    = getEventsDb(txn, room_id);
-        auto relationsDb = getRelationsDb(txn, room_id);
-        auto cursor      = lmdb::cursor::open(txn, orderDb);
+    // room ids come sorted from the rooms db, continue where the last run stopped
+    for (auto room_id = std::lower_bound(room_ids.begin(), room_ids.end(), prune_resume_room_);
+         room_id != room_ids.end();
+         ++room_id) {
+        auto orderDb = getEventOrderDb(txn, *room_id);
 
+        std::string_view indexVal, val;
         uint64_t first, last;
-        if (cursor.get(indexVal, val, MDB_LAST)) {
+        {
+            auto cursor = lmdb::cursor::open(txn, orderDb);
+            if (!cursor.get(indexVal, val, MDB_LAST))
+                continue;
             last = lmdb::from_sv<uint64_t>(indexVal);
-        } else {
-            continue;
-        }
-        if (cursor.get(indexVal, val, MDB_FIRST)) {
+
+            if (!cursor.get(indexVal, val, MDB_FIRST))
+                continue;
             first = lmdb::from_sv<uint64_t>(indexVal);
-        } else {
-            continue;
         }
 
         size_t message_count = static_cast<size_t>(last - first);
         if (message_count < MAX_RESTORED_MESSAGES)
             continue;
 
-        bool start = true;
-        while (cursor.get(indexVal, val, start ? MDB_FIRST : MDB_NEXT) &&
-               message_count-- > MAX_RESTORED_MESSAGES) {
-            start    = false;
-            auto obj = nlohmann::json::parse(std::string_view(val.data(), val.size()));
-
-            if (obj.count("event_id") != 0) {
-                std::string event_id = obj["event_id"].get<std::string>();
-                evToOrderDb.del(txn, event_id);
-                eventsDb.del(txn, event_id);
-
-                relationsDb.del(txn, event_id);
-
-                std::string_view order{};
-                bool exists = m2o.get(txn, event_id, order);
-                if (exists) {
-                    o2m.del(txn, order);
-                    m2o.del(txn, event_id);
-                }
-            }
-            cursor.del();
+        pruneTimelineRange(txn, *room_id, last - MAX_RESTORED_MESSAGES, deadline, stats);
+        if (!stats.done) {
+            prune_resume_room_ = *room_id;
+            break;
         }
-        cursor.close();
     }
+
+    if (stats.done)
+        prune_resume_room_.clear();
+
     txn.commit();
+
+    stats.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - started);
+    return stats;
 }
 
-void
-Cache::deleteOldData() noexcept
+Cache::PruneStats
+Cache::deleteOldData(std::chrono::milliseconds budget) noexcept
 {
     try {
-        deleteOldMessages();
+        auto stats = deleteOldMessages(budget);
+        nhlog::db()->info("pruned {} old timeline entries, {} bytes in {}us{}",
+                          stats.events,
+                          stats.bytes,
+                          stats.elapsed.count(),
+                          stats.done ? "" : ", continuing later");
+        return stats;
     } catch (const lmdb::error &e) {
         nhlog::db()->error("failed to delete old messages: {}", e.what());
+        return {};
     }
 }
 
@@ -3732,7 +5484,7 @@ Cache::spaces()
             if (!space_child.empty()) {
                 std::string_view room_data;
                 if (roomsDb_.get(txn, space_id, room_data)) {
-                    RoomInfo tmp = nlohmann::json::parse(std::move(room_data)).get<RoomInfo>();
+                    RoomInfo tmp = decodeStoredEvent(room_data).get<RoomInfo>();
                     ret.insert(QString::fromUtf8(space_id.data(), space_id.size()), tmp);
                 } else {
                     ret.insert(QString::fromUtf8(space_id.data(), space_id.size()), std::nullopt);
@@ -3924,32 +5676,36 @@ Cache::hasEnoughPowerLevel(const std::vector<mtx::events::EventType> &eventTypes
     using namespace mtx::events;
     using namespace mtx::events::state;
 
-    auto txn = lmdb::txn::begin(env_);
-    auto db  = getStatesDb(txn, room_id);
-
     int64_t min_event_level = std::numeric_limits<int64_t>::max();
     int64_t user_level      = std::numeric_limits<int64_t>::min();
 
-    std::string_view event;
-    bool res = db.get(txn, to_string(EventType::RoomPowerLevels), event);
+    try {
+        auto txn = ro_txn(env_);
+        auto db  = getStatesDb(txn, room_id);
 
-    if (res) {
-        try {
-            StateEvent<PowerLevels> msg =
-              nlohmann::json::parse(std::string_view(event.data(), event.size()))
-                .get<StateEvent<PowerLevels>>();
+        std::string_view event;
+        bool res = db.get(txn, to_string(EventType::RoomPowerLevels), event);
+
+        if (res) {
+            try {
+                StateEvent<PowerLevels> msg =
+                  nlohmann::json::parse(std::string_view(event.data(), event.size()))
+                    .get<StateEvent<PowerLevels>>();
 
-            user_level = msg.content.user_level(user_id);
+                user_level = msg.content.user_level(user_id);
 
-            for (const auto &ty : eventTypes)
-                min_event_level = std::min(min_event_level, msg.content.state_level(to_string(ty)));
-        } catch (const nlohmann::json::exception &e) {
-            nhlog::db()->warn("failed to parse m.room.power_levels event: {}", e.what());
+                for (const auto &ty : eventTypes)
+                    min_event_level =
+                      std::min(min_event_level, msg.content.state_level(to_string(ty)));
+            } catch (const nlohmann::json::exception &e) {
+                nhlog::db()->warn("failed to parse m.room.power_levels event: {}", e.what());
+            }
         }
+    } catch (const lmdb::error &e) {
+        // no state stored for this room, which a read only transaction can't create
+        nhlog::db()->debug("no power levels for room {}: {}", room_id, e.what());
     }
 
-    txn.commit();
-
     return user_level >= min_event_level;
 }
 
@@ -4024,6 +5780,7 @@ std::map<std::string, std::optional<UserKeyCache>>
 Cache::getMembersWithKeys(const std::string &room_id, bool verified_only)
 {
     std::string_view keys;
+    const auto statsBefore = verificationStats();
 
     try {
         auto txn = ro_txn(env_);
@@ -4079,6 +5836,18 @@ Cache::getMembersWithKeys(const std::string &room_id, bool verified_only)
         }
         cursor.close();
 
+        if (verified_only) {
+            const auto stats = verificationStats();
+            nhlog::db()->debug("Verified members of {}: {} status lookups, {} recalculated, {} "
+                               "signatures checked, {} memoized",
+                               room_id,
+                               stats.status_hits + stats.status_misses -
+                                 statsBefore.status_hits - statsBefore.status_misses,
+                               stats.status_misses - statsBefore.status_misses,
+                               stats.signature_checks - statsBefore.signature_checks,
+                               stats.signature_hits - statsBefore.signature_hits);
+        }
+
         return members;
     } catch (std::exception &e) {
         nhlog::db()->debug("Error retrieving members: {}", e.what());
@@ -4216,16 +5985,25 @@ Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::Query
     for (const auto &[user, keys] : keyQuery.self_signing_keys)
         updates[user].self_signing_keys = keys;
 
+    const auto local_user = utils::localUser().toStdString();
+
+    // Only users, whose stored keys changed, need their status recalculated. Everyone else's
+    // status only depends on our own signing keys.
+    std::set<std::string> changedUsers;
+    bool ourSigningKeysChanged = false;
+
     for (auto &[user, update] : updates) {
         nhlog::db()->debug("Updated user keys: {}", user);
 
         auto updateToWrite = update;
+        nlohmann::json previous;
 
         std::string_view oldKeys;
         auto res = db.get(txn, user, oldKeys);
 
         if (res) {
             updateToWrite     = nlohmann::json::parse(oldKeys).get<UserKeyCache>();
+            previous          = updateToWrite;
             auto last_changed = updateToWrite.last_changed;
             // skip if we are tracking this and expect it to be up to date with the last
             // sync token
@@ -4322,6 +6100,16 @@ Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::Query
                 updateToWrite.seen_device_ids.insert(device_id);
             }
         }
+
+        if (!res || nlohmann::json(updateToWrite) != previous) {
+            changedUsers.insert(user);
+            if (user == local_user &&
+                (!res || previous.at("master_keys") != nlohmann::json(updateToWrite.master_keys) ||
+                 previous.at("user_signing_keys") !=
+                   nlohmann::json(updateToWrite.user_signing_keys)))
+                ourSigningKeysChanged = true;
+        }
+
         updateToWrite.updated_at = sync_token;
         db.put(txn, user, nlohmann::json(updateToWrite).dump());
     }
@@ -4329,31 +6117,22 @@ Cache::updateUserKeys(const std::string &sync_token, const mtx::responses::Query
     txn.commit();
 
     std::map<std::string, VerificationStatus> tmp;
-    const auto local_user = utils::localUser().toStdString();
-
     {
         std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
-        for (auto &[user_id, update] : updates) {
-            (void)update;
-            if (user_id == local_user) {
-                std::swap(tmp, verification_storage.status);
-            } else {
+        if (ourSigningKeysChanged) {
+            std::swap(tmp, verification_storage.status);
+        } else {
+            for (const auto &user_id : changedUsers)
                 verification_storage.status.erase(user_id);
-            }
         }
     }
 
-    for (auto &[user_id, update] : updates) {
-        (void)update;
-        if (user_id == local_user) {
-            for (const auto &[user, status] : tmp) {
-                (void)status;
-                emit verificationStatusChanged(user);
-            }
-        } else {
-            emit verificationStatusChanged(user_id);
-        }
+    for (const auto &[user, status] : tmp) {
+        (void)status;
+        changedUsers.insert(user);
     }
+    for (const auto &user_id : changedUsers)
+        emit verificationStatusChanged(user_id);
 }
 
 void
@@ -4564,25 +6343,13 @@ Cache::markDeviceVerified(const std::string &user_id, const std::string &key)
         }
     }
 
-    const auto local_user = utils::localUser().toStdString();
-    std::map<std::string, VerificationStatus> tmp;
+    // Manually verified devices only count for their own user, the status of everyone else
+    // depends on our signing keys, which are handled in updateUserKeys.
     {
         std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
-        if (user_id == local_user) {
-            std::swap(tmp, verification_storage.status);
-            verification_storage.status.clear();
-        } else {
-            verification_storage.status.erase(user_id);
-        }
-    }
-    if (user_id == local_user) {
-        for (const auto &[user, status] : tmp) {
-            (void)status;
-            emit verificationStatusChanged(user);
-        }
-    } else {
-        emit verificationStatusChanged(user_id);
+        verification_storage.status.erase(user_id);
     }
+    emit verificationStatusChanged(user_id);
 }
 
 void
@@ -4607,21 +6374,9 @@ Cache::markDeviceUnverified(const std::string &user_id, const std::string &key)
     } catch (std::exception &) {
     }
 
-    const auto local_user = utils::localUser().toStdString();
-    std::map<std::string, VerificationStatus> tmp;
     {
         std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
-        if (user_id == local_user) {
-            std::swap(tmp, verification_storage.status);
-        } else {
-            verification_storage.status.erase(user_id);
-        }
-    }
-    if (user_id == local_user) {
-        for (const auto &[user, status] : tmp) {
-            (void)status;
-            emit verificationStatusChanged(user);
-        }
+        verification_storage.status.erase(user_id);
     }
     emit verificationStatusChanged(user_id);
 }
@@ -4633,12 +6388,56 @@ Cache::verificationStatus(const std::string &user_id)
     return verificationStatus_(user_id, txn);
 }
 
+VerificationStats
+Cache::verificationStats()
+{
+    std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
+    return verification_storage.stats;
+}
+
+bool
+Cache::verifySignature_(const std::string &signing_key,
+                        nlohmann::json object,
+                        const std::string &signature)
+{
+    // Neither is covered by the signature, see ed25519_verify_signature.
+    object.erase("signatures");
+    object.erase("unsigned");
+
+    std::string memoKey;
+    memoKey.append(signing_key);
+    memoKey.push_back('\0');
+    memoKey.append(signature);
+    memoKey.push_back('\0');
+    memoKey.append(mtx::crypto::to_string(mtx::crypto::sha256(object.dump())));
+
+    auto &memo = verification_storage.signatures;
+    if (auto it = memo.find(memoKey); it != memo.end()) {
+        verification_storage.stats.signature_hits++;
+        return it->second;
+    }
+
+    verification_storage.stats.signature_checks++;
+    bool valid = mtx::crypto::ed25519_verify_signature(signing_key, object, signature);
+
+    // the memo is cheap to rebuild, so just start over instead of tracking its usage
+    if (memo.size() >= MAX_MEMOIZED_SIGNATURES)
+        memo.clear();
+    memo.emplace(std::move(memoKey), valid);
+
+    return valid;
+}
+
 VerificationStatus
 Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
 {
     std::unique_lock<std::mutex> lock(verification_storage.verification_storage_mtx);
-    if (verification_storage.status.count(user_id))
-        return verification_storage.status.at(user_id);
+    if (auto cached = verification_storage.status.find(user_id);
+        cached != verification_storage.status.end()) {
+        verification_storage.stats.status_hits++;
+        return cached->second;
+    }
+    verification_storage.stats.status_misses++;
 
     VerificationStatus status;
 
@@ -4659,9 +6458,9 @@ Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
         trustlevel = crypto::Trust::Verified;
     }
 
-    auto verifyAtLeastOneSig = [](const auto &toVerif,
-                                  const std::map<std::string, std::string> &keys,
-                                  const std::string &keyOwner) {
+    auto verifyAtLeastOneSig = [this](const auto &toVerif,
+                                      const std::map<std::string, std::string> &keys,
+                                      const std::string &keyOwner) {
         if (!toVerif.signatures.count(keyOwner))
             return false;
 
@@ -4669,8 +6468,7 @@ Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
             if (!keys.count(key_id))
                 continue;
 
-            if (mtx::crypto::ed25519_verify_signature(
-                  keys.at(key_id), nlohmann::json(toVerif), signature))
+            if (verifySignature_(keys.at(key_id), nlohmann::json(toVerif), signature))
                 return true;
         }
         return false;
@@ -4712,9 +6510,9 @@ Cache::verificationStatus_(const std::string &user_id, lmdb::txn &txn)
             auto &mk           = ourKeys->master_keys;
             std::string dev_id = "ed25519:" + http::client()->device_id();
             if (!mk.signatures.count(local_user) || !mk.signatures.at(local_user).count(dev_id) ||
-                !mtx::crypto::ed25519_verify_signature(olm::client()->identity_keys().ed25519,
-                                                       nlohmann::json(mk),
-                                                       mk.signatures.at(local_user).at(dev_id))) {
+                !verifySignature_(olm::client()->identity_keys().ed25519,
+                                  nlohmann::json(mk),
+                                  mk.signatures.at(local_user).at(dev_id))) {
                 nhlog::crypto()->debug("We have not verified our own master key");
                 verification_storage.status[user_id] = status;
                 return status;
@@ -4850,6 +6648,47 @@ from_json(const nlohmann::json &j, MemberInfo &info)
     info.is_direct  = j.value("is_direct", false);
 }
 
+void
+to_json(nlohmann::json &j, const UserDirectoryEntry &entry)
+{
+    j["name"]       = entry.display_name;
+    j["avatar_url"] = entry.avatar_url;
+    j["rooms"]      = entry.shared_rooms;
+}
+
+void
+from_json(const nlohmann::json &j, UserDirectoryEntry &entry)
+{
+    entry.display_name = j.at("name").get<std::string>();
+    entry.avatar_url   = j.value("avatar_url", "");
+    entry.shared_rooms = j.at("rooms").get<uint32_t>();
+}
+
+void
+to_json(nlohmann::json &j, const RelationAggregation &aggregation)
+{
+    j = nlohmann::json::object();
+    for (const auto &edit : aggregation.edits)
+        j["edits"].push_back(nlohmann::json::array({edit.event_id, edit.sender}));
+    for (const auto &reactions : aggregation.reactions)
+        j["reactions"].push_back({{"key", reactions.key}, {"senders", reactions.senders}});
+}
+
+void
+from_json(const nlohmann::json &j, RelationAggregation &aggregation)
+{
+    if (j.contains("edits"))
+        for (const auto &edit : j.at("edits"))
+            aggregation.edits.push_back(
+              {edit.at(0).get<std::string>(), edit.at(1).get<std::string>()});
+    if (j.contains("reactions"))
+        for (const auto &reactions : j.at("reactions"))
+            aggregation.reactions.push_back(
+              {reactions.at("key").get<std::string>(),
+               reactions.at("senders")
+                 .get<std::vector<std::pair<std::string, std::string>>>()});
+}
+
 void
 to_json(nlohmann::json &obj, const DeviceKeysToMsgIndex &msg)
 {
@@ -5346,16 +7185,26 @@ dropOutboundMegolmSession(const std::string &room_id)
     instance_->dropOutboundMegolmSession(room_id);
 }
 
-void
+std::size_t
 importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys)
 {
-    instance_->importSessionKeys(keys);
+    return instance_->importSessionKeys(keys);
+}
+SessionKeyTransferStats
+importSessionKeys(const std::function<bool(mtx::crypto::ExportedSessionKeys &)> &source)
+{
+    return instance_->importSessionKeys(source);
 }
 mtx::crypto::ExportedSessionKeys
 exportSessionKeys()
 {
     return instance_->exportSessionKeys();
 }
+SessionKeyTransferStats
+exportSessionKeys(const std::function<bool(mtx::crypto::ExportedSessionKeys &&)> &sink)
+{
+    return instance_->exportSessionKeys(sink);
+}
 
 //
 // Inbound Megolm Sessions
@@ -5393,6 +7242,12 @@ saveOlmSession(const std::string &curve25519,
 {
     instance_->saveOlmSession(curve25519, std::move(session), timestamp);
 }
+void
+saveOlmSessions(std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessions,
+                uint64_t timestamp)
+{
+    instance_->saveOlmSessions(std::move(sessions), timestamp);
+}
 std::vector<std::string>
 getOlmSessions(const std::string &curve25519)
 {
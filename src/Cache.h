@@ -9,6 +9,8 @@
 #include <QDateTime>
 #include <QString>
 
+#include <functional>
+
 #if __has_include(<lmdbxx/lmdb++.h>)
 #include <lmdbxx/lmdb++.h>
 #else
@@ -218,10 +220,16 @@ updateOutboundMegolmSession(const std::string &room_id,
 void
 dropOutboundMegolmSession(const std::string &room_id);
 
-void
+std::size_t
 importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
+//! Imports chunks from `source` until it returns false.
+SessionKeyTransferStats
+importSessionKeys(const std::function<bool(mtx::crypto::ExportedSessionKeys &)> &source);
 mtx::crypto::ExportedSessionKeys
 exportSessionKeys();
+//! Passes all sessions to `sink` in bounded chunks, until it returns false.
+SessionKeyTransferStats
+exportSessionKeys(const std::function<bool(mtx::crypto::ExportedSessionKeys &&)> &sink);
 
 //
 // Inbound Megolm Sessions
@@ -244,6 +252,9 @@ void
 saveOlmSession(const std::string &curve25519,
                mtx::crypto::OlmSessionPtr session,
                uint64_t timestamp);
+void
+saveOlmSessions(std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessions,
+                uint64_t timestamp);
 std::vector<std::string>
 getOlmSessions(const std::string &curve25519);
 std::optional<mtx::crypto::OlmSessionPtr>
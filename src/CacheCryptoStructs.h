@@ -7,9 +7,13 @@
 
 #include <QObject>
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <map>
 #include <mutex>
 #include <set>
+#include <unordered_map>
 
 #include <mtx/events/encrypted.hpp>
 #include <mtx/responses/crypto.hpp>
@@ -134,11 +138,35 @@ struct VerificationStatus
     bool no_keys = false;
 };
 
+//! Work done by the verification status engine since startup.
+struct VerificationStats
+{
+    //! Status lookups answered from memory and lookups, that walked the signing chain.
+    uint64_t status_hits = 0, status_misses = 0;
+    //! Signatures answered from the memo and signatures, that were actually verified.
+    uint64_t signature_hits = 0, signature_checks = 0;
+};
+
+//! Throughput of a session key export or import.
+struct SessionKeyTransferStats
+{
+    std::size_t sessions = 0, skipped = 0, chunks = 0;
+    std::chrono::milliseconds elapsed{0};
+
+    double sessionsPerSecond() const
+    {
+        return elapsed.count() > 0 ? sessions * 1000.0 / elapsed.count() : 0.0;
+    }
+};
+
 //! In memory cache of verification status
 struct VerificationStorage
 {
     //! mapping of user to verification status
     std::map<std::string, VerificationStatus> status;
+    //! result of each signature check by signing key, signature and hash of the signed object
+    std::unordered_map<std::string, bool> signatures;
+    VerificationStats stats;
     std::mutex verification_storage_mtx;
 };
 
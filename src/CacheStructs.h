@@ -10,6 +10,8 @@
 #include <QString>
 
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <mtx/events/join_rules.hpp>
 #include <mtx/events/mscs/image_packs.hpp>
@@ -115,6 +117,51 @@ to_json(nlohmann::json &j, const MemberInfo &info);
 void
 from_json(const nlohmann::json &j, MemberInfo &info);
 
+//! Edits and reactions of an event, maintained while the timeline is stored.
+struct RelationAggregation
+{
+    struct Edit
+    {
+        std::string event_id;
+        std::string sender;
+    };
+    struct Reactions
+    {
+        std::string key;
+        //! sender and the id of their reaction, in arrival order. A sender may have reacted
+        //! more than once with the same key, each reaction is kept until it is redacted.
+        std::vector<std::pair<std::string, std::string>> senders;
+    };
+
+    //! In arrival order. The latest one from the sender of the original event applies.
+    std::vector<Edit> edits;
+    //! In the order the keys were first used.
+    std::vector<Reactions> reactions;
+
+    bool empty() const { return edits.empty() && reactions.empty(); }
+};
+
+void
+to_json(nlohmann::json &j, const RelationAggregation &aggregation);
+void
+from_json(const nlohmann::json &j, RelationAggregation &aggregation);
+
+//! A user sharing a joined room with us, see Cache::searchUserDirectory.
+struct UserDirectoryEntry
+{
+    std::string user_id;
+    //! From the last member event of the user.
+    std::string display_name;
+    std::string avatar_url;
+    //! Number of joined rooms the user is a member of.
+    uint32_t shared_rooms = 0;
+};
+
+void
+to_json(nlohmann::json &j, const UserDirectoryEntry &entry);
+void
+from_json(const nlohmann::json &j, UserDirectoryEntry &entry);
+
 struct RoomSearchResult
 {
     std::string room_id;
@@ -7,8 +7,16 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <limits>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <unordered_map>
 
 #include <QDateTime>
 #include <QString>
@@ -28,6 +36,12 @@
 #include "CacheCryptoStructs.h"
 #include "CacheStructs.h"
 #include "Logging.h"
+#include "MegolmSessionCache.h"
+#include "OlmSessionCache.h"
+
+namespace olm {
+class SyncDecryptionBatch;
+}
 
 namespace mtx::responses {
 struct Messages;
@@ -62,6 +76,7 @@ public:
     // device & user verification cache
     std::optional<UserKeyCache> userKeys(const std::string &user_id);
     VerificationStatus verificationStatus(const std::string &user_id);
+    VerificationStats verificationStats();
     void markDeviceVerified(const std::string &user_id, const std::string &device);
     void markDeviceUnverified(const std::string &user_id, const std::string &device);
     crypto::Trust roomVerificationStatus(const std::string &room_id);
@@ -110,6 +125,12 @@ public:
     std::optional<mtx::events::collections::RoomAccountDataEvents>
     getAccountData(mtx::events::EventType type, const std::string &room_id = "");
 
+    //! Users of the joined rooms, whose user id, display name or a word of it starts with
+    //! `prefix` (case insensitive). At most `limit` users, most shared rooms first. Only the
+    //! first 1000 matches in index order are ranked.
+    std::vector<UserDirectoryEntry> searchUserDirectory(const std::string &prefix,
+                                                        std::size_t limit);
+
     //! Retrieve member info from a room.
     std::vector<RoomMember>
     getMembers(const std::string &room_id, std::size_t startIndex = 0, std::size_t len = 30);
@@ -120,7 +141,10 @@ public:
     size_t memberCount(const std::string &room_id);
 
     void updateState(const std::string &room, const mtx::responses::StateEvents &state);
-    void saveState(const mtx::responses::Sync &res);
+    //! Stores a sync. `decrypted` holds the timelines of the joined rooms decrypted by
+    //! olm::decryptSync(), without it encrypted events are classified as they are.
+    void saveState(const mtx::responses::Sync &res,
+                   std::map<std::string, olm::SyncDecryptionBatch> *decrypted = nullptr);
     bool isInitialized();
     bool isDatabaseReady() { return databaseReady_ ; }
 
@@ -203,6 +227,8 @@ public:
                       const std::string &event_id,
                       const mtx::events::collections::TimelineEvent &event);
     std::vector<std::string> relatedEvents(const std::string &room_id, const std::string &event_id);
+    RelationAggregation relationAggregation(const std::string &room_id,
+                                            const std::string &event_id);
 
     struct TimelineRange
     {
@@ -214,6 +240,10 @@ public:
     std::optional<std::pair<uint64_t, std::string>>
     lastInvisibleEventAfter(const std::string &room_id, std::string_view event_id);
     std::optional<std::string> getTimelineEventId(const std::string &room_id, uint64_t index);
+    //! The type the message at `index` was classified with when it was stored, without
+    //! decoding or decrypting it. nullopt for messages stored before the classification.
+    std::optional<mtx::events::EventType> getTimelineEventType(const std::string &room_id,
+                                                               uint64_t index);
     std::optional<uint64_t> getArrivalIndex(const std::string &room_id, std::string_view event_id);
 
     std::string previousBatchToken(const std::string &room_id);
@@ -223,14 +253,33 @@ public:
     std::vector<std::string> pendingEvents(const std::string &room_id);
     std::optional<mtx::events::collections::TimelineEvent>
     firstPendingMessage(const std::string &room_id);
+    //! The first limit messages of the pending queue, in the order they are sent.
+    std::vector<mtx::events::collections::TimelineEvent>
+    pendingMessages(const std::string &room_id, size_t limit);
     void removePendingStatus(const std::string &room_id, const std::string &txn_id);
+    bool isPendingMessage(const std::string &room_id, std::string_view txn_id);
 
     //! clear timeline keeping only the latest batch
     void clearTimeline(const std::string &room_id);
 
-    //! Remove old unused data.
-    void deleteOldMessages();
-    void deleteOldData() noexcept;
+    //! What a pruning run removed and how long it took.
+    struct PruneStats
+    {
+        uint64_t events = 0;
+        //! Size of the deleted keys and values. The pages are reused by lmdb, the file
+        //! doesn't shrink.
+        uint64_t bytes = 0;
+        std::chrono::microseconds elapsed{0};
+        //! False if the run stopped at its time budget and there is more to prune.
+        bool done = true;
+    };
+
+    //! Remove old unused data. Stops after `budget` and continues with the room it stopped
+    //! at on the next call, so that retention can run in slices between syncs.
+    PruneStats deleteOldMessages(
+      std::chrono::milliseconds budget = std::chrono::milliseconds::max());
+    PruneStats deleteOldData(
+      std::chrono::milliseconds budget = std::chrono::milliseconds::max()) noexcept;
     //! Retrieve all saved room ids.
     std::vector<std::string> getRoomIds(lmdb::txn &txn);
     std::vector<std::string> getParentRoomIds(const std::string &room_id);
@@ -261,8 +310,21 @@ public:
                                      mtx::crypto::OutboundGroupSessionPtr &session);
     void dropOutboundMegolmSession(const std::string &room_id);
 
-    void importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
+    //! Sessions pickled, unpickled and written per transaction by the session key transfer.
+    static constexpr std::size_t SessionKeyChunkSize = 1000;
+
+    //! Imports the keys in chunks and returns the number of stored sessions.
+    std::size_t importSessionKeys(const mtx::crypto::ExportedSessionKeys &keys);
+    //! Imports chunks from `source` until it returns false. The chunk passed in is empty.
+    SessionKeyTransferStats importSessionKeys(
+      const std::function<bool(mtx::crypto::ExportedSessionKeys &)> &source);
+    //! Collects all sessions in memory, prefer the overload with a sink for large key sets.
     mtx::crypto::ExportedSessionKeys exportSessionKeys();
+    //! Passes all sessions to `sink` in chunks of at most `chunkSize`, until it returns false.
+    //! No transaction is open, while the sink runs.
+    SessionKeyTransferStats exportSessionKeys(
+      const std::function<bool(mtx::crypto::ExportedSessionKeys &&)> &sink,
+      std::size_t chunkSize = SessionKeyChunkSize);
 
     //
     // Inbound Megolm Sessions
@@ -273,6 +335,15 @@ public:
     mtx::crypto::InboundGroupSessionPtr getInboundMegolmSession(const MegolmSessionIndex &index);
     bool inboundMegolmSessionExists(const MegolmSessionIndex &index);
     std::optional<GroupSessionData> getMegolmSessionData(const MegolmSessionIndex &index);
+    //! Returns the live session from the session cache, unpickling it on a miss. Lock the
+    //! entry while using it.
+    MegolmSessionCache::EntryPtr getCachedInboundMegolmSession(const MegolmSessionIndex &index);
+    //! Stores the ratchet state of a cached session. The entry must be locked by the caller.
+    //! Nothing is written, if a session with a lower first known index was stored meanwhile.
+    void writeBackInboundMegolmSession(const MegolmSessionIndex &index,
+                                       const MegolmSessionCache::EntryPtr &session,
+                                       const GroupSessionData &data);
+    MegolmSessionCache &megolmSessionCache() { return megolmSessionCache_; }
 
     //
     // Olm Sessions
@@ -280,10 +351,16 @@ public:
     void saveOlmSession(const std::string &curve25519,
                         mtx::crypto::OlmSessionPtr session,
                         uint64_t timestamp);
+    //! Stores the sessions in a single transaction. Sessions, that fail to pickle, are skipped.
+    void saveOlmSessions(std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessions,
+                         uint64_t timestamp);
+    //! Returns the ids of the sessions with a device, the most recently used one first.
     std::vector<std::string> getOlmSessions(const std::string &curve25519);
+    //! The returned session is removed from the session cache until it is saved again.
     std::optional<mtx::crypto::OlmSessionPtr>
     getOlmSession(const std::string &curve25519, const std::string &session_id);
     std::optional<mtx::crypto::OlmSessionPtr> getLatestOlmSession(const std::string &curve25519);
+    OlmSessionCache &olmSessionCache() { return olmSessionCache_; }
 
     void saveOlmAccount(const std::string &pickled);
     std::string restoreOlmAccount();
@@ -298,22 +375,89 @@ public:
 
     std::string pickleSecret();
 
+    //! Counters of the per room database handle registry.
+    struct RoomDbiStats
+    {
+        uint64_t hits   = 0;
+        uint64_t misses = 0;
+        size_t rooms    = 0;
+    };
+    RoomDbiStats roomDbiStats();
+
     template<class T>
     constexpr static bool isStateEvent_ =
       std::is_same_v<std::remove_cv_t<std::remove_reference_t<T>>,
                      mtx::events::StateEvent<decltype(std::declval<T>().content)>>;
 
-    static int compare_state_key(const MDB_val *a, const MDB_val *b)
+    //! Key of the state_key index: event type and state_key separated by a NUL byte, so that
+    //! all keys of a type sort next to each other with the default memcmp comparator.
+    static std::string stateKeyIndexKey(std::string_view type, std::string_view state_key)
     {
-        auto get_skey = [](const MDB_val *v) {
-            return nlohmann::json::parse(
-                     std::string_view(static_cast<const char *>(v->mv_data), v->mv_size))
-              .value("key", "");
-        };
+        std::string key;
+        key.reserve(type.size() + 1 + state_key.size());
+        key.append(type);
+        key.push_back('\0');
+        key.append(state_key);
+        return key;
+    }
 
-        return get_skey(a).compare(get_skey(b));
+    //! Key of the megolm session dbs: room_id and session_id separated by a NUL byte, which
+    //! can't appear in either of them.
+    static std::string megolmSessionKey(const MegolmSessionIndex &index)
+    {
+        std::string key;
+        key.reserve(index.room_id.size() + 1 + index.session_id.size());
+        key.append(index.room_id);
+        key.push_back('\0');
+        key.append(index.session_id);
+        return key;
+    }
+    //! Splits a key created by megolmSessionKey. Returns false for keys in any other format.
+    static bool parseMegolmSessionKey(std::string_view key, MegolmSessionIndex &index)
+    {
+        auto sep = key.find('\0');
+        if (sep == std::string_view::npos)
+            return false;
+        index.room_id    = std::string(key.substr(0, sep));
+        index.session_id = std::string(key.substr(sep + 1));
+        return true;
     }
 
+    //! Encodes an event for the per room events db.
+    //!
+    //! Format: 1 byte marker (0x00, never valid JSON), 1 byte format version, 4 byte little
+    //! endian payload length, followed by the event as MessagePack.
+    static std::string encodeStoredEvent(const nlohmann::json &event);
+    //! Decodes a value of the per room events db. Values written before the binary format
+    //! was introduced are still parsed as plain JSON.
+    static nlohmann::json decodeStoredEvent(std::string_view data);
+    static bool isEncodedStoredEvent(std::string_view data);
+
+    //! Parts of RoomInfo, that are derived from the room state.
+    enum RoomInfoField : uint32_t
+    {
+        RoomInfoName        = 1 << 0,
+        RoomInfoTopic       = 1 << 1,
+        RoomInfoAvatar      = 1 << 2,
+        RoomInfoCreate      = 1 << 3, // version and is_space
+        RoomInfoMembers     = 1 << 4,
+        RoomInfoJoinRule    = 1 << 5,
+        RoomInfoGuestAccess = 1 << 6,
+        RoomInfoAll         = (1 << 7) - 1,
+    };
+    //! The RoomInfo fields, that the state events of a sync can change.
+    static uint32_t roomInfoChanges(const mtx::responses::JoinedRoom &room);
+    //! Recalculates `fields` of `info` from the stored room state.
+    void
+    updateRoomInfo(lmdb::txn &txn, const std::string &room_id, RoomInfo &info, uint32_t fields);
+    //! Stores the summary of a joined room. The in memory table is updated by commitRoomInfos.
+    void putRoomInfo(lmdb::txn &txn, const std::string &room_id, const RoomInfo &info);
+    //! Commits `txn` and applies its room summary changes to the in memory table.
+    void commitRoomInfos(lmdb::txn &txn);
+    //! Loads the summaries of all joined rooms. room_infos_mtx_ must be held and no
+    //! transaction may be open on this thread.
+    void loadRoomInfos();
+
 signals:
     void newReadReceipts(const QString &room_id, const std::vector<QString> &event_ids);
     void roomReadStatus(const std::map<QString, bool> &status);
@@ -324,6 +468,8 @@ signals:
     void selfVerificationStatusChanged();
     void secretChanged(const std::string name);
     void databaseReady();
+    //! The message order of the room changed, because its hidden event types changed.
+    void hiddenEventsReclassified(const QString &room_id);
 
 private:
     void loadSecrets(std::vector<std::pair<std::string, bool>> toLoad);
@@ -354,15 +500,51 @@ private:
     void saveTimelineMessages(lmdb::txn &txn,
                               lmdb::dbi &eventsDb,
                               const std::string &room_id,
-                              const mtx::responses::Timeline &res);
+                              const mtx::responses::Timeline &res,
+                              olm::SyncDecryptionBatch *decrypted = nullptr);
+    //! Removes a message from the pending queue. Returns false if it wasn't pending.
+    bool removePending(lmdb::txn &txn, const std::string &room_id, std::string_view txn_id);
+    //! Deletes the timeline entries with an order index below `end` in a single cursor pass,
+    //! together with their events, relations and message order. Stops early at `deadline`.
+    void pruneTimelineRange(lmdb::txn &txn,
+                            const std::string &room_id,
+                            uint64_t end,
+                            std::chrono::steady_clock::time_point deadline,
+                            PruneStats &stats);
+
+    //! Adds an edit or reaction to the aggregation of the event it relates to. An entry for
+    //! `replaced_id` (the transaction id of a local echo) is updated in place. Backfilled
+    //! events are older than everything aggregated so far and go to the front.
+    void aggregateRelations(lmdb::txn &txn,
+                            lmdb::dbi &aggregationsDb,
+                            const mtx::events::collections::TimelineEvents &e,
+                            std::string_view replaced_id = {},
+                            bool backfilled              = false);
+    //! Removes a redacted edit or reaction from the aggregation of the event it related to.
+    void removeAggregatedRelations(lmdb::txn &txn,
+                                   lmdb::dbi &aggregationsDb,
+                                   const mtx::common::Relations &relations,
+                                   const std::string &event_id);
 
     //! retrieve a specific event from account data
     //! pass empty room_id for global account data
     std::optional<mtx::events::collections::RoomAccountDataEvents>
     getAccountData(lmdb::txn &txn, mtx::events::EventType type, const std::string &room_id);
-    bool isHiddenEvent(lmdb::txn &txn,
-                       mtx::events::collections::TimelineEvents e,
-                       const std::string &room_id);
+    //! The event types hidden in a room. Read once per batch of timeline events.
+    std::vector<mtx::events::EventType> hiddenEventTypes(lmdb::txn &txn,
+                                                         const std::string &room_id);
+    //! Decides once, when the event is stored, if it is hidden and records its type and
+    //! visibility in the order entry. The type of an encrypted event is taken from its
+    //! unencrypted relation or from `decrypted`. Without a batch, i.e. for the initial sync,
+    //! backfilled and pending events, it is decrypted without storing anything.
+    bool classifyEvent(nlohmann::json &orderEntry,
+                       const mtx::events::collections::TimelineEvents &e,
+                       const std::string &room_id,
+                       const std::vector<mtx::events::EventType> &hiddenTypes,
+                       olm::SyncDecryptionBatch *decrypted);
+    //! Applies changed hidden event types to the stored types and rebuilds the message order.
+    //! Returns false if the visibility of no event changed.
+    bool reclassifyHiddenEvents(lmdb::txn &txn, const std::string &room_id);
 
     //! Remove a room from the cache.
     // void removeLeftRoom(lmdb::txn &txn, const std::string &room_id);
@@ -404,11 +586,15 @@ private:
                 // Lightweight representation of a member.
                 MemberInfo tmp{display_name, e->content.avatar_url};
 
+                std::string_view previous;
+                bool newMember = !membersdb.get(txn, e->state_key, previous);
                 membersdb.put(txn, e->state_key, nlohmann::json(tmp).dump());
+                addToUserDirectory(txn, e->state_key, tmp, newMember);
                 break;
             }
             default: {
-                membersdb.del(txn, e->state_key, "");
+                if (membersdb.del(txn, e->state_key, ""))
+                    removeFromUserDirectory(txn, e->state_key);
                 break;
             }
             }
@@ -422,33 +608,23 @@ private:
         std::visit(
           [&txn, &statesdb, &stateskeydb, &eventsDb, &membersdb](const auto &e) {
               if constexpr (isStateEvent_<decltype(e)>) {
-                  eventsDb.put(txn, e.event_id, nlohmann::json(e).dump());
+                  eventsDb.put(txn, e.event_id, encodeStoredEvent(nlohmann::json(e)));
 
                   if (e.type != EventType::Unsupported) {
                       if (std::is_same_v<std::remove_cv_t<std::remove_reference_t<decltype(e)>>,
                                          StateEvent<mtx::events::msg::Redacted>>) {
-                          if (e.type == EventType::RoomMember)
-                              membersdb.del(txn, e.state_key, "");
-                          else if (e.state_key.empty())
+                          if (e.type == EventType::RoomMember) {
+                              if (membersdb.del(txn, e.state_key, ""))
+                                  removeFromUserDirectory(txn, e.state_key);
+                          } else if (e.state_key.empty())
                               statesdb.del(txn, to_string(e.type));
                           else
-                              stateskeydb.del(txn,
-                                              to_string(e.type),
-                                              nlohmann::json::object({
-                                                             {"key", e.state_key},
-                                                             {"id", e.event_id},
-                                                           })
-                                                .dump());
+                              stateskeydb.del(txn, stateKeyIndexKey(to_string(e.type), e.state_key));
                       } else if (e.state_key.empty())
                           statesdb.put(txn, to_string(e.type), nlohmann::json(e).dump());
                       else
-                          stateskeydb.put(txn,
-                                          to_string(e.type),
-                                          nlohmann::json::object({
-                                                         {"key", e.state_key},
-                                                         {"id", e.event_id},
-                                                       })
-                                            .dump());
+                          stateskeydb.put(
+                            txn, stateKeyIndexKey(to_string(e.type), e.state_key), e.event_id);
                   }
               }
           },
@@ -475,23 +651,16 @@ private:
                     return std::nullopt;
                 }
             } else {
-                auto db                   = getStatesKeyDb(txn, room_id);
-                std::string d             = nlohmann::json::object({{"key", state_key}}).dump();
-                std::string_view data     = d;
-                std::string_view typeStrV = typeStr;
-
-                auto cursor = lmdb::cursor::open(txn, db);
-                if (!cursor.get(typeStrV, data, MDB_GET_BOTH))
+                auto db = getStatesKeyDb(txn, room_id);
+                std::string_view event_id;
+                if (!db.get(txn, stateKeyIndexKey(typeStr, state_key), event_id))
                     return std::nullopt;
 
-                try {
-                    auto eventsDb = getEventsDb(txn, room_id);
-                    if (!eventsDb.get(
-                          txn, nlohmann::json::parse(data)["id"].get<std::string>(), value))
-                        return std::nullopt;
-                } catch (std::exception &e) {
+                auto eventsDb = getEventsDb(txn, room_id);
+                if (!eventsDb.get(txn, event_id, value))
                     return std::nullopt;
-                }
+
+                return decodeStoredEvent(value).get<mtx::events::StateEvent<T>>();
             }
 
             return nlohmann::json::parse(value).get<mtx::events::StateEvent<T>>();
@@ -513,27 +682,27 @@ private:
         std::vector<mtx::events::StateEvent<T>> events;
 
         {
-            auto db                   = getStatesKeyDb(txn, room_id);
-            auto eventsDb             = getEventsDb(txn, room_id);
-            const auto typeStr        = to_string(type);
-            std::string_view typeStrV = typeStr;
-            std::string_view data;
+            auto db              = getStatesKeyDb(txn, room_id);
+            auto eventsDb        = getEventsDb(txn, room_id);
+            const auto prefix    = stateKeyIndexKey(to_string(type), "");
+            std::string_view key = prefix;
+            std::string_view event_id;
             std::string_view value;
 
             auto cursor = lmdb::cursor::open(txn, db);
             bool first  = true;
-            if (cursor.get(typeStrV, data, MDB_SET)) {
-                while (cursor.get(typeStrV, data, first ? MDB_FIRST_DUP : MDB_NEXT_DUP)) {
-                    first = false;
-
-                    try {
-                        if (eventsDb.get(
-                              txn, nlohmann::json::parse(data)["id"].get<std::string>(), value))
-                            events.push_back(
-                              nlohmann::json::parse(value).get<mtx::events::StateEvent<T>>());
-                    } catch (std::exception &e) {
-                        nhlog::db()->warn("Failed to parse state event: {}", e.what());
-                    }
+            while (cursor.get(key, event_id, first ? MDB_SET_RANGE : MDB_NEXT)) {
+                first = false;
+
+                if (key.substr(0, prefix.size()) != prefix)
+                    break;
+
+                try {
+                    if (eventsDb.get(txn, event_id, value))
+                        events.push_back(
+                          decodeStoredEvent(value).get<mtx::events::StateEvent<T>>());
+                } catch (std::exception &e) {
+                    nhlog::db()->warn("Failed to parse state event: {}", e.what());
                 }
             }
         }
@@ -563,94 +732,144 @@ private:
                       const std::set<std::string> &spaces_with_updates,
                       std::set<std::string> rooms_with_updates);
 
+    //! Records the current name and avatar of a member. `joinedRoom` counts a new shared room.
+    void addToUserDirectory(lmdb::txn &txn,
+                            const std::string &user_id,
+                            const MemberInfo &member,
+                            bool joinedRoom);
+    //! Forgets one shared room of a user and the user with the last one.
+    void removeFromUserDirectory(lmdb::txn &txn, const std::string &user_id);
+
+    //! Per room databases, whose handles are kept in a registry once they are known to the
+    //! env. A handle only survives its transaction when it is committed, so misses just open
+    //! the db in the callers transaction and the room gets registered after the next sync.
+    enum class RoomDb : uint8_t
+    {
+        Events,
+        EventOrder,
+        EventToOrder,
+        MessageToOrder,
+        OrderToMessage,
+        Pending,
+        PendingIndex,
+        Relations,
+        RelationAggregations,
+        States,
+        StatesKey,
+        Members,
+        Mentions,
+        Count,
+    };
+    using RoomDbis = std::array<MDB_dbi, static_cast<size_t>(RoomDb::Count)>;
+
+    lmdb::dbi roomDb(lmdb::txn &txn, const std::string &room_id, RoomDb db);
+    //! Opens the dbs of rooms that missed the registry in their own transaction and keeps
+    //! their handles. Must not be called while a write transaction is open on this thread.
+    void registerPendingRoomDbis();
+    void dropRoomDbis(const std::string &room_id);
+
+    //! Opens a db after the setup. mdb_dbi_open must not run concurrently, but since the syncs
+    //! are stored on their own thread, readers and the writer may both miss a handle.
+    lmdb::dbi openDbi(lmdb::txn &txn, const std::string &name, unsigned int flags = 0)
+    {
+        std::lock_guard<std::mutex> lock(dbi_open_mtx_);
+        return lmdb::dbi::open(txn, name.c_str(), flags);
+    }
+
     lmdb::dbi getPendingReceiptsDb(lmdb::txn &txn)
     {
-        return lmdb::dbi::open(txn, "pending_receipts", MDB_CREATE);
+        return openDbi(txn, "pending_receipts", MDB_CREATE);
     }
 
     lmdb::dbi getEventsDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/events").c_str(), MDB_CREATE);
+        return roomDb(txn, room_id, RoomDb::Events);
     }
 
     lmdb::dbi getEventOrderDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(
-          txn, std::string(room_id + "/event_order").c_str(), MDB_CREATE | MDB_INTEGERKEY);
+        return roomDb(txn, room_id, RoomDb::EventOrder);
     }
 
     // inverse of EventOrderDb
     lmdb::dbi getEventToOrderDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/event2order").c_str(), MDB_CREATE);
+        return roomDb(txn, room_id, RoomDb::EventToOrder);
     }
 
     lmdb::dbi getMessageToOrderDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/msg2order").c_str(), MDB_CREATE);
+        return roomDb(txn, room_id, RoomDb::MessageToOrder);
     }
 
     lmdb::dbi getOrderToMessageDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(
-          txn, std::string(room_id + "/order2msg").c_str(), MDB_CREATE | MDB_INTEGERKEY);
+        return roomDb(txn, room_id, RoomDb::OrderToMessage);
     }
 
+    //! Queue of the messages to send, maps a sequence number to the transaction id.
     lmdb::dbi getPendingMessagesDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(
-          txn, std::string(room_id + "/pending").c_str(), MDB_CREATE | MDB_INTEGERKEY);
+        return roomDb(txn, room_id, RoomDb::Pending);
+    }
+
+    //! inverse of PendingMessagesDb
+    lmdb::dbi getPendingIndexDb(lmdb::txn &txn, const std::string &room_id)
+    {
+        return roomDb(txn, room_id, RoomDb::PendingIndex);
     }
 
     lmdb::dbi getRelationsDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(
-          txn, std::string(room_id + "/related").c_str(), MDB_CREATE | MDB_DUPSORT);
+        return roomDb(txn, room_id, RoomDb::Relations);
+    }
+
+    //! Maps an event id to the RelationAggregation of its edits and reactions.
+    lmdb::dbi getRelationAggregationsDb(lmdb::txn &txn, const std::string &room_id)
+    {
+        return roomDb(txn, room_id, RoomDb::RelationAggregations);
     }
 
     lmdb::dbi getInviteStatesDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/invite_state").c_str(), MDB_CREATE);
+        return openDbi(txn, room_id + "/invite_state", MDB_CREATE);
     }
 
     lmdb::dbi getInviteMembersDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/invite_members").c_str(), MDB_CREATE);
+        return openDbi(txn, room_id + "/invite_members", MDB_CREATE);
     }
 
     lmdb::dbi getStatesDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/state").c_str(), MDB_CREATE);
+        return roomDb(txn, room_id, RoomDb::States);
     }
 
     lmdb::dbi getStatesKeyDb(lmdb::txn &txn, const std::string &room_id)
     {
-        auto db = lmdb::dbi::open(
-          txn, std::string(room_id + "/state_by_key").c_str(), MDB_CREATE | MDB_DUPSORT);
-        lmdb::dbi_set_dupsort(txn, db, compare_state_key);
-        return db;
+        return roomDb(txn, room_id, RoomDb::StatesKey);
     }
 
     lmdb::dbi getAccountDataDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/account_data").c_str(), MDB_CREATE);
+        return openDbi(txn, room_id + "/account_data", MDB_CREATE);
     }
 
     lmdb::dbi getMembersDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/members").c_str(), MDB_CREATE);
+        return roomDb(txn, room_id, RoomDb::Members);
     }
 
     lmdb::dbi getMentionsDb(lmdb::txn &txn, const std::string &room_id)
     {
-        return lmdb::dbi::open(txn, std::string(room_id + "/mentions").c_str(), MDB_CREATE);
+        return roomDb(txn, room_id, RoomDb::Mentions);
     }
 
-    lmdb::dbi getUserKeysDb(lmdb::txn &txn) { return lmdb::dbi::open(txn, "user_key", MDB_CREATE); }
+    lmdb::dbi getUserKeysDb(lmdb::txn &txn) { return openDbi(txn, "user_key", MDB_CREATE); }
 
     lmdb::dbi getVerificationDb(lmdb::txn &txn)
     {
-        return lmdb::dbi::open(txn, "verified", MDB_CREATE);
+        return openDbi(txn, "verified", MDB_CREATE);
     }
 
     //! Retrieves or creates the database that stores the open OLM sessions between our device
@@ -659,9 +878,12 @@ private:
     //! Each entry is a map from the session_id to the pickled representation of the session.
     lmdb::dbi getOlmSessionsDb(lmdb::txn &txn, const std::string &curve25519_key)
     {
-        return lmdb::dbi::open(
-          txn, std::string("olm_sessions.v2/" + curve25519_key).c_str(), MDB_CREATE);
+        return openDbi(txn, "olm_sessions.v2/" + curve25519_key, MDB_CREATE);
     }
+    //! Returns the registered handle of a device's olm session db for readers, or nullopt if
+    //! there are no sessions with that device. On a miss the handle is opened in a short write
+    //! transaction, so no transaction may be open on this thread.
+    std::optional<lmdb::dbi> olmSessionsDb(const std::string &curve25519_key);
 
     QString getDisplayName(const mtx::events::StateEvent<mtx::events::state::Member> &event)
     {
@@ -673,6 +895,13 @@ private:
 
     std::optional<VerificationCache> verificationCache(const std::string &user_id, lmdb::txn &txn);
     VerificationStatus verificationStatus_(const std::string &user_id, lmdb::txn &txn);
+    //! Verifies a signature, remembering the result for the same key, signature and object.
+    //! verification_storage_mtx must be held.
+    bool verifySignature_(const std::string &signing_key,
+                          nlohmann::json object,
+                          const std::string &signature);
+    //! Imports one chunk of session keys in a single write transaction.
+    std::size_t importSessionKeyChunk(const mtx::crypto::ExportedSessionKeys &keys);
     std::optional<UserKeyCache> userKeys_(const std::string &user_id, lmdb::txn &txn);
 
     void setNextBatchToken(lmdb::txn &txn, const std::string &token);
@@ -685,6 +914,8 @@ private:
     lmdb::dbi readReceiptsDb_;
     lmdb::dbi notificationsDb_;
     lmdb::dbi presenceDb_;
+    lmdb::dbi userDirectoryDb_;
+    lmdb::dbi userDirectoryIndexDb_;
 
     lmdb::dbi devicesDb_;
     lmdb::dbi deviceKeysDb_;
@@ -693,6 +924,11 @@ private:
     lmdb::dbi outboundMegolmSessionDb_;
     lmdb::dbi megolmSessionDataDb_;
 
+    MegolmSessionCache megolmSessionCache_;
+
+    lmdb::dbi olmSessionsByUseDb_;
+    OlmSessionCache olmSessionCache_;
+
     lmdb::dbi encryptedRooms_;
 
     QString localUserId_;
@@ -704,6 +940,29 @@ private:
     SecretsStorage secret_storage;
 
     bool databaseReady_ = false;
+
+    //! Serializes mdb_dbi_open, see openDbi.
+    std::mutex dbi_open_mtx_;
+    std::mutex room_dbis_mtx_;
+    std::unordered_map<std::string, RoomDbis> room_dbis_;
+    std::set<std::string> pending_room_dbis_;
+    std::atomic<uint64_t> room_dbi_hits_{0};
+    std::atomic<uint64_t> room_dbi_misses_{0};
+
+    //! Room the last pruning run stopped at. Only touched inside the write transaction.
+    std::string prune_resume_room_;
+
+    //! Olm session db handles by curve25519 key, nullopt if the db doesn't exist (yet).
+    std::mutex olm_session_dbis_mtx_;
+    std::unordered_map<std::string, std::optional<MDB_dbi>> olm_session_dbis_;
+
+    //! In memory table of the joined rooms' summaries. Writers commit while holding the
+    //! mutex, so that the table never differs from the last committed state.
+    std::mutex room_infos_mtx_;
+    bool room_infos_loaded_ = false;
+    std::unordered_map<std::string, RoomInfo> room_infos_;
+    //! Summaries changed in the open write transaction, nullopt for removed rooms.
+    std::map<std::string, std::optional<RoomInfo>> pending_room_infos_;
 };
 
 namespace cache {
@@ -16,6 +16,7 @@
 #include "EventAccessors.h"
 #include "Logging.h"
 #include "MatrixClient.h"
+#include "SyncWorker.h"
 #include "UserProfile.h"
 #include "UserSettings.h"
 #include "encryption/Olm.h"
@@ -137,6 +138,7 @@ Client::Client(QSharedPointer<UserSettings> userSettings)
     qRegisterMetaType<mtx::secret_storage::AesHmacSha2KeyDescription>();
     qRegisterMetaType<SecretsToDecrypt>();
     qRegisterMetaType<std::vector<DeviceInfo>>();
+    qRegisterMetaType<std::shared_ptr<olm::SyncDecryption>>();
 
     _verificationManager = new VerificationManager(this);
     _authentication = new Authentication();
@@ -322,10 +324,6 @@ Client::Client(QSharedPointer<UserSettings> userSettings)
     connect(this, &Client::prepareTimelines, this, &Client::prepareTimelinesCB, Qt::QueuedConnection);
     connect(this, &Client::initiateFinished, [this]() {
         this->callManager()->refreshTurnServer();
-        auto rooms = this->joinedRoomList();
-        for (const auto &roomid : rooms.keys()) {
-            QObject::connect(this->timeline(roomid), &Timeline::newCallEvent, callManager_, &CallManager::syncEvent, Qt::UniqueConnection);
-        }
     });
     connect(this, &Client::notificationsRetrieved, this, &Client::sendNotifications);
     connect(this,
@@ -381,8 +379,29 @@ Client::Client(QSharedPointer<UserSettings> userSettings)
       [this]() { QTimer::singleShot(RETRY_TIMEOUT, this, &Client::trySync); },
       Qt::QueuedConnection);
 
+    // The worker stays on this thread, if the sync should be stored synchronously. On the sync
+    // thread it lives as long as the client, stop() only pauses the thread, so that a later
+    // start() finds it again.
+    if (userSettings_->backgroundSync()) {
+        syncWorker_ = new SyncWorker();
+        syncThread_.setObjectName("sync_worker");
+        syncWorker_->moveToThread(&syncThread_);
+        syncThread_.start();
+    } else {
+        syncWorker_ = new SyncWorker(this);
+    }
+    connect(
+      this, &Client::newSyncResponse, syncWorker_, &SyncWorker::saveSync, Qt::QueuedConnection);
+    connect(syncWorker_, &SyncWorker::syncSaved, this, &Client::handleSyncResponse);
+    connect(syncWorker_, &SyncWorker::syncFailed, this, &Client::trySyncCb);
+    connect(this,
+            &Client::newInitialSyncResponse,
+            syncWorker_,
+            &SyncWorker::saveInitialSync,
+            Qt::QueuedConnection);
     connect(
-      this, &Client::newSyncResponse, this, &Client::handleSyncResponse, Qt::QueuedConnection);
+      syncWorker_, &SyncWorker::initialSyncSaved, this, &Client::handleInitialSyncResponse);
+    connect(syncWorker_, &SyncWorker::initialSyncFailed, this, &Client::startInitialSync);
 
     connect(this, &Client::dropToLogin, this, &Client::dropToLoginCb);
     connect(
@@ -603,8 +622,7 @@ Client::loadStateFromCache()
     connect(this, &Client::newSyncResponse, &Client::startRemoveFallbackKeyTimer);
     emit trySyncCb();
     emit prepareTimelines();
-    auto up = new UserProfile("",utils::localUser());
-    (void) up; //TODO: review
+    refreshOwnProfile();
 }
 
 void Client::prepareTimelinesCB(){
@@ -738,70 +756,49 @@ Client::startInitialSync()
             }
         }
 
-        QTimer::singleShot(0, this, [this, res] {
-        nhlog::net()->info("initial sync completed");
-        try {
-            cache::client()->saveState(res);
-            olm::handle_to_device_messages(res.to_device.events);
-            cache::calculateRoomReadStatus();
-            changeInitialSyncStatge(false);
-            emit initialSync(std::move(res));
-        } catch (const lmdb::error &e) {
-            nhlog::db()->error("failed to save state after initial sync: {}", e.what());
-            startInitialSync();
-            return;
-        }
-        _presenceEmitter->sync(res.presence);
-        emit trySyncCb();
-        emit prepareTimelines();
-        auto up = new UserProfile("",utils::localUser());
-        (void) up; //TODO: review
-    });
+        emit newInitialSyncResponse(res);
     });
 }
 
 void
-Client::handleSyncResponse(const mtx::responses::Sync &res, const QString &prev_batch_token)
+Client::handleInitialSyncResponse(const mtx::responses::Sync &res)
 {
     try {
-        if (prev_batch_token.toStdString() != cache::nextBatchToken()) {
-            nhlog::net()->warn("Duplicate sync, dropping");
-            return;
-        }
+        olm::handle_to_device_messages(res.to_device.events);
+        changeInitialSyncStatge(false);
+        emit initialSync(res);
     } catch (const lmdb::error &e) {
-        nhlog::db()->warn("Logged out in the mean time, dropping sync");
+        nhlog::db()->error("failed to handle initial sync: {}", e.what());
+        startInitialSync();
         return;
     }
+    _presenceEmitter->sync(res.presence);
+    emit trySyncCb();
+    emit prepareTimelines();
+    refreshOwnProfile();
+}
 
-    nhlog::net()->debug("sync completed: {}", res.next_batch);
-
+void
+Client::handleSyncResponse(const mtx::responses::Sync &res,
+                           const QMap<QString, RoomInfo> &rooms,
+                           std::shared_ptr<olm::SyncDecryption> decrypted)
+{
     // Ensure that we have enough one-time keys available.
     ensureOneTimeKeyCount(res.device_one_time_keys_count, res.device_unused_fallback_key_types);
 
-    // TODO: fine grained error handling
     try {
-        cache::client()->saveState(res);
         olm::handle_to_device_messages(res.to_device.events);
 
-        auto updates = cache::getRoomInfo(cache::client()->roomsWithStateUpdates(res));
         changeInitialSyncStatge(false);
+        if (!rooms.isEmpty())
+            emit roomsUpdated(rooms);
         if( res.rooms.join.size() || res.rooms.invite.size() || res.rooms.leave.size()) {
-            syncTimelines(res.rooms);
+            syncTimelines(res.rooms, *decrypted);
             emit newUpdate(res);
         }
         _presenceEmitter->sync(res.presence);
-        // if we process a lot of syncs (1 every 200ms), this means we clean the
-        // db every 100s
-        static int syncCounter = 0;
-        if (syncCounter++ >= 500) {
-            cache::deleteOldData();
-            syncCounter = 0;
-        }
-    } catch (const lmdb::map_full_error &e) {
-        nhlog::db()->error("lmdb is full: {}", e.what());
-        cache::deleteOldData();
     } catch (const lmdb::error &e) {
-        nhlog::db()->error("saving sync response: {}", e.what());
+        nhlog::db()->error("handling sync response: {}", e.what());
     }
 
     emit trySyncCb();
@@ -872,7 +869,6 @@ Client::joinRoomVia(const QString &room_id,
           }
 
           emit joinedRoom(QString::fromStdString(roomId.room_id));
-          connect(this->timeline(room_id), &Timeline::newCallEvent, callManager_, &CallManager::syncEvent, Qt::UniqueConnection);
 
           // We remove any invites with the same room_id.
           try {
@@ -905,7 +901,6 @@ Client::createRoom(const mtx::requests::CreateRoom &req)
           }
 
           nhlog::net()->info("Room {} created.",res.room_id.to_string());
-          QObject::connect(this->timeline(QString::fromStdString(res.room_id.to_string())), &Timeline::newCallEvent, callManager_, &CallManager::syncEvent, Qt::UniqueConnection);
           emit roomCreated(QString::fromStdString(res.room_id.to_string()));
       });
 }
@@ -958,7 +953,8 @@ Client::inviteUser(const QString &roomid,const QString &userid, const QString &r
 void
 Client::receivedSessionKey(const QString &room_id, const QString &session_id)
 {
-    if(auto tl = timeline(room_id))
+    // rooms without a timeline have no pending key requests
+    if(auto tl = _timelines.value(room_id))
         tl->receivedSessionKey(session_id.toStdString());
 }
 
@@ -1101,6 +1097,20 @@ Client::removeOldFallbackKey()
     olm::mark_keys_as_published();
 }
 
+void
+Client::refreshOwnProfile()
+{
+    const auto userid = utils::localUser();
+    if (ownProfile_ && ownProfile_->userid() == userid) {
+        ownProfile_->fetchDeviceList(userid);
+        return;
+    }
+
+    if (ownProfile_)
+        ownProfile_->deleteLater();
+    ownProfile_ = new UserProfile(QString(), userid, this);
+}
+
 void
 Client::getProfileInfo(QString userid)
 {
@@ -1390,6 +1400,8 @@ void Client::start(QString userId, QString homeServer, QString token){
             return;
         }
     }
+    if (syncWorker_->thread() == &syncThread_ && !syncThread_.isRunning())
+        syncThread_.start();
     bootstrap(userId.toStdString(), homeServer.toStdString(), token.toStdString());
 }
 
@@ -1399,45 +1411,149 @@ void Client::stop(){
         http::client()->close(true);
         nhlog::net()->debug("bye");
     }
+    if (syncThread_.isRunning()) {
+        syncThread_.quit();
+        syncThread_.wait();
+    }
 }
 
-void Client::syncTimelines(const mtx::responses::Rooms &rooms){
+Client::~Client()
+{
+    syncThread_.quit();
+    syncThread_.wait();
+
+    // a worker on the sync thread has no parent
+    if (syncWorker_ && syncWorker_->thread() == &syncThread_)
+        delete syncWorker_;
+    syncWorker_ = nullptr;
+}
+
+namespace {
+//! Whether the sync of a room carries events, that its timeline has to handle right away, like
+//! calls and verification requests. Recent encrypted events are decrypted into `decrypted` to
+//! look at their real type, the timeline then reuses those results.
+bool
+needsLiveTimeline(const mtx::responses::Timeline &timeline, olm::SyncDecryptionBatch &decrypted)
+{
+    using namespace mtx::events;
+    // calls and verification requests time out, so older events can wait
+    const auto liveSince = QDateTime::currentDateTime().addSecs(-10 * 60);
+
+    for (const auto &e : timeline.events) {
+        if (mtx::accessors::origin_server_ts(e) < liveSince)
+            continue;
+
+        const auto *event = &e;
+        if (auto encrypted = std::get_if<EncryptedEvent<msg::Encrypted>>(&e)) {
+            const auto &result = decrypted.decrypt(*encrypted);
+            // an event we can't decrypt can't be handled by the timeline either
+            if (!result.event)
+                continue;
+            event = &result.event.value();
+        }
+
+        if (std::holds_alternative<RoomEvent<voip::CallInvite>>(*event) ||
+            std::holds_alternative<RoomEvent<voip::CallCandidates>>(*event) ||
+            std::holds_alternative<RoomEvent<voip::CallAnswer>>(*event) ||
+            std::holds_alternative<RoomEvent<voip::CallHangUp>>(*event) ||
+            std::holds_alternative<RoomEvent<msg::KeyVerificationRequest>>(*event) ||
+            std::holds_alternative<RoomEvent<msg::KeyVerificationStart>>(*event) ||
+            std::holds_alternative<RoomEvent<msg::KeyVerificationAccept>>(*event) ||
+            std::holds_alternative<RoomEvent<msg::KeyVerificationKey>>(*event) ||
+            std::holds_alternative<RoomEvent<msg::KeyVerificationMac>>(*event) ||
+            std::holds_alternative<RoomEvent<msg::KeyVerificationReady>>(*event) ||
+            std::holds_alternative<RoomEvent<msg::KeyVerificationDone>>(*event) ||
+            std::holds_alternative<RoomEvent<msg::KeyVerificationCancel>>(*event))
+            return true;
+    }
+    return false;
+}
+}
+
+void Client::syncTimelines(const mtx::responses::Rooms &rooms, olm::SyncDecryption &decrypted){
+    // the sync was already stored, so rooms without a timeline read it from the cache later
+    const bool lazy = UserSettings::instance()->lazyTimelines();
     for(auto const &r: rooms.join){
-        addTimeline(QString::fromStdString(r.first));
-        syncTimeline(QString::fromStdString(r.first), r.second);
+        auto roomId = QString::fromStdString(r.first);
+        // decrypted when the sync was stored, the check and the timeline reuse it
+        auto &batch = decrypted.try_emplace(r.first, r.first).first->second;
+        if(lazy && !_timelines.contains(roomId) && !needsLiveTimeline(r.second.timeline, batch)){
+            _lazyRooms.insert(roomId);
+            continue;
+        }
+        addTimeline(roomId);
+        syncTimeline(roomId, r.second, batch);
     }
     for(auto const &r: rooms.invite){
-        addTimeline(QString::fromStdString(r.first));
+        auto roomId = QString::fromStdString(r.first);
+        if(lazy && !_timelines.contains(roomId))
+            _lazyRooms.insert(roomId);
+        else
+            addTimeline(roomId);
     }
     for(auto const &r: rooms.leave){
         removeTimeline(QString::fromStdString(r.first));
     }
 }
 
-void Client::syncTimeline(const QString &roomId, const mtx::responses::JoinedRoom &room){
+void Client::syncTimeline(const QString &roomId, const mtx::responses::JoinedRoom &room,
+                          olm::SyncDecryptionBatch &decrypted){
     auto it = _timelines.find(roomId);
     if(it != _timelines.end()){
-        it.value()->sync(room);
+        it.value()->sync(room, decrypted);
     }
 }
 
 void Client::createTimelinesFromDB(){
-    auto rooms = joinedRoomList();
-    for(auto const &r: rooms.toStdMap()){
-        addTimeline(r.first);
+    if(!UserSettings::instance()->lazyTimelines()){
+        auto rooms = joinedRoomList();
+        for(auto const &r: rooms.toStdMap()){
+            addTimeline(r.first);
+        }
+        return;
+    }
+
+    for(const auto &room_id: cache::joinedRooms()){
+        auto roomId = QString::fromStdString(room_id);
+        // only a timeline sends its pending messages
+        if(cache::client()->pendingEvents(room_id).empty())
+            _lazyRooms.insert(roomId);
+        else
+            addTimeline(roomId);
     }
+    nhlog::ui()->info("Created {} timelines, {} rooms are loaded on demand",
+                      _timelines.size(),
+                      _lazyRooms.size());
 }
 
-void Client::addTimeline(const QString &roomID){
+Timeline *Client::timeline(const QString &roomID){
     auto it = _timelines.find(roomID);
-    if(it == _timelines.end()){
-        _timelines[roomID] = new Timeline(roomID);
-        connect(_timelines[roomID], &Timeline::forwardToRoom, this, &Client::forwardMessageToRoom);
-        _timelines[roomID]->initialSync();
+    if(it != _timelines.end()){
+        return it.value();
     }
+    if(_lazyRooms.contains(roomID)){
+        return addTimeline(roomID);
+    }
+    return nullptr;
+}
+
+Timeline *Client::addTimeline(const QString &roomID){
+    auto it = _timelines.find(roomID);
+    if(it != _timelines.end()){
+        return it.value();
+    }
+
+    _lazyRooms.remove(roomID);
+    auto timeline = new Timeline(roomID);
+    _timelines[roomID] = timeline;
+    connect(timeline, &Timeline::forwardToRoom, this, &Client::forwardMessageToRoom);
+    connect(timeline, &Timeline::newCallEvent, callManager_, &CallManager::syncEvent, Qt::UniqueConnection);
+    timeline->initialSync();
+    return timeline;
 }
 
 void Client::removeTimeline(const QString &roomID){
+    _lazyRooms.remove(roomID);
     auto it = _timelines.find(roomID);
     if(it != _timelines.end()){
         auto timeline = _timelines[roomID];
@@ -1489,28 +1605,21 @@ QVariantMap Client::loginOptions(const QString &server){
     return loginOptions;
 }
 
-QVector<UserInformation> Client::knownUsers(const QString &filter){
+QVector<UserInformation> Client::knownUsers(const QString &filter, int limit){
     QVector<UserInformation> knownUsers;
-    for(auto const& t: _timelines.toStdMap()){
-        auto members = t.second->getMembers();
-        for(auto const &m: members){
-            if(m.user_id != UserSettings::instance()->userId() && (m.user_id.contains(filter) || m.display_name.contains(filter))){
-                UserInformation uinfo;
-                uinfo.userId = m.user_id;
-                uinfo.displayName = m.display_name;
-                uinfo.avatarUrl = t.second->avatarUrl(m.user_id);
-                // check dupplication
-                bool dupplicate = false;
-                for(auto const &ku: knownUsers){
-                    if(ku.userId == uinfo.userId){
-                        dupplicate = true;
-                        break;
-                    }
-                }
-                if(!dupplicate) 
-                    knownUsers.push_back(uinfo);
-            }
-        }
+    const auto self = UserSettings::instance()->userId().toStdString();
+    // one more, in case our own user is part of the result
+    for(const auto &user: cache::client()->searchUserDirectory(filter.toStdString(), limit + 1)){
+        if(user.user_id == self)
+            continue;
+        if(knownUsers.size() == limit)
+            break;
+
+        UserInformation uinfo;
+        uinfo.userId = QString::fromStdString(user.user_id);
+        uinfo.displayName = QString::fromStdString(user.display_name);
+        uinfo.avatarUrl = QString::fromStdString(user.avatar_url);
+        knownUsers.push_back(uinfo);
     }
     return knownUsers;
 }
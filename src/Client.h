@@ -21,6 +21,8 @@
 
 #include <QMap>
 #include <QPoint>
+#include <QSet>
+#include <QThread>
 #include <QTimer>
 #include <QStandardPaths>
 #include "Features.h"
@@ -44,6 +46,8 @@
 
 class UserSettings;
 class CallManager;
+class SyncWorker;
+class UserProfile;
 
 namespace mtx::requests {
 struct CreateRoom;
@@ -71,18 +75,14 @@ public:
         }
         return instance_; 
     }
+    ~Client() override;
     QSharedPointer<UserSettings> userSettings() { return userSettings_; }
     void deleteConfigs();
     QString status() const;
     void setStatus(const QString &status);
     mtx::presence::PresenceState currentPresence() const;
-    Timeline * timeline(const QString &roomID){
-        auto it = _timelines.find(roomID);
-        if(it != _timelines.end()){
-            return it.value();
-        }
-        return nullptr;
-    }
+    //! The timeline of a joined or invited room. In lazy mode it is created on first use.
+    Timeline * timeline(const QString &roomID);
 
     VerificationManager *verificationManager() { return _verificationManager; }
     Q_INVOKABLE PresenceEmitter *presenceEmitter() { return _presenceEmitter; }
@@ -98,7 +98,8 @@ public:
                       .toStdString(), enable, enableDebugLogs);    
     }
     Q_INVOKABLE QVariantMap loginOptions(const QString & server);
-    Q_INVOKABLE QVector<UserInformation> knownUsers(const QString &filter = "");
+    //! Users sharing a room with us, whose user id or display name starts with `filter`.
+    Q_INVOKABLE QVector<UserInformation> knownUsers(const QString &filter = "", int limit = 100);
 
     CallManager *callManager() { return callManager_; }
 
@@ -167,6 +168,9 @@ signals:
     void tryDelayedSyncCb();
     void tryInitialSyncCb();
     void newSyncResponse(const mtx::responses::Sync &res, const QString &prev_batch_token);
+    void newInitialSyncResponse(const mtx::responses::Sync &res);
+    //! Rooms, whose state was changed by the last sync.
+    void roomsUpdated(const QMap<QString, RoomInfo> &rooms);
     void initiateFinished();
     void newUpdate(const mtx::responses::Sync &sync);
     void initialSync(const mtx::responses::Sync &sync);
@@ -209,7 +213,10 @@ private slots:
     void loginCb(const mtx::responses::Login &res);
     void removeRoom(const QString &room_id);
     void dropToLoginCb(const QString &msg);
-    void handleSyncResponse(const mtx::responses::Sync &res, const QString &prev_batch_token);
+    void handleSyncResponse(const mtx::responses::Sync &res,
+                            const QMap<QString, RoomInfo> &rooms,
+                            std::shared_ptr<olm::SyncDecryption> decrypted);
+    void handleInitialSyncResponse(const mtx::responses::Sync &res);
     void prepareTimelinesCB();
     void removeOldFallbackKey();
 
@@ -225,6 +232,8 @@ private:
 #endif
     QString _clientName;
     QMap<QString, Timeline *> _timelines;
+    //! Known rooms without a timeline yet, see UserSettings::lazyTimelines.
+    QSet<QString> _lazyRooms;
     bool                    _isInitialSync = true;
     Client(QSharedPointer<UserSettings> userSettings = UserSettings::initialize(std::nullopt));
     void startInitialSync();
@@ -234,11 +243,14 @@ private:
     void ensureOneTimeKeyCount(const std::map<std::string, uint16_t> &counts,
                                const std::optional<std::vector<std::string>> &fallback_keys);
     void getBackupVersion();
+    //! Loads our own profile and device list, after the cache was restored or initially synced.
+    void refreshOwnProfile();
     void bootstrap(std::string userid, std::string homeserver, std::string token);
-    void syncTimelines(const mtx::responses::Rooms &rooms);
-    void syncTimeline(const QString &roomId, const mtx::responses::JoinedRoom &room);
+    void syncTimelines(const mtx::responses::Rooms &rooms, olm::SyncDecryption &decrypted);
+    void syncTimeline(const QString &roomId, const mtx::responses::JoinedRoom &room,
+                      olm::SyncDecryptionBatch &decrypted);
     void createTimelinesFromDB();
-    void addTimeline(const QString &roomID); 
+    Timeline *addTimeline(const QString &roomID); 
     void removeTimeline(const QString &roomID); 
     void loginDone(const UserInformation &user);
     void changeInitialSyncStatge(bool state);
@@ -256,8 +268,12 @@ private:
     void sendNotifications(const mtx::responses::Notifications &);
 
     QTimer connectivityTimer_;
+    //! Stores the syncs, either on syncThread_ or synchronously on this thread.
+    SyncWorker *syncWorker_ = nullptr;
+    QThread syncThread_;
     VerificationManager *_verificationManager = nullptr;
     PresenceEmitter *_presenceEmitter = nullptr;
+    UserProfile *ownProfile_ = nullptr;
     std::atomic_bool isConnected_;
     // Global user settings.
     QSharedPointer<UserSettings> userSettings_;    
@@ -0,0 +1,147 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "MegolmSessionCache.h"
+
+#include <olm/olm.h>
+
+MegolmSessionCache::EntryPtr
+MegolmSessionCache::get(const MegolmSessionIndex &index)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    auto it = items_.find(Key{index.room_id, index.session_id});
+    if (it == items_.end()) {
+        misses_++;
+        return nullptr;
+    }
+
+    hits_++;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->entry;
+}
+
+MegolmSessionCache::EntryPtr
+MegolmSessionCache::put(const MegolmSessionIndex &index,
+                        mtx::crypto::InboundGroupSessionPtr session)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return putLocked(index, std::move(session));
+}
+
+MegolmSessionCache::EntryPtr
+MegolmSessionCache::putLocked(const MegolmSessionIndex &index,
+                              mtx::crypto::InboundGroupSessionPtr session)
+{
+    auto entry     = std::make_shared<Entry>();
+    entry->session = std::move(session);
+
+    Key key{index.room_id, index.session_id};
+    auto size = entrySize(key);
+
+    if (auto it = items_.find(key); it != items_.end()) {
+        it->second->entry->invalidated = true;
+        bytes_ -= it->second->size;
+        lru_.erase(it->second);
+        items_.erase(it);
+    }
+
+    if (size > max_bytes_)
+        return entry;
+
+    lru_.push_front(Item{key, entry, size});
+    items_.emplace(std::move(key), lru_.begin());
+    bytes_ += size;
+    evict();
+
+    return entry;
+}
+
+MegolmSessionCache::EntryPtr
+MegolmSessionCache::putLoaded(const MegolmSessionIndex &index,
+                              mtx::crypto::InboundGroupSessionPtr session,
+                              uint64_t sequence)
+{
+    {
+        // writers invalidate while holding the cache mutex, so checking under it is enough
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (sequence % 2 == 0 && write_seq_ == sequence)
+            return putLocked(index, std::move(session));
+    }
+
+    auto entry         = std::make_shared<Entry>();
+    entry->session     = std::move(session);
+    entry->invalidated = true;
+    return entry;
+}
+
+void
+MegolmSessionCache::invalidate(const MegolmSessionIndex &index)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    auto it = items_.find(Key{index.room_id, index.session_id});
+    if (it == items_.end())
+        return;
+
+    it->second->entry->invalidated = true;
+    bytes_ -= it->second->size;
+    lru_.erase(it->second);
+    items_.erase(it);
+}
+
+void
+MegolmSessionCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    for (auto &item : lru_)
+        item.entry->invalidated = true;
+
+    lru_.clear();
+    items_.clear();
+    bytes_ = 0;
+}
+
+void
+MegolmSessionCache::setMaxBytes(std::size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    max_bytes_ = max_bytes;
+    evict();
+}
+
+std::size_t
+MegolmSessionCache::maxBytes() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return max_bytes_;
+}
+
+std::size_t
+MegolmSessionCache::bytes() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return bytes_;
+}
+
+std::size_t
+MegolmSessionCache::entrySize(const Key &key)
+{
+    // the olm session itself, the key stored twice and the list and map nodes
+    return olm_inbound_group_session_size() + sizeof(Entry) + sizeof(Item) +
+           2 * (key.first.size() + key.second.size()) + 64;
+}
+
+void
+MegolmSessionCache::evict()
+{
+    // Evicted entries stay valid for users still holding them, only the cache forgets them.
+    while (bytes_ > max_bytes_ && !lru_.empty()) {
+        auto &item = lru_.back();
+        bytes_ -= item.size;
+        items_.erase(item.key);
+        lru_.pop_back();
+    }
+}
@@ -0,0 +1,107 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <mtxclient/crypto/types.hpp>
+
+#include "CacheCryptoStructs.h"
+
+//! Bounded LRU of unpickled inbound megolm sessions.
+//!
+//! Unpickling a session is expensive compared to decrypting a single message with it, so
+//! sessions used for decryption are kept alive here. Entries are shared, their session must
+//! only be used while holding the entry's mutex. The cache never writes to the database, the
+//! owner is responsible to write back sessions and to invalidate entries from inside the write
+//! transaction, that changes the stored session.
+class MegolmSessionCache
+{
+public:
+    struct Entry
+    {
+        std::mutex mtx;
+        mtx::crypto::InboundGroupSessionPtr session;
+        //! Set, when the stored session was replaced. A stale entry must not be written back.
+        std::atomic<bool> invalidated{false};
+    };
+    using EntryPtr = std::shared_ptr<Entry>;
+
+    //! Held by a writer of stored sessions from inside its write transaction, before it
+    //! invalidates the sessions it replaces, until the transaction ended. Write transactions
+    //! are exclusive, so at most one guard exists at a time.
+    class WriteGuard
+    {
+    public:
+        explicit WriteGuard(MegolmSessionCache &cache)
+          : cache_(cache)
+        {
+            cache_.write_seq_++;
+        }
+        ~WriteGuard() { cache_.write_seq_++; }
+        WriteGuard(const WriteGuard &)            = delete;
+        WriteGuard &operator=(const WriteGuard &) = delete;
+
+    private:
+        MegolmSessionCache &cache_;
+    };
+
+    explicit MegolmSessionCache(std::size_t max_bytes)
+      : max_bytes_(max_bytes)
+    {}
+
+    //! Returns the cached session or nullptr.
+    EntryPtr get(const MegolmSessionIndex &index);
+    //! Adds a session, replacing (and invalidating) an existing entry for the same index.
+    EntryPtr put(const MegolmSessionIndex &index, mtx::crypto::InboundGroupSessionPtr session);
+    //! Read before loading a stored session, pass it to putLoaded().
+    uint64_t writeSequence() const { return write_seq_; }
+    //! Like put() for a session loaded from the database. If a write was in flight or started
+    //! since `sequence` was read, the session may be outdated. It is then returned invalidated
+    //! and not cached.
+    EntryPtr putLoaded(const MegolmSessionIndex &index,
+                       mtx::crypto::InboundGroupSessionPtr session,
+                       uint64_t sequence);
+    void invalidate(const MegolmSessionIndex &index);
+    void clear();
+
+    void setMaxBytes(std::size_t max_bytes);
+    std::size_t maxBytes() const;
+    std::size_t bytes() const;
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    using Key = std::pair<std::string, std::string>;
+    struct Item
+    {
+        Key key;
+        EntryPtr entry;
+        std::size_t size;
+    };
+
+    EntryPtr putLocked(const MegolmSessionIndex &index,
+                       mtx::crypto::InboundGroupSessionPtr session);
+    static std::size_t entrySize(const Key &key);
+    void evict();
+
+    mutable std::mutex mtx_;
+    std::list<Item> lru_;
+    std::map<Key, std::list<Item>::iterator> items_;
+    std::size_t max_bytes_;
+    std::size_t bytes_ = 0;
+
+    std::atomic<uint64_t> hits_{0}, misses_{0};
+    //! odd while a WriteGuard exists
+    std::atomic<uint64_t> write_seq_{0};
+};
@@ -0,0 +1,64 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "OlmSessionCache.h"
+
+mtx::crypto::OlmSessionPtr
+OlmSessionCache::take(const std::string &curve25519, const std::string &session_id)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    auto it = items_.find(Key{curve25519, session_id});
+    if (it == items_.end()) {
+        misses_++;
+        return nullptr;
+    }
+
+    hits_++;
+    auto session = std::move(it->second->session);
+    lru_.erase(it->second);
+    items_.erase(it);
+    return session;
+}
+
+void
+OlmSessionCache::put(const std::string &curve25519,
+                     const std::string &session_id,
+                     mtx::crypto::OlmSessionPtr session)
+{
+    if (!session || capacity_ == 0)
+        return;
+
+    Key key{curve25519, session_id};
+
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    if (auto it = items_.find(key); it != items_.end()) {
+        lru_.erase(it->second);
+        items_.erase(it);
+    }
+
+    lru_.push_front(Item{key, std::move(session)});
+    items_.emplace(std::move(key), lru_.begin());
+
+    while (lru_.size() > capacity_) {
+        items_.erase(lru_.back().key);
+        lru_.pop_back();
+    }
+}
+
+void
+OlmSessionCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    lru_.clear();
+    items_.clear();
+}
+
+std::size_t
+OlmSessionCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return lru_.size();
+}
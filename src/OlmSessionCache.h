@@ -0,0 +1,58 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <mtxclient/crypto/types.hpp>
+
+//! Bounded LRU of unpickled olm sessions of recently active devices.
+//!
+//! Every message advances an olm session, so unlike megolm sessions they are not shared. A
+//! session is handed out exclusively by take() and the owner puts it back after storing its
+//! new state. Concurrent users of the same session therefore fall back to the stored copy, as
+//! they did without the cache. The cache never writes to the database.
+class OlmSessionCache
+{
+public:
+    static constexpr std::size_t DefaultCapacity = 128;
+
+    explicit OlmSessionCache(std::size_t capacity = DefaultCapacity)
+      : capacity_(capacity)
+    {}
+
+    //! Removes the session from the cache and returns it, or nullptr if it isn't cached.
+    mtx::crypto::OlmSessionPtr take(const std::string &curve25519, const std::string &session_id);
+    //! Adds a session, whose state matches the stored one, as the most recently used entry.
+    void put(const std::string &curve25519,
+             const std::string &session_id,
+             mtx::crypto::OlmSessionPtr session);
+    void clear();
+
+    std::size_t size() const;
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    using Key = std::pair<std::string, std::string>;
+    struct Item
+    {
+        Key key;
+        mtx::crypto::OlmSessionPtr session;
+    };
+
+    mutable std::mutex mtx_;
+    std::list<Item> lru_;
+    std::map<Key, std::list<Item>::iterator> items_;
+    std::size_t capacity_;
+
+    std::atomic<uint64_t> hits_{0}, misses_{0};
+};
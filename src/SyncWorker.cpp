@@ -0,0 +1,96 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "SyncWorker.h"
+
+#include "Cache.h"
+#include "Cache_p.h"
+#include "Logging.h"
+
+namespace {
+//! Time a sync may spend on deleting old messages.
+constexpr auto PRUNE_SLICE = std::chrono::milliseconds(50);
+}
+
+void
+SyncWorker::saveSync(const mtx::responses::Sync &res, const QString &prev_batch_token)
+{
+    try {
+        if (prev_batch_token.toStdString() != cache::nextBatchToken()) {
+            nhlog::net()->warn("Duplicate sync, dropping");
+            emit syncDropped();
+            return;
+        }
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("Logged out in the mean time, dropping sync");
+        emit syncDropped();
+        return;
+    }
+
+    nhlog::net()->debug("sync completed: {}", res.next_batch);
+
+    // decrypted once for storing and for the timelines, outside of the write transaction
+    auto decrypted = olm::decryptSync(res.rooms);
+    try {
+        cache::client()->saveState(res, decrypted.get());
+    } catch (const lmdb::map_full_error &e) {
+        nhlog::db()->error("lmdb is full: {}", e.what());
+        cache::deleteOldData();
+        emit syncFailed();
+        return;
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("saving sync response: {}", e.what());
+        emit syncFailed();
+        return;
+    } catch (const std::exception &e) {
+        nhlog::db()->error("failed to store sync response: {}", e.what());
+        emit syncFailed();
+        return;
+    }
+
+    // The sync is committed, so it is handed on even if the steps below fail. They only cost
+    // the room list an update or delay the cleanup.
+    QMap<QString, RoomInfo> updates;
+    try {
+        updates = cache::getRoomInfo(cache::client()->roomsWithStateUpdates(res));
+    } catch (const lmdb::error &e) {
+        nhlog::db()->warn("failed to read the updated room info: {}", e.what());
+    }
+
+    // if we process a lot of syncs (1 every 200ms), this means we clean the
+    // db every 100s. Large accounts are pruned in slices over the following syncs.
+    static int syncCounter = 0;
+    static bool pruning    = false;
+    if (pruning || syncCounter++ >= 500) {
+        syncCounter = 0;
+        try {
+            pruning = !cache::client()->deleteOldData(PRUNE_SLICE).done;
+        } catch (const lmdb::error &e) {
+            nhlog::db()->warn("failed to delete old messages: {}", e.what());
+            pruning = false;
+        }
+    }
+
+    emit syncSaved(res, updates, std::move(decrypted));
+}
+
+void
+SyncWorker::saveInitialSync(const mtx::responses::Sync &res)
+{
+    nhlog::net()->info("initial sync completed");
+    try {
+        cache::client()->saveState(res);
+        cache::calculateRoomReadStatus();
+    } catch (const lmdb::error &e) {
+        nhlog::db()->error("failed to save state after initial sync: {}", e.what());
+        emit initialSyncFailed();
+        return;
+    } catch (const std::exception &e) {
+        nhlog::db()->error("failed to store initial sync: {}", e.what());
+        emit initialSyncFailed();
+        return;
+    }
+
+    emit initialSyncSaved(res);
+}
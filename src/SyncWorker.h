@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QMap>
+#include <QObject>
+#include <QString>
+
+#include <memory>
+
+#include <mtx/responses/sync.hpp>
+
+#include "CacheStructs.h"
+#include "encryption/Olm.h"
+
+//! Stores sync responses in the cache.
+//!
+//! When moved to its own thread, it owns the lmdb write path of the sync loop, so that
+//! large (initial) syncs don't block the main thread. Only after a sync is committed, the
+//! main thread is notified to update the timelines. When it stays on the main thread, the
+//! sync is stored synchronously, like before.
+class SyncWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    SyncWorker(QObject *parent = nullptr)
+      : QObject(parent)
+    {}
+
+public slots:
+    void saveSync(const mtx::responses::Sync &res, const QString &prev_batch_token);
+    void saveInitialSync(const mtx::responses::Sync &res);
+
+signals:
+    //! The sync was committed. `rooms` contains the updated info of rooms with state changes,
+    //! `decrypted` the timelines decrypted while storing it.
+    void syncSaved(const mtx::responses::Sync &res,
+                   const QMap<QString, RoomInfo> &rooms,
+                   std::shared_ptr<olm::SyncDecryption> decrypted);
+    //! The sync was dropped, because it didn't continue the stored batch token.
+    void syncDropped();
+    void syncFailed();
+
+    void initialSyncSaved(const mtx::responses::Sync &res);
+    void initialSyncFailed();
+};
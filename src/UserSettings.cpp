@@ -110,6 +110,13 @@ UserSettings::load(std::optional<QString> profile)
     screenShareHideCursor_ =
       settings.value(QStringLiteral("user/screen_share_hide_cursor"), false).toBool();
     useStunServer_ = settings.value(QStringLiteral("user/use_stun_server"), false).toBool();
+    backgroundSync_ = settings.value(QStringLiteral("user/background_sync"), true).toBool();
+    readReceiptDelay_ = settings.value(QStringLiteral("user/read_receipt_delay"), 1000).toInt();
+    megolmSessionCacheSize_ =
+      settings.value(QStringLiteral("user/megolm_session_cache_size"), 4096).toInt();
+    sendWindow_ = settings.value(QStringLiteral("user/send_window"), 4).toInt();
+    lazyTimelines_ = settings.value(QStringLiteral("user/lazy_timelines"), false).toBool();
+    prefetchPages_ = settings.value(QStringLiteral("user/prefetch_pages"), 0).toInt();
 
     if (profile) // set to "" if it's the default to maintain compatibility
         profile_ = (*profile == QLatin1String("default")) ? QLatin1String("") : *profile;
@@ -510,6 +517,72 @@ UserSettings::setOnlyShareKeysWithVerifiedUsers(bool shareKeys)
     save();
 }
 
+void
+UserSettings::setBackgroundSync(bool state)
+{
+    if (state == backgroundSync_)
+        return;
+
+    backgroundSync_ = state;
+    emit backgroundSyncChanged(state);
+    save();
+}
+
+void
+UserSettings::setReadReceiptDelay(int delay)
+{
+    if (delay == readReceiptDelay_)
+        return;
+
+    readReceiptDelay_ = delay;
+    emit readReceiptDelayChanged(delay);
+    save();
+}
+
+void
+UserSettings::setMegolmSessionCacheSize(int size)
+{
+    if (size == megolmSessionCacheSize_)
+        return;
+
+    megolmSessionCacheSize_ = size;
+    emit megolmSessionCacheSizeChanged(size);
+    save();
+}
+
+void
+UserSettings::setSendWindow(int window)
+{
+    if (window == sendWindow_)
+        return;
+
+    sendWindow_ = window;
+    emit sendWindowChanged(window);
+    save();
+}
+
+void
+UserSettings::setLazyTimelines(bool state)
+{
+    if (state == lazyTimelines_)
+        return;
+
+    lazyTimelines_ = state;
+    emit lazyTimelinesChanged(state);
+    save();
+}
+
+void
+UserSettings::setPrefetchPages(int pages)
+{
+    if (pages == prefetchPages_)
+        return;
+
+    prefetchPages_ = pages;
+    emit prefetchPagesChanged(pages);
+    save();
+}
+
 void
 UserSettings::setShareKeysWithTrustedUsers(bool shareKeys)
 {
@@ -784,6 +857,12 @@ UserSettings::save()
     settings.setValue(QStringLiteral("screen_share_remote_video"), screenShareRemoteVideo_);
     settings.setValue(QStringLiteral("screen_share_hide_cursor"), screenShareHideCursor_);
     settings.setValue(QStringLiteral("use_stun_server"), useStunServer_);
+    settings.setValue(QStringLiteral("background_sync"), backgroundSync_);
+    settings.setValue(QStringLiteral("read_receipt_delay"), readReceiptDelay_);
+    settings.setValue(QStringLiteral("megolm_session_cache_size"), megolmSessionCacheSize_);
+    settings.setValue(QStringLiteral("send_window"), sendWindow_);
+    settings.setValue(QStringLiteral("lazy_timelines"), lazyTimelines_);
+    settings.setValue(QStringLiteral("prefetch_pages"), prefetchPages_);
     settings.setValue(QStringLiteral("currentProfile"), profile_);
     // settings.setValue(QStringLiteral("use_identicon"), useIdenticon_);
     settings.setValue(QStringLiteral("open_image_external"), openImageExternal_);
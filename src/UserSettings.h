@@ -83,6 +83,17 @@ class UserSettings : public QObject
                  setShareKeysWithTrustedUsers NOTIFY shareKeysWithTrustedUsersChanged)
     Q_PROPERTY(bool useOnlineKeyBackup READ useOnlineKeyBackup WRITE setUseOnlineKeyBackup NOTIFY
                  useOnlineKeyBackupChanged)
+    Q_PROPERTY(
+      bool backgroundSync READ backgroundSync WRITE setBackgroundSync NOTIFY backgroundSyncChanged)
+    Q_PROPERTY(int readReceiptDelay READ readReceiptDelay WRITE setReadReceiptDelay NOTIFY
+                 readReceiptDelayChanged)
+    Q_PROPERTY(int megolmSessionCacheSize READ megolmSessionCacheSize WRITE
+                 setMegolmSessionCacheSize NOTIFY megolmSessionCacheSizeChanged)
+    Q_PROPERTY(int sendWindow READ sendWindow WRITE setSendWindow NOTIFY sendWindowChanged)
+    Q_PROPERTY(
+      bool lazyTimelines READ lazyTimelines WRITE setLazyTimelines NOTIFY lazyTimelinesChanged)
+    Q_PROPERTY(int prefetchPages READ prefetchPages WRITE setPrefetchPages NOTIFY
+                 prefetchPagesChanged)
     Q_PROPERTY(QString profile READ profile WRITE setProfile NOTIFY profileChanged)
     Q_PROPERTY(QString userId READ userId WRITE setUserId NOTIFY userIdChanged)
     Q_PROPERTY(QString cmUserId READ cmUserId WRITE setCMUserId NOTIFY cmUserIdChanged)
@@ -163,6 +174,19 @@ public:
     void setOnlyShareKeysWithVerifiedUsers(bool state);
     void setShareKeysWithTrustedUsers(bool state);
     void setUseOnlineKeyBackup(bool state);
+    //! Store syncs on a worker thread. Takes effect on the next start.
+    void setBackgroundSync(bool state);
+    //! Time in ms, in which read receipts of a room are coalesced into one request.
+    void setReadReceiptDelay(int delay);
+    //! Memory ceiling in KiB for unpickled inbound megolm sessions.
+    void setMegolmSessionCacheSize(int size);
+    //! Number of events per room, that may be sent at once. Messages are still sent one at a
+    //! time to keep their order, only reactions and redactions are sent next to them.
+    void setSendWindow(int window);
+    //! Create timelines only when they are requested instead of for all rooms at startup.
+    void setLazyTimelines(bool state);
+    //! Pages of history kept loaded ahead of the scroll position, 0 to only load on request.
+    void setPrefetchPages(int pages);
     void setProfile(QString profile);
     void setUserId(QString userId);
     void setCMUserId(QString userId);
@@ -229,6 +253,12 @@ public:
     bool shareKeysWithTrustedUsers() const { return shareKeysWithTrustedUsers_; }
     bool onlyShareKeysWithVerifiedUsers() const { return onlyShareKeysWithVerifiedUsers_; }
     bool useOnlineKeyBackup() const { return useOnlineKeyBackup_; }
+    bool backgroundSync() const { return backgroundSync_; }
+    int readReceiptDelay() const { return readReceiptDelay_; }
+    int megolmSessionCacheSize() const { return megolmSessionCacheSize_; }
+    int sendWindow() const { return sendWindow_; }
+    bool lazyTimelines() const { return lazyTimelines_; }
+    int prefetchPages() const { return prefetchPages_; }
     QString profile() const { return profile_; }
     QString userId() const { return userId_; }
     QString cmUserId() const { return cmUserId_; }
@@ -297,6 +327,12 @@ signals:
     void onlyShareKeysWithVerifiedUsersChanged(bool state);
     void shareKeysWithTrustedUsersChanged(bool state);
     void useOnlineKeyBackupChanged(bool state);
+    void backgroundSyncChanged(bool state);
+    void readReceiptDelayChanged(int delay);
+    void megolmSessionCacheSizeChanged(int size);
+    void sendWindowChanged(int window);
+    void lazyTimelinesChanged(bool state);
+    void prefetchPagesChanged(int pages);
     void profileChanged(QString profile);
     void userIdChanged(QString userId);
     void cmUserIdChanged(QString cmUserId);
@@ -335,6 +371,12 @@ private:
     bool shareKeysWithTrustedUsers_;
     bool onlyShareKeysWithVerifiedUsers_;
     bool useOnlineKeyBackup_;
+    bool backgroundSync_;
+    int readReceiptDelay_;
+    int megolmSessionCacheSize_;
+    int sendWindow_;
+    bool lazyTimelines_;
+    int prefetchPages_;
     bool mobileMode_;
     int timelineMaxWidth_;
     int roomListWidth_;
@@ -0,0 +1,121 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "DecryptionPool.h"
+
+#include <QThread>
+
+#include <algorithm>
+
+#include "CacheCryptoStructs.h"
+#include "Logging.h"
+
+DecryptionPool::DecryptionPool(int threads, QObject *parent)
+  : QObject(parent)
+{
+    pool_.setMaxThreadCount(std::max(threads, 1));
+}
+
+DecryptionPool::~DecryptionPool() { pool_.waitForDone(); }
+
+DecryptionPool *
+DecryptionPool::instance()
+{
+    // decryption mostly waits on the database, leave some cores to the ui
+    static auto *instance_ =
+      new DecryptionPool(std::clamp(QThread::idealThreadCount() / 2, 1, 4));
+    return instance_;
+}
+
+std::map<std::string, std::vector<std::size_t>>
+DecryptionPool::groupBySession(const std::vector<EncryptedEvent> &events)
+{
+    std::map<std::string, std::vector<std::size_t>> groups;
+    for (std::size_t i = 0; i < events.size(); i++)
+        groups[events[i].content.session_id].push_back(i);
+    return groups;
+}
+
+void
+DecryptionPool::decryptGroup(Batch &batch, const std::vector<std::size_t> &group)
+{
+    for (auto i : group) {
+        const auto &e = batch.events[i];
+        batch.results[i] = olm::decryptEvent(MegolmSessionIndex(batch.room_id, e.content), e);
+    }
+}
+
+std::vector<olm::DecryptionResult>
+DecryptionPool::decryptBatch(const std::string &room_id, const std::vector<EncryptedEvent> &events)
+{
+    Batch batch;
+    batch.room_id = room_id;
+    batch.events  = events;
+    batch.results.resize(events.size());
+
+    for (const auto &[session_id, group] : groupBySession(batch.events)) {
+        (void)session_id;
+        decryptGroup(batch, group);
+    }
+
+    return std::move(batch.results);
+}
+
+void
+DecryptionPool::decrypt(QObject *context,
+                        const std::string &room_id,
+                        std::vector<EncryptedEvent> events,
+                        Callback done)
+{
+    auto seq   = next_seq_++;
+    auto batch = std::make_shared<Batch>();
+
+    batch->room_id = room_id;
+    batch->events  = std::move(events);
+    batch->results.resize(batch->events.size());
+    batch->context = context;
+    batch->done    = std::move(done);
+    batches_[seq]  = batch;
+
+    auto groups = groupBySession(batch->events);
+    if (groups.empty()) {
+        finished(seq);
+        return;
+    }
+
+    nhlog::crypto()->debug("Decrypting {} events of {} sessions in the background",
+                           batch->events.size(),
+                           groups.size());
+
+    batch->remaining = groups.size();
+    for (auto &[session_id, group] : groups) {
+        (void)session_id;
+        pool_.start(QRunnable::create([this, batch, seq, group = std::move(group)]() {
+            decryptGroup(*batch, group);
+
+            if (--batch->remaining == 0)
+                QMetaObject::invokeMethod(
+                  this, [this, seq]() { finished(seq); }, Qt::QueuedConnection);
+        }));
+    }
+}
+
+void
+DecryptionPool::finished(uint64_t seq)
+{
+    if (auto batch = batches_.find(seq); batch != batches_.end())
+        batch->second->finished = true;
+
+    // deliver in submission order, later batches wait for earlier ones
+    for (auto next = batches_.find(next_delivery_);
+         next != batches_.end() && next->second->finished;
+         next = batches_.find(next_delivery_)) {
+        auto batch = std::move(next->second);
+        batches_.erase(next);
+        next_delivery_++;
+
+        if (batch->context)
+            batch->done(std::move(batch->results));
+    }
+}
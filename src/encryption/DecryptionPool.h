@@ -0,0 +1,79 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QObject>
+#include <QPointer>
+#include <QThreadPool>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <mtx/events/encrypted.hpp>
+
+#include "Olm.h"
+
+//! Decrypts batches of megolm events on a fixed size thread pool.
+//!
+//! A batch is split by megolm session. Events of the same session are decrypted in order on
+//! one thread, since they share the cached session and its ratchet, while different sessions
+//! are decrypted in parallel. Results are returned in the order of the submitted events and
+//! batches are completed in the order they were submitted. The pool only touches the local
+//! olm state and the cache, key requests for missing sessions are left to the caller.
+class DecryptionPool : public QObject
+{
+    Q_OBJECT
+
+public:
+    using EncryptedEvent = mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>;
+    using Callback       = std::function<void(std::vector<olm::DecryptionResult>)>;
+
+    explicit DecryptionPool(int threads, QObject *parent = nullptr);
+    ~DecryptionPool() override;
+
+    static DecryptionPool *instance();
+
+    //! Decrypts `events` in the background. `done` is called on the thread of the pool object
+    //! with one result per event, unless `context` was destroyed in the mean time.
+    void decrypt(QObject *context,
+                 const std::string &room_id,
+                 std::vector<EncryptedEvent> events,
+                 Callback done);
+
+    //! Decrypts `events` on the calling thread, with the same grouping and ordering as
+    //! decrypt().
+    static std::vector<olm::DecryptionResult>
+    decryptBatch(const std::string &room_id, const std::vector<EncryptedEvent> &events);
+
+    //! Blocks until all submitted batches were decrypted. Their callbacks are still queued.
+    void waitForDone() { pool_.waitForDone(); }
+    int threadCount() const { return pool_.maxThreadCount(); }
+
+private:
+    struct Batch
+    {
+        std::string room_id;
+        std::vector<EncryptedEvent> events;
+        std::vector<olm::DecryptionResult> results;
+        std::atomic<std::size_t> remaining{0};
+        QPointer<QObject> context;
+        Callback done;
+        bool finished = false;
+    };
+
+    static std::map<std::string, std::vector<std::size_t>>
+    groupBySession(const std::vector<EncryptedEvent> &events);
+    static void decryptGroup(Batch &batch, const std::vector<std::size_t> &group);
+    void finished(uint64_t seq);
+
+    QThreadPool pool_;
+    std::map<uint64_t, std::shared_ptr<Batch>> batches_;
+    uint64_t next_seq_ = 0, next_delivery_ = 0;
+};
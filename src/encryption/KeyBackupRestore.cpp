@@ -0,0 +1,240 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "KeyBackupRestore.h"
+
+#include <QThread>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <mtxclient/crypto/client.hpp>
+
+#include "Cache.h"
+#include "Logging.h"
+#include "MatrixClient.h"
+
+KeyBackupRestore::KeyBackupRestore(QObject *parent)
+  : QObject(parent)
+{
+    // decrypting is cheap compared to importing, which is serialized by the database anyway
+    pool_.setMaxThreadCount(std::clamp(QThread::idealThreadCount() / 2, 1, 4));
+}
+
+KeyBackupRestore::~KeyBackupRestore()
+{
+    cancel();
+    pool_.waitForDone();
+}
+
+KeyBackupRestore *
+KeyBackupRestore::instance()
+{
+    static auto *instance_ = new KeyBackupRestore;
+    return instance_;
+}
+
+void
+KeyBackupRestore::start(const std::string &version,
+                        mtx::crypto::BinaryBuf key,
+                        std::vector<std::string> rooms)
+{
+    cancel();
+
+    generation_++;
+    version_       = version;
+    key_           = std::move(key);
+    queue_         = std::deque<std::string>(rooms.begin(), rooms.end());
+    pagesInFlight_ = 0;
+    roomsDone_     = 0;
+    roomsTotal_    = static_cast<int>(queue_.size());
+    imported_      = 0;
+
+    nhlog::crypto()->info("Restoring the key backup of {} rooms", roomsTotal_);
+
+    if (queue_.empty()) {
+        emit finished(0);
+        return;
+    }
+
+    for (int i = 0; i < MaxPagesInFlight; i++)
+        fetchNext();
+}
+
+void
+KeyBackupRestore::prioritize(const std::string &room_id)
+{
+    auto it = std::find(queue_.begin(), queue_.end(), room_id);
+    if (it == queue_.end() || it == queue_.begin())
+        return;
+
+    queue_.erase(it);
+    queue_.push_front(room_id);
+}
+
+void
+KeyBackupRestore::cancel()
+{
+    if (!running())
+        return;
+
+    nhlog::crypto()->info(
+      "Cancelled the key backup restore after {} of {} rooms", roomsDone_, roomsTotal_);
+    generation_++;
+    queue_.clear();
+    roomsDone_ = roomsTotal_ = 0;
+}
+
+void
+KeyBackupRestore::fetchNext()
+{
+    if (queue_.empty() || pagesInFlight_ >= MaxPagesInFlight)
+        return;
+
+    auto room_id = std::move(queue_.front());
+    queue_.pop_front();
+    pagesInFlight_++;
+
+    http::client()->room_keys(
+      version_,
+      room_id,
+      [this, generation = generation_, room_id](const mtx::responses::backup::RoomKeysBackup &bk,
+                                                mtx::http::RequestErr err) {
+          Sessions sessions;
+          if (err) {
+              if (err->status_code != 404)
+                  nhlog::crypto()->error("Failed to download the key backup of {}: {} - {}",
+                                         room_id,
+                                         mtx::errors::to_string(err->matrix_error.errcode),
+                                         err->matrix_error.error);
+          } else {
+              sessions.assign(bk.sessions.begin(), bk.sessions.end());
+          }
+
+          // called on the network thread
+          QMetaObject::invokeMethod(
+            this,
+            [this, generation, room_id, sessions = std::move(sessions)]() mutable {
+                restorePage(generation, room_id, std::move(sessions));
+            },
+            Qt::QueuedConnection);
+      });
+}
+
+void
+KeyBackupRestore::restorePage(uint64_t generation, const std::string &room_id, Sessions sessions)
+{
+    if (generation != generation_)
+        return;
+
+    if (sessions.empty()) {
+        pageDone(generation, 0);
+        return;
+    }
+
+    struct Page
+    {
+        std::string room_id;
+        Sessions sessions;
+        mtx::crypto::BinaryBuf key;
+        std::atomic<std::size_t> remaining{0};
+        std::atomic<std::size_t> imported{0};
+    };
+
+    auto page      = std::make_shared<Page>();
+    page->room_id  = room_id;
+    page->sessions = std::move(sessions);
+    page->key      = key_;
+
+    auto batches    = (page->sessions.size() + BatchSize - 1) / BatchSize;
+    page->remaining = batches;
+
+    nhlog::crypto()->debug(
+      "Restoring {} sessions of {} from the key backup", page->sessions.size(), room_id);
+
+    for (std::size_t i = 0; i < batches; i++) {
+        pool_.start(QRunnable::create([this, page, generation, i]() {
+            auto end = std::min((i + 1) * BatchSize, page->sessions.size());
+            page->imported +=
+              restoreBatch(page->room_id, page->sessions, i * BatchSize, end, page->key);
+
+            if (--page->remaining == 0)
+                QMetaObject::invokeMethod(
+                  this,
+                  [this, generation, imported = page->imported.load()]() {
+                      pageDone(generation, imported);
+                  },
+                  Qt::QueuedConnection);
+        }));
+    }
+}
+
+std::size_t
+KeyBackupRestore::restoreBatch(const std::string &room_id,
+                               const Sessions &sessions,
+                               std::size_t begin,
+                               std::size_t end,
+                               const mtx::crypto::BinaryBuf &key)
+{
+    using namespace mtx::crypto;
+
+    ExportedSessionKeys keys;
+    keys.sessions.reserve(end - begin);
+
+    for (auto i = begin; i < end; i++) {
+        const auto &[session_id, encSession] = sessions[i];
+        try {
+            auto session = decrypt_session(encSession.session_data, key);
+
+            if (session.algorithm != MEGOLM_ALGO)
+                // don't know this algorithm
+                continue;
+
+            ExportedSession sess{};
+            sess.session_id                      = session_id;
+            sess.room_id                         = room_id;
+            sess.algorithm                       = MEGOLM_ALGO;
+            sess.forwarding_curve25519_key_chain = std::move(session.forwarding_curve25519_key_chain);
+            sess.sender_claimed_keys             = std::move(session.sender_claimed_keys);
+            sess.sender_key                      = std::move(session.sender_key);
+            sess.session_key                     = std::move(session.session_key);
+            keys.sessions.push_back(std::move(sess));
+        } catch (const std::exception &e) {
+            nhlog::crypto()->warn(
+              "Failed to decrypt backed up session {} of {}: {}", session_id, room_id, e.what());
+        }
+    }
+
+    if (keys.sessions.empty())
+        return 0;
+
+    try {
+        return cache::importSessionKeys(keys);
+    } catch (const lmdb::error &e) {
+        nhlog::crypto()->critical("Failed to save restored sessions of {}: {}", room_id, e.what());
+        return 0;
+    }
+}
+
+void
+KeyBackupRestore::pageDone(uint64_t generation, std::size_t imported)
+{
+    if (generation != generation_)
+        return;
+
+    pagesInFlight_--;
+    roomsDone_++;
+    imported_ += imported;
+
+    emit progress(roomsDone_, roomsTotal_, static_cast<int>(imported_));
+
+    if (roomsDone_ == roomsTotal_) {
+        nhlog::crypto()->info("Restored {} sessions from the key backup", imported_);
+        emit finished(static_cast<int>(imported_));
+        return;
+    }
+
+    fetchNext();
+}
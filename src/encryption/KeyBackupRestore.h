@@ -0,0 +1,76 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QObject>
+#include <QThreadPool>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <mtx/responses/crypto.hpp>
+#include <mtxclient/crypto/types.hpp>
+
+//! Restores megolm sessions from the online key backup, one room at a time.
+//!
+//! Each room's sessions are downloaded as a separate page. They are decrypted on a thread pool
+//! and imported in bounded transactions, so memory use is bounded by the pages in flight
+//! instead of by the whole backup. Rooms move to the front of the queue when they are
+//! prioritized, e.g. because the user is looking at them.
+class KeyBackupRestore : public QObject
+{
+    Q_OBJECT
+
+public:
+    //! Sessions decrypted and imported by one pool task, in a single transaction.
+    static constexpr std::size_t BatchSize = 256;
+    //! Pages being downloaded or imported at the same time.
+    static constexpr int MaxPagesInFlight = 2;
+
+    explicit KeyBackupRestore(QObject *parent = nullptr);
+    ~KeyBackupRestore() override;
+
+    static KeyBackupRestore *instance();
+
+    //! Restores the sessions of `rooms` in that order from backup `version`. A running
+    //! restore is cancelled.
+    void start(const std::string &version,
+               mtx::crypto::BinaryBuf key,
+               std::vector<std::string> rooms);
+    //! Restores the room next, if it is still queued.
+    void prioritize(const std::string &room_id);
+    void cancel();
+    bool running() const { return roomsDone_ < roomsTotal_; }
+
+signals:
+    void progress(int roomsDone, int roomsTotal, int sessionsImported);
+    void finished(int sessionsImported);
+
+private:
+    using Sessions = std::vector<std::pair<std::string, mtx::responses::backup::SessionBackup>>;
+
+    static std::size_t restoreBatch(const std::string &room_id,
+                                    const Sessions &sessions,
+                                    std::size_t begin,
+                                    std::size_t end,
+                                    const mtx::crypto::BinaryBuf &key);
+    void fetchNext();
+    void restorePage(uint64_t generation, const std::string &room_id, Sessions sessions);
+    void pageDone(uint64_t generation, std::size_t imported);
+
+    QThreadPool pool_;
+    std::deque<std::string> queue_;
+    std::string version_;
+    mtx::crypto::BinaryBuf key_;
+    //! Incremented on every start, so that callbacks of a cancelled restore are ignored.
+    uint64_t generation_ = 0;
+    int pagesInFlight_ = 0;
+    int roomsDone_ = 0, roomsTotal_ = 0;
+    std::size_t imported_ = 0;
+};
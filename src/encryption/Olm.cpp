@@ -6,8 +6,13 @@
 #include "Olm.h"
 
 #include <QObject>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
 #include <QTimer>
 
+#include <algorithm>
+#include <atomic>
 #include <nlohmann/json.hpp>
 #include <variant>
 
@@ -19,6 +24,7 @@
 #include "ChatPage.h"
 #include "DeviceVerificationFlow.h"
 #include "EventAccessors.h"
+#include "KeyBackupRestore.h"
 #include "Logging.h"
 #include "MatrixClient.h"
 // #include "UserSettingsPage.h"
@@ -712,13 +718,15 @@ try_olm_decryption(const std::string &sender_key, const mtx::events::msg::OlmCip
             nhlog::crypto()->debug("Updated olm session: {}",
                                    mtx::crypto::session_id(session->get()));
             cache::saveOlmSession(
-              id, std::move(session.value()), QDateTime::currentMSecsSinceEpoch());
+              sender_key, std::move(session.value()), QDateTime::currentMSecsSinceEpoch());
         } catch (const mtx::crypto::olm_exception &e) {
             nhlog::crypto()->debug("failed to decrypt olm message ({}, {}) with {}: {}",
                                    msg.type,
                                    sender_key,
                                    id,
                                    e.what());
+            // a failed decryption doesn't advance the session, so it can stay cached
+            cache::client()->olmSessionCache().put(sender_key, id, std::move(session.value()));
             continue;
         } catch (const lmdb::error &e) {
             nhlog::crypto()->critical("failed to save session: {}", e.what());
@@ -906,49 +914,9 @@ download_full_keybackup()
     }
     auto sessionDecryptionKey = to_binary_buf(base642bin(*decryptedSecret));
 
-    http::client()->room_keys(
-      backupVersion->version,
-      [sessionDecryptionKey](const mtx::responses::backup::KeysBackup &bk,
-                             mtx::http::RequestErr err) {
-          if (err) {
-              if (err->status_code != 404)
-                  nhlog::crypto()->error("Failed to dowload backup: {} - {}",
-                                         mtx::errors::to_string(err->matrix_error.errcode),
-                                         err->matrix_error.error);
-              return;
-          }
-
-          mtx::crypto::ExportedSessionKeys allKeys;
-          try {
-              for (const auto &[room, roomKey] : bk.rooms) {
-                  for (const auto &[session_id, encSession] : roomKey.sessions) {
-                      auto session = decrypt_session(encSession.session_data, sessionDecryptionKey);
-
-                      if (session.algorithm != mtx::crypto::MEGOLM_ALGO)
-                          // don't know this algorithm
-                          return;
-
-                      ExportedSession sess{};
-                      sess.session_id = session_id;
-                      sess.room_id    = room;
-                      sess.algorithm  = mtx::crypto::MEGOLM_ALGO;
-                      sess.forwarding_curve25519_key_chain =
-                        std::move(session.forwarding_curve25519_key_chain);
-                      sess.sender_claimed_keys = std::move(session.sender_claimed_keys);
-                      sess.sender_key          = std::move(session.sender_key);
-                      sess.session_key         = std::move(session.session_key);
-                      allKeys.sessions.push_back(std::move(sess));
-                  }
-              }
-
-              // call on UI thread
-              QTimer::singleShot(0, ChatPage::instance(), [keys = std::move(allKeys)] {
-                  cache::importSessionKeys(keys);
-              });
-          } catch (const lmdb::error &e) {
-              nhlog::crypto()->critical("failed to save inbound megolm session: {}", e.what());
-          }
-      });
+    // sessions of rooms, that were left, are looked up on demand by lookup_keybackup
+    KeyBackupRestore::instance()->start(
+      backupVersion->version, std::move(sessionDecryptionKey), cache::joinedRooms());
 }
 void
 lookup_keybackup(const std::string room, const std::string session_id)
@@ -1009,10 +977,10 @@ lookup_keybackup(const std::string room, const std::string session_id)
               auto megolm_session =
                 olm::client()->import_inbound_group_session(session.session_key);
 
-              if (!cache::inboundMegolmSessionExists(index) ||
+              auto existing = cache::getInboundMegolmSession(index);
+              if (!existing ||
                   olm_inbound_group_session_first_known_index(megolm_session.get()) <
-                    olm_inbound_group_session_first_known_index(
-                      cache::getInboundMegolmSession(index).get())) {
+                    olm_inbound_group_session_first_known_index(existing.get())) {
                   cache::saveInboundMegolmSession(index, std::move(megolm_session), data);
 
                   nhlog::crypto()->info("imported inbound megolm session "
@@ -1094,32 +1062,28 @@ handle_key_request_message(const mtx::events::DeviceEvent<mtx::events::msg::KeyR
     index.room_id    = req.content.room_id;
     index.session_id = req.content.session_id;
 
-    // Check if we have the keys for the requested session.
-    auto sessionData = cache::getMegolmSessionData(index);
-    if (!sessionData) {
+    // Check if we have the keys for the requested session. Only the data is read here, most
+    // requests are rejected before the session itself is needed.
+    auto storedData = cache::getMegolmSessionData(index);
+    if (!storedData) {
         nhlog::crypto()->warn("requested session not found in room: {}", req.content.room_id);
         return;
     }
+    const auto &sessionData = *storedData;
 
     // Check if we were the sender of the session being requested (unless it is actually us
     // requesting the session).
     if (req.sender != http::client()->user_id().to_string() &&
-        sessionData->sender_key != olm::client()->identity_keys().curve25519) {
+        sessionData.sender_key != olm::client()->identity_keys().curve25519) {
         nhlog::crypto()->debug(
           "ignoring key request {} because we did not create the requested session: "
           "\nrequested({}) ours({})",
           req.content.request_id,
-          sessionData->sender_key,
+          sessionData.sender_key,
           olm::client()->identity_keys().curve25519);
         return;
     }
 
-    const auto session = cache::getInboundMegolmSession(index);
-    if (!session) {
-        nhlog::crypto()->warn("No session with id {} in db", req.content.session_id);
-        return;
-    }
-
     if (!cache::isRoomMember(req.sender, req.content.room_id)) {
         nhlog::crypto()->warn("user {} that requested the session key is not member of the room {}",
                               req.sender,
@@ -1145,11 +1109,11 @@ handle_key_request_message(const mtx::events::DeviceEvent<mtx::events::msg::KeyR
 
     bool shouldSeeKeys    = false;
     uint64_t minimumIndex = -1;
-    if (sessionData->currently.keys.count(req.sender)) {
-        if (sessionData->currently.keys.at(req.sender)
+    if (sessionData.currently.keys.count(req.sender)) {
+        if (sessionData.currently.keys.at(req.sender)
               .deviceids.count(req.content.requesting_device_id)) {
             shouldSeeKeys = true;
-            minimumIndex  = sessionData->currently.keys.at(req.sender)
+            minimumIndex  = sessionData.currently.keys.at(req.sender)
                              .deviceids.at(req.content.requesting_device_id);
         }
     }
@@ -1164,6 +1128,12 @@ handle_key_request_message(const mtx::events::DeviceEvent<mtx::events::msg::KeyR
         minimumIndex = -1;
     }
 
+    const auto session = cache::getInboundMegolmSession(index);
+    if (!session) {
+        nhlog::crypto()->warn("No session with id {} in db", req.content.session_id);
+        return;
+    }
+
     try {
         auto session_key = mtx::crypto::export_session(session.get(), minimumIndex);
 
@@ -1175,11 +1145,11 @@ handle_key_request_message(const mtx::events::DeviceEvent<mtx::events::msg::KeyR
         forward_key.room_id     = index.room_id;
         forward_key.session_id  = index.session_id;
         forward_key.session_key = session_key;
-        forward_key.sender_key  = sessionData->sender_key;
+        forward_key.sender_key  = sessionData.sender_key;
 
         // TODO(Nico): Figure out if this is correct
-        forward_key.sender_claimed_ed25519_key      = sessionData->sender_claimed_ed25519_key;
-        forward_key.forwarding_curve25519_key_chain = sessionData->forwarding_curve25519_key_chain;
+        forward_key.sender_claimed_ed25519_key      = sessionData.sender_claimed_ed25519_key;
+        forward_key.forwarding_curve25519_key_chain = sessionData.forwarding_curve25519_key_chain;
 
         send_megolm_key_to_device(req.sender, req.content.requesting_device_id, forward_key);
     } catch (std::exception &e) {
@@ -1207,26 +1177,22 @@ decryptEvent(const MegolmSessionIndex &index,
              const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event,
              bool dont_write_db)
 {
-    try {
-        if (!cache::client()->inboundMegolmSessionExists(index)) {
-            return {DecryptionErrorCode::MissingSession, std::nullopt, std::nullopt};
-        }
-    } catch (const lmdb::error &e) {
-        return {DecryptionErrorCode::DbError, e.what(), std::nullopt};
-    }
-
     std::string msg_str;
     try {
-        auto session = cache::client()->getInboundMegolmSession(index);
+        auto session = cache::client()->getCachedInboundMegolmSession(index);
         if (!session) {
             return {DecryptionErrorCode::MissingSession, std::nullopt, std::nullopt};
         }
 
+        // decrypting advances the ratchet of the shared session
+        std::lock_guard<std::mutex> lock(session->mtx);
+
         auto sessionData =
           cache::client()->getMegolmSessionData(index).value_or(GroupSessionData{});
 
-        auto res = olm::client()->decrypt_group_message(session.get(), event.content.ciphertext);
-        msg_str  = std::string((char *)res.data.data(), res.data.size());
+        auto res =
+          olm::client()->decrypt_group_message(session->session.get(), event.content.ciphertext);
+        msg_str = std::string((char *)res.data.data(), res.data.size());
 
         if (!event.event_id.empty() && event.event_id[0] == '$') {
             auto oldIdx = sessionData.indices.find(res.message_index);
@@ -1235,7 +1201,7 @@ decryptEvent(const MegolmSessionIndex &index,
                     return {DecryptionErrorCode::ReplayAttack, std::nullopt, std::nullopt};
             } else if (!dont_write_db) {
                 sessionData.indices[res.message_index] = event.event_id;
-                cache::client()->saveInboundMegolmSession(index, std::move(session), sessionData);
+                cache::client()->writeBackInboundMegolmSession(index, session, sessionData);
             }
         }
     } catch (const lmdb::error &e) {
@@ -1266,6 +1232,75 @@ decryptEvent(const MegolmSessionIndex &index,
     }
 }
 
+namespace {
+std::atomic<uint64_t> syncEventsDecrypted{0}, syncEventsReused{0};
+}
+
+void
+SyncDecryptionBatch::decryptTimeline(const mtx::responses::Timeline &timeline)
+{
+    for (const auto &e : timeline.events)
+        if (auto encrypted =
+              std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&e);
+            encrypted && !encrypted->content.relations.annotates())
+            decrypt(*encrypted);
+}
+
+const DecryptionResult &
+SyncDecryptionBatch::decrypt(const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event)
+{
+    auto result = results_.find(event.event_id);
+    if (result != results_.end() && result->second.error != MissingSession &&
+        result->second.error != MissingSessionIndex) {
+        reused_++;
+        syncEventsReused++;
+        return result->second;
+    }
+
+    decrypted_++;
+    syncEventsDecrypted++;
+    auto decrypted = decryptEvent(MegolmSessionIndex(room_id_, event.content), event);
+    if (result != results_.end()) {
+        result->second = std::move(decrypted);
+        return result->second;
+    }
+    return results_.emplace(event.event_id, std::move(decrypted)).first->second;
+}
+
+const DecryptionResult *
+SyncDecryptionBatch::find(const std::string &event_id)
+{
+    auto result = results_.find(event_id);
+    if (result == results_.end())
+        return nullptr;
+
+    reused_++;
+    syncEventsReused++;
+    return &result->second;
+}
+
+void
+SyncDecryptionBatch::insert(const std::string &event_id, DecryptionResult result)
+{
+    results_.emplace(event_id, std::move(result));
+}
+
+std::shared_ptr<SyncDecryption>
+decryptSync(const mtx::responses::Rooms &rooms)
+{
+    auto decrypted = std::make_shared<SyncDecryption>();
+    for (const auto &[room_id, room] : rooms.join)
+        decrypted->emplace(room_id, SyncDecryptionBatch(room_id))
+          .first->second.decryptTimeline(room.timeline);
+    return decrypted;
+}
+
+SyncDecryptionStats
+syncDecryptionStats()
+{
+    return {syncEventsDecrypted, syncEventsReused};
+}
+
 crypto::Trust
 calculate_trust(const std::string &user_id, const MegolmSessionIndex &index)
 {
@@ -1280,6 +1315,192 @@ calculate_trust(const std::string &user_id, const MegolmSessionIndex &index)
     return trustlevel;
 }
 
+namespace {
+//! Upper bound of device messages in a single send_to_device request.
+constexpr std::size_t MAX_TO_DEVICE_MESSAGES_PER_REQUEST = 100;
+//! Below this many devices per thread, waking the pool costs more than it saves.
+constexpr std::size_t MIN_DEVICES_PER_THREAD = 16;
+
+using OlmMessages =
+  std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>;
+
+//! The olm encrypted copy of a to_device event for one device.
+struct DeviceMessage
+{
+    std::string user_id;
+    std::string device_id;
+    std::string ed25519;
+    std::string curve25519;
+    //! The session to encrypt with, or empty to create one from the one time key.
+    mtx::crypto::OlmSessionPtr session;
+    std::string one_time_key;
+    std::optional<mtx::events::msg::OlmEncrypted> encrypted;
+};
+
+QThreadPool *
+encryptionPool()
+{
+    static auto *pool = [] {
+        auto p = new QThreadPool;
+        p->setMaxThreadCount(std::clamp(QThread::idealThreadCount(), 1, 8));
+        return p;
+    }();
+    return pool;
+}
+
+//! Our keys, read once before encrypting for many devices.
+struct OwnIdentity
+{
+    std::string user_id;
+    std::string device_id;
+    std::string ed25519;
+    std::string curve25519;
+};
+
+//! Creates the session from the one time key. This uses our account, so it must not run
+//! concurrently with anything else touching the account.
+void
+create_device_session(DeviceMessage &msg)
+{
+    if (msg.session)
+        return;
+
+    try {
+        msg.session = olm::client()->create_outbound_session(msg.curve25519, msg.one_time_key);
+    } catch (const mtx::crypto::olm_exception &e) {
+        nhlog::crypto()->critical(
+          "failed to create olm session for {}:{}: {}", msg.user_id, msg.device_id, e.what());
+    }
+}
+
+//! Same as OlmClient::create_olm_encrypted_content, but only touches the device's session,
+//! so it can run on several threads at once.
+void
+encrypt_device_message(DeviceMessage &msg, const nlohmann::json &ev_json, const OwnIdentity &own)
+{
+    if (!msg.session)
+        return;
+
+    try {
+        auto payload                         = ev_json;
+        payload["keys"]["ed25519"]           = own.ed25519;
+        payload["sender"]                    = own.user_id;
+        payload["sender_device"]             = own.device_id;
+        payload["recipient"]                 = msg.user_id;
+        payload["recipient_keys"]["ed25519"] = msg.ed25519;
+
+        auto type      = olm_encrypt_message_type(msg.session.get());
+        auto encrypted = olm::client()->encrypt_message(msg.session.get(), payload.dump());
+
+        nlohmann::json content = {
+          {"algorithm", mtx::crypto::OLM_ALGO},
+          {"sender_key", own.curve25519},
+          {"ciphertext",
+           {{msg.curve25519,
+             {{"body", std::string(encrypted.begin(), encrypted.end())}, {"type", type}}}}}};
+        msg.encrypted = content.get<mtx::events::msg::OlmEncrypted>();
+    } catch (const mtx::crypto::olm_exception &e) {
+        nhlog::crypto()->critical(
+          "failed to encrypt to_device message for {}:{}: {}", msg.user_id, msg.device_id, e.what());
+    }
+}
+
+void
+send_to_device_chunked(OlmMessages messages)
+{
+    OlmMessages chunk;
+    std::size_t count = 0;
+
+    auto flush = [&chunk, &count] {
+        if (chunk.empty())
+            return;
+
+        http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
+          http::client()->generate_txn_id(), chunk, [](mtx::http::RequestErr err) {
+              if (err) {
+                  nhlog::net()->warn("failed to send "
+                                     "send_to_device "
+                                     "message: {}",
+                                     err->matrix_error.error);
+              }
+          });
+        chunk.clear();
+        count = 0;
+    };
+
+    for (auto &[user, devices] : messages) {
+        for (auto &[device, msg] : devices) {
+            chunk[user][device] = std::move(msg);
+            if (++count >= MAX_TO_DEVICE_MESSAGES_PER_REQUEST)
+                flush();
+        }
+    }
+    flush();
+}
+
+//! Encrypts the event for every device, on the encryption pool when there are many of them.
+//! The touched sessions are stored in one transaction, before the messages are sent in
+//! bounded chunks.
+void
+encrypt_and_send_device_messages(std::vector<DeviceMessage> msgs, const nlohmann::json &ev_json)
+{
+    if (msgs.empty())
+        return;
+
+    // The account isn't safe to use from several threads and it may change on the main thread
+    // meanwhile. So new sessions are created and our keys read here, only the encryption with
+    // each device's own session runs on the pool.
+    for (auto &msg : msgs)
+        create_device_session(msg);
+
+    const auto keys = olm::client()->identity_keys();
+    const OwnIdentity own{http::client()->user_id().to_string(),
+                          http::client()->device_id(),
+                          keys.ed25519,
+                          keys.curve25519};
+
+    auto workers = static_cast<int>(std::min<std::size_t>(
+      encryptionPool()->maxThreadCount(), msgs.size() / MIN_DEVICES_PER_THREAD));
+    std::atomic<std::size_t> next{0};
+    auto encryptRemaining = [&msgs, &next, &ev_json, &own] {
+        for (std::size_t i = next++; i < msgs.size(); i = next++)
+            encrypt_device_message(msgs[i], ev_json, own);
+    };
+
+    // the calling thread helps, so only start the additional workers
+    QSemaphore done;
+    for (int i = 1; i < workers; i++)
+        encryptionPool()->start(QRunnable::create([&encryptRemaining, &done] {
+            encryptRemaining();
+            done.release();
+        }));
+    encryptRemaining();
+    if (workers > 1)
+        done.acquire(workers - 1);
+
+    OlmMessages messages;
+    std::vector<std::pair<std::string, mtx::crypto::OlmSessionPtr>> sessions;
+    sessions.reserve(msgs.size());
+    for (auto &msg : msgs) {
+        if (!msg.encrypted)
+            continue;
+
+        messages[mtx::identifiers::parse<mtx::identifiers::User>(msg.user_id)][msg.device_id] =
+          std::move(*msg.encrypted);
+        sessions.emplace_back(std::move(msg.curve25519), std::move(msg.session));
+    }
+
+    try {
+        nhlog::crypto()->debug("Updated {} olm sessions", sessions.size());
+        cache::saveOlmSessions(std::move(sessions), QDateTime::currentMSecsSinceEpoch());
+    } catch (const lmdb::error &e) {
+        nhlog::db()->critical("failed to save outbound olm sessions: {}", e.what());
+    }
+
+    send_to_device_chunked(std::move(messages));
+}
+}
+
 //! Send encrypted to device messages, targets is a map from userid to device ids or {} for all
 //! devices
 void
@@ -1293,8 +1514,7 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
 
     std::map<std::string, std::vector<std::string>> keysToQuery;
     mtx::requests::ClaimKeys claims;
-    std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
-      messages;
+    std::vector<DeviceMessage> msgs;
     std::map<std::string, std::map<std::string, DevicePublicKeys>> pks;
 
     auto our_curve = olm::client()->identity_keys().curve25519;
@@ -1356,45 +1576,22 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                 continue;
             }
 
-            messages[mtx::identifiers::parse<mtx::identifiers::User>(user)][device] =
-              olm::client()
-                ->create_olm_encrypted_content(session->get(),
-                                               ev_json,
-                                               UserId(user),
-                                               d.keys.at("ed25519:" + device),
-                                               device_curve)
-                .get<mtx::events::msg::OlmEncrypted>();
-
-            try {
-                nhlog::crypto()->debug("Updated olm session: {}",
-                                       mtx::crypto::session_id(session->get()));
-                cache::saveOlmSession(d.keys.at("curve25519:" + device),
-                                      std::move(*session),
-                                      QDateTime::currentMSecsSinceEpoch());
-            } catch (const lmdb::error &e) {
-                nhlog::db()->critical("failed to save outbound olm session: {}", e.what());
-            } catch (const mtx::crypto::olm_exception &e) {
-                nhlog::crypto()->critical("failed to pickle outbound olm session: {}", e.what());
-            }
+            DeviceMessage msg;
+            msg.user_id    = user;
+            msg.device_id  = device;
+            msg.ed25519    = d.keys.at("ed25519:" + device);
+            msg.curve25519 = device_curve;
+            msg.session    = std::move(*session);
+            msgs.push_back(std::move(msg));
         }
     }
 
-    if (!messages.empty())
-        http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
-          http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
-              if (err) {
-                  nhlog::net()->warn("failed to send "
-                                     "send_to_device "
-                                     "message: {}",
-                                     err->matrix_error.error);
-              }
-          });
+    encrypt_and_send_device_messages(std::move(msgs), ev_json);
 
     auto BindPks = [ev_json](decltype(pks) pks_temp) {
         return [pks = pks_temp, ev_json](const mtx::responses::ClaimKeys &res,
                                          mtx::http::RequestErr) {
-            std::map<mtx::identifiers::User, std::map<std::string, mtx::events::msg::OlmEncrypted>>
-              messages;
+            std::vector<DeviceMessage> msgs;
             for (const auto &[user_id, retrieved_devices] : res.one_time_keys) {
                 nhlog::net()->debug("claimed keys for {}", user_id);
                 if (retrieved_devices.size() == 0) {
@@ -1432,39 +1629,20 @@ send_encrypted_to_device_messages(const std::map<std::string, std::vector<std::s
                         }
                     }
 
-                    auto session = olm::client()->create_outbound_session(id_key, otk);
-
-                    messages[mtx::identifiers::parse<mtx::identifiers::User>(user_id)][device_id] =
-                      olm::client()
-                        ->create_olm_encrypted_content(
-                          session.get(), ev_json, UserId(user_id), sign_key, id_key)
-                        .get<mtx::events::msg::OlmEncrypted>();
-
-                    try {
-                        nhlog::crypto()->debug("Updated olm session: {}",
-                                               mtx::crypto::session_id(session.get()));
-                        cache::saveOlmSession(
-                          id_key, std::move(session), QDateTime::currentMSecsSinceEpoch());
-                    } catch (const lmdb::error &e) {
-                        nhlog::db()->critical("failed to save outbound olm session: {}", e.what());
-                    } catch (const mtx::crypto::olm_exception &e) {
-                        nhlog::crypto()->critical("failed to pickle outbound olm session: {}",
-                                                  e.what());
-                    }
+                    // the session is created together with the message, so that the key
+                    // agreement of new sessions is parallelized as well
+                    DeviceMessage msg;
+                    msg.user_id      = user_id;
+                    msg.device_id    = device_id;
+                    msg.ed25519      = sign_key;
+                    msg.curve25519   = id_key;
+                    msg.one_time_key = otk;
+                    msgs.push_back(std::move(msg));
                 }
                 nhlog::net()->info("send_to_device: {}", user_id);
             }
 
-            if (!messages.empty())
-                http::client()->send_to_device<mtx::events::msg::OlmEncrypted>(
-                  http::client()->generate_txn_id(), messages, [](mtx::http::RequestErr err) {
-                      if (err) {
-                          nhlog::net()->warn("failed to send "
-                                             "send_to_device "
-                                             "message: {}",
-                                             err->matrix_error.error);
-                      }
-                  });
+            encrypt_and_send_device_messages(std::move(msgs), ev_json);
         };
     };
 
@@ -5,9 +5,11 @@
 
 #pragma once
 
+#include <map>
 #include <memory>
 #include <mtx/events.hpp>
 #include <mtx/events/encrypted.hpp>
+#include <mtx/responses/sync.hpp>
 #include <mtxclient/crypto/client.hpp>
 
 #include "../CacheCryptoStructs.h"
@@ -96,6 +98,59 @@ DecryptionResult
 decryptEvent(const MegolmSessionIndex &index,
              const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event,
              bool dont_write_db = false);
+
+//! Decryption results of the events of one sync batch of a room.
+//!
+//! The sync worker decrypts the timeline before the sync is stored, the classification of
+//! hidden events and the timeline reuse those results, so that each event is decrypted only
+//! once per sync. Events, whose session was missing, are decrypted again on use, since the
+//! keys may arrive with the to_device messages of the same sync.
+class SyncDecryptionBatch
+{
+public:
+    explicit SyncDecryptionBatch(std::string room_id)
+      : room_id_(std::move(room_id))
+    {}
+
+    //! Decrypts the encrypted events of `timeline`, except reactions, whose type is known from
+    //! their unencrypted relation. Decrypting writes to the database, so this must not be
+    //! called inside a write transaction.
+    void decryptTimeline(const mtx::responses::Timeline &timeline);
+    //! Returns the result for `event`, decrypting it on first use.
+    const DecryptionResult &
+    decrypt(const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &event);
+    //! The result for an event, that was already decrypted, without decrypting it.
+    const DecryptionResult *find(const std::string &event_id);
+    //! Records a result, that was obtained elsewhere (i.e. from a cache).
+    void insert(const std::string &event_id, DecryptionResult result);
+
+    uint64_t decryptedCount() const { return decrypted_; }
+    uint64_t reusedCount() const { return reused_; }
+
+private:
+    std::string room_id_;
+    std::map<std::string, DecryptionResult> results_;
+    uint64_t decrypted_ = 0, reused_ = 0;
+};
+
+//! The decryption batches of a sync by room id.
+using SyncDecryption = std::map<std::string, SyncDecryptionBatch>;
+
+//! Decrypts the timelines of the joined rooms of a sync. Call it before storing the sync.
+std::shared_ptr<SyncDecryption>
+decryptSync(const mtx::responses::Rooms &rooms);
+
+struct SyncDecryptionStats
+{
+    //! events decrypted while processing syncs
+    uint64_t decrypted = 0;
+    //! decryptions avoided by reusing the result of the batch
+    uint64_t reused = 0;
+};
+//! Totals over all sync batches.
+SyncDecryptionStats
+syncDecryptionStats();
+
 crypto::Trust
 calculate_trust(const std::string &user_id, const MegolmSessionIndex &index);
 
@@ -131,3 +186,5 @@ void
 download_cross_signing_keys(const std::string &recoveryKey);
 
 } // namespace olm
+
+Q_DECLARE_METATYPE(std::shared_ptr<olm::SyncDecryption>)
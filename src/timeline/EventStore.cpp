@@ -5,6 +5,8 @@
 
 #include "EventStore.h"
 
+#include <QCoreApplication>
+#include <QPointer>
 #include <QThread>
 #include <QTimer>
 
@@ -16,15 +18,42 @@
 #include "EventAccessors.h"
 #include "Logging.h"
 #include "MatrixClient.h"
+#include "ReadReceiptScheduler.h"
 #include "UserSettings.h"
 #include "Utils.h"
+#include "encryption/DecryptionPool.h"
+#include "encryption/KeyBackupRestore.h"
 
 Q_DECLARE_METATYPE(Reaction)
 
-QCache<EventStore::IdIndex, olm::DecryptionResult> EventStore::decryptedEvents_{1000};
-QCache<EventStore::IdIndex, mtx::events::collections::TimelineEvents> EventStore::events_by_id_{
-  1000};
-QCache<EventStore::Index, mtx::events::collections::TimelineEvents> EventStore::events_{1000};
+namespace {
+//! Reactions and redactions are shown on their target, so their position in the timeline
+//! doesn't matter.
+bool
+isOrderIndependent(const mtx::events::collections::TimelineEvents &event)
+{
+    if (std::holds_alternative<mtx::events::RedactionEvent<mtx::events::msg::Redaction>>(event))
+        return true;
+
+    for (const auto &r : mtx::accessors::relations(event).relations)
+        if (r.rel_type == mtx::common::RelationType::Annotation)
+            return true;
+    return false;
+}
+
+//! The events `event` refers to by id.
+std::vector<std::string>
+relationTargets(const mtx::events::collections::TimelineEvents &event)
+{
+    std::vector<std::string> targets;
+    for (const auto &r : mtx::accessors::relations(event).relations)
+        targets.push_back(r.event_id);
+    if (auto redaction =
+          std::get_if<mtx::events::RedactionEvent<mtx::events::msg::Redaction>>(&event))
+        targets.push_back(redaction->content.redacts);
+    return targets;
+}
+}
 
 EventStore::EventStore(std::string room_id, QObject *)
   : room_id_(std::move(room_id))
@@ -64,21 +93,26 @@ EventStore::EventStore(std::string room_id, QObject *)
       &EventStore::oldMessagesRetrieved,
       this,
       [this](const mtx::responses::Messages &res) {
+          paginating_ = false;
           if (res.end.empty() || cache::client()->previousBatchToken(room_id_) == res.end) {
-              noMoreMessages = true;
+              noMoreMessages   = true;
+              fetch_requested_ = false;
               emit fetchedMore();
               return;
           }
 
           uint64_t newFirst = cache::client()->saveOldMessages(room_id_, res);
+          decryptInBackground(res.chunk);
+
           if (newFirst == first)
-              fetchMore();
+              paginate();
           else {
               if (this->last != std::numeric_limits<uint64_t>::max()) {
                   auto oldFirst = this->first;
                   emit beginInsertRows(toExternalIdx(newFirst), toExternalIdx(this->first - 1));
                   this->first = newFirst;
                   emit endInsertRows();
+                  fetch_requested_ = false;
                   emit fetchedMore();
                   emit dataChanged(toExternalIdx(oldFirst), toExternalIdx(oldFirst));
               } else {
@@ -89,72 +123,119 @@ EventStore::EventStore(std::string room_id, QObject *)
                       this->first = range->first;
                       this->last  = range->last;
                       emit endInsertRows();
+                      fetch_requested_ = false;
                       emit fetchedMore();
                   } else {
-                      fetchMore();
+                      paginate();
+                      return;
                   }
               }
+              prefetch();
+          }
+      },
+      Qt::QueuedConnection);
+
+    connect(
+      this,
+      &EventStore::paginationFailed,
+      this,
+      [this]() {
+          paginating_ = false;
+          if (fetch_requested_) {
+              fetch_requested_ = false;
+              emit fetchedMore();
           }
       },
       Qt::QueuedConnection);
 
+    connect(
+      cache::client(),
+      &Cache::hiddenEventsReclassified,
+      this,
+      [this](const QString &room_id) {
+          if (room_id.toStdString() != room_id_)
+              return;
+
+          emit beginResetModel();
+          reloadRange();
+          emit endResetModel();
+      },
+      Qt::QueuedConnection);
+
     connect(this, &EventStore::processPending, this, [this]() {
-        if (!current_txn.empty()) {
-            nhlog::ui()->debug("Already processing {}", current_txn);
+        // failures of messages, that are no longer pending, e.g. because their remote echo
+        // arrived, must not hold back the queue
+        dropStaleSendFailures();
+
+        // The server orders the timeline by arrival and requests in flight together may arrive
+        // in any order, so messages are sent one at a time. Reactions and redactions are
+        // aggregated onto their target instead of taking a place in the timeline, up to the
+        // send window of them go out next to the message.
+        auto window = static_cast<size_t>(std::max(UserSettings::instance()->sendWindow(), 1));
+        if (in_flight_.size() >= window) {
+            nhlog::ui()->debug("Already sending {} messages", in_flight_.size());
             return;
         }
 
-        auto event = cache::client()->firstPendingMessage(room_id_);
-
-        if (!event) {
+        // look past messages, that have to wait, for reactions and redactions
+        auto pending = cache::client()->pendingMessages(room_id_, in_flight_.size() + 2 * window);
+        if (pending.empty()) {
             nhlog::ui()->debug("No event to send");
             return;
         }
 
-        std::visit(
-          [this](const auto &e) {
-              const auto &txn_id = e.event_id;
-              this->current_txn  = txn_id;
-
-              if (txn_id.empty() || txn_id[0] != 'm') {
-                  nhlog::ui()->debug("Invalid txn id '{}'", txn_id);
-                  cache::client()->removePendingStatus(room_id_, txn_id);
-                  return;
-              }
+        auto isInFlight = [this](const std::string &txn_id) {
+            return std::find(in_flight_.begin(), in_flight_.end(), txn_id) != in_flight_.end();
+        };
+
+        // a message in flight or held back, later messages have to wait for it
+        bool messageWaiting = !ordered_in_flight_.empty();
+        // pending events, that were not sent in this pass
+        std::set<std::string> heldBack;
+
+        auto now = QDateTime::currentMSecsSinceEpoch();
+        for (const auto &event : pending) {
+            if (in_flight_.size() >= window)
+                break;
+
+            auto txn_id = mtx::accessors::event_id(event.data);
+            if (isInFlight(txn_id))
+                continue;
+
+            if (txn_id.empty() || txn_id[0] != 'm') {
+                nhlog::ui()->debug("Invalid txn id '{}'", txn_id);
+                cache::client()->removePendingStatus(room_id_, txn_id);
+                send_failures_.erase(txn_id);
+                continue;
+            }
 
-              if constexpr (mtx::events::message_content_to_type<decltype(e.content)> !=
-                            mtx::events::EventType::Unsupported)
-                  http::client()->send_room_message(
-                    room_id_,
-                    txn_id,
-                    e.content,
-                    [this, txn_id, e](const mtx::responses::EventId &event_id,
-                                      mtx::http::RequestErr err) {
-                        if (err) {
-                            const int status_code = static_cast<int>(err->status_code);
-                            nhlog::net()->warn("[{}] failed to send message: {} {}",
-                                               txn_id,
-                                               err->matrix_error.error,
-                                               status_code);
-                            emit messageFailed(txn_id);
-                            return;
-                        }
+            const bool ordered = !isOrderIndependent(event.data);
+            bool wait          = ordered && messageWaiting;
+
+            // waiting for its backoff, the timer sends it again
+            if (auto failure = send_failures_.find(txn_id);
+                failure != send_failures_.end() && failure->second.retry_at > now)
+                wait = true;
+
+            // replies, edits, reactions and redactions get the event id of their target once it
+            // was sent
+            for (const auto &target : relationTargets(event.data))
+                if (isInFlight(target) || heldBack.count(target))
+                    wait = true;
+
+            if (!wait) {
+                sendPending(event.data);
+                if (ordered && isInFlight(txn_id)) {
+                    ordered_in_flight_ = txn_id;
+                    messageWaiting     = true;
+                }
+                continue;
+            }
 
-                        emit messageSent(txn_id, event_id.event_id.to_string());
-                        if constexpr (std::is_same_v<decltype(e.content),
-                                                     mtx::events::msg::Encrypted>) {
-                            auto event = decryptEvent({room_id_, e.event_id}, e);
-                            if (event->event) {
-                                if (auto dec = std::get_if<mtx::events::RoomEvent<
-                                      mtx::events::msg::KeyVerificationRequest>>(
-                                      &event->event.value())) {
-                                    emit updateFlowEventId(event_id.event_id.to_string());
-                                }
-                            }
-                        }
-                    });
-          },
-          event->data);
+            heldBack.insert(txn_id);
+            if (ordered)
+                messageWaiting = true;
+        }
     });
 
     connect(
@@ -162,17 +243,25 @@ EventStore::EventStore(std::string room_id, QObject *)
       &EventStore::messageFailed,
       this,
       [this](std::string txn_id) {
-          if (current_txn == txn_id) {
-              current_txn_error_count++;
-              if (current_txn_error_count > 10) {
-                  nhlog::ui()->debug("failing txn id '{}'", txn_id);
-                  cache::client()->removePendingStatus(room_id_, txn_id);
-                  current_txn_error_count = 0;
-              }
+          in_flight_.erase(std::remove(in_flight_.begin(), in_flight_.end(), txn_id),
+                           in_flight_.end());
+          if (ordered_in_flight_ == txn_id)
+              ordered_in_flight_.clear();
+
+          auto &failure = send_failures_[txn_id];
+          failure.count++;
+          if (failure.count > 10) {
+              nhlog::ui()->debug("failing txn id '{}'", txn_id);
+              cache::client()->removePendingStatus(room_id_, txn_id);
+              send_failures_.erase(txn_id);
+              emit processPending();
+              return;
           }
-          QTimer::singleShot(1000, this, [this]() {
+
+          auto backoff     = std::min(1000 << (failure.count - 1), 30'000);
+          failure.retry_at = QDateTime::currentMSecsSinceEpoch() + backoff;
+          QTimer::singleShot(backoff, this, [this]() {
               nhlog::ui()->debug("timeout");
-              this->current_txn = "";
               emit processPending();
           });
       },
@@ -187,8 +276,12 @@ EventStore::EventStore(std::string room_id, QObject *)
 
           // Replace the event_id in pending edits/replies/redactions with the actual
           // event_id of this event. This allows one to edit and reply to events that are
-          // currently pending.
-          for (const auto &pending_event_id : cache::client()->pendingEvents(room_id_)) {
+          // currently pending. Relations are stored unencrypted, so only the pending events
+          // related to this one need to be looked at.
+          for (const auto &pending_event_id : cache::client()->relatedEvents(room_id_, txn_id)) {
+              if (!cache::client()->isPendingMessage(room_id_, pending_event_id))
+                  continue;
+
               if (auto pending_event = cache::client()->getEvent(room_id_, pending_event_id)) {
                   bool was_encrypted = false;
                   mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> original_encrypted;
@@ -263,34 +356,37 @@ EventStore::EventStore(std::string room_id, QObject *)
 
                   auto idx = idToIndex(pending_event_id);
 
-                  events_by_id_.remove({room_id_, pending_event_id});
-                  events_.remove({room_id_, toInternalIdx(*idx)});
+                  windowCache_.removeEventById(pending_event_id);
+                  if (idx)
+                      windowCache_.removeEvent(toInternalIdx(*idx));
               }
           }
 
-          http::client()->read_event(
-            room_id_,
-            event_id,
-            [this, event_id](mtx::http::RequestErr err) {
-                if (err) {
-                    nhlog::net()->warn("failed to read_event ({}, {})", room_id_, event_id);
-                }
-            },
-            !UserSettings::instance()->readReceipts());
-
           auto idx = idToIndex(event_id);
 
+          ReadReceiptScheduler::instance()->markAsRead(
+            room_id_, event_id, idx ? toInternalIdx(*idx) : last);
+
           if (idx)
               emit dataChanged(*idx, *idx);
 
           cache::client()->removePendingStatus(room_id_, txn_id);
-          this->current_txn             = "";
-          this->current_txn_error_count = 0;
+          in_flight_.erase(std::remove(in_flight_.begin(), in_flight_.end(), txn_id),
+                           in_flight_.end());
+          if (ordered_in_flight_ == txn_id)
+              ordered_in_flight_.clear();
+          send_failures_.erase(txn_id);
           emit processPending();
       },
       Qt::QueuedConnection);
 }
 
+EventStore::~EventStore()
+{
+    // responses still in flight must not touch the deleted store
+    *pagination_cancelled_ = true;
+}
+
 void
 EventStore::addPending(mtx::events::collections::TimelineEvents event)
 {
@@ -301,17 +397,85 @@ EventStore::addPending(mtx::events::collections::TimelineEvents event)
     mtx::responses::Timeline events;
     events.limited = false;
     events.events.emplace_back(event);
-    handleSync(events);
+    olm::SyncDecryptionBatch decrypted(room_id_);
+    handleSync(events, decrypted);
 
     emit processPending();
 }
 
+void
+EventStore::sendPending(const mtx::events::collections::TimelineEvents &event)
+{
+    std::visit(
+      [this](const auto &e) {
+          const auto &txn_id = e.event_id;
+
+          if constexpr (mtx::events::message_content_to_type<decltype(e.content)> ==
+                        mtx::events::EventType::Unsupported) {
+              nhlog::ui()->warn("Can't send txn id '{}' of unsupported type", txn_id);
+              cache::client()->removePendingStatus(room_id_, txn_id);
+              send_failures_.erase(txn_id);
+          } else {
+              in_flight_.push_back(txn_id);
+              http::client()->send_room_message(
+                room_id_,
+                txn_id,
+                e.content,
+                [this, txn_id, e](const mtx::responses::EventId &event_id,
+                                  mtx::http::RequestErr err) {
+                    if (err) {
+                        const int status_code = static_cast<int>(err->status_code);
+                        nhlog::net()->warn("[{}] failed to send message: {} {}",
+                                           txn_id,
+                                           err->matrix_error.error,
+                                           status_code);
+                        emit messageFailed(txn_id);
+                        return;
+                    }
+
+                    emit messageSent(txn_id, event_id.event_id.to_string());
+                    if constexpr (std::is_same_v<decltype(e.content),
+                                                 mtx::events::msg::Encrypted>) {
+                        auto event = decryptEvent({room_id_, e.event_id}, e);
+                        if (event->event) {
+                            if (auto dec = std::get_if<mtx::events::RoomEvent<
+                                  mtx::events::msg::KeyVerificationRequest>>(
+                                  &event->event.value())) {
+                                emit updateFlowEventId(event_id.event_id.to_string());
+                            }
+                        }
+                    }
+                });
+          }
+      },
+      event);
+}
+
+void
+EventStore::dropStaleSendFailures()
+{
+    for (auto it = send_failures_.begin(); it != send_failures_.end();)
+        if (!cache::client()->isPendingMessage(room_id_, it->first))
+            it = send_failures_.erase(it);
+        else
+            ++it;
+}
+
 void
 EventStore::clearTimeline()
 {
     emit beginResetModel();
 
     cache::client()->clearTimeline(room_id_);
+    reloadRange();
+    dropStaleSendFailures();
+
+    emit endResetModel();
+}
+
+void
+EventStore::reloadRange()
+{
     auto range = cache::client()->getTimelineRange(room_id_);
     if (range) {
         nhlog::db()->info("Range {} {}", range->last, range->first);
@@ -323,10 +487,8 @@ EventStore::clearTimeline()
     }
     nhlog::ui()->info("Range {} {}", this->last, this->first);
 
-    decryptedEvents_.clear();
-    events_.clear();
-
-    emit endResetModel();
+    windowCache_.clear();
+    decrypting_.clear();
 }
 
 void
@@ -346,16 +508,17 @@ EventStore::receivedSessionKey(const std::string &session_id)
     for (const auto &e : request.events) {
         auto idx = idToIndex(e.event_id);
         if (idx) {
-            decryptedEvents_.remove({room_id_, e.event_id});
-            events_by_id_.remove({room_id_, e.event_id});
-            events_.remove({room_id_, toInternalIdx(*idx)});
+            windowCache_.removeDecrypted(e.event_id);
+            windowCache_.removeEventById(e.event_id);
+            windowCache_.removeEvent(toInternalIdx(*idx));
             emit dataChanged(*idx, *idx);
         }
     }
 }
 
 void
-EventStore::handleSync(const mtx::responses::Timeline &events)
+EventStore::handleSync(const mtx::responses::Timeline &events,
+                       olm::SyncDecryptionBatch &decrypted)
 {
     if (this->thread() != QThread::currentThread())
         nhlog::db()->warn("{} called from a different thread!", __func__);
@@ -366,8 +529,7 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         this->first = std::numeric_limits<uint64_t>::max();
         this->last  = std::numeric_limits<uint64_t>::max();
 
-        decryptedEvents_.clear();
-        events_.clear();
+        windowCache_.clear();
         emit endResetModel();
         return;
     }
@@ -377,8 +539,7 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         this->last  = range->last;
         this->first = range->first;
 
-        decryptedEvents_.clear();
-        events_.clear();
+        windowCache_.clear();
         emit endResetModel();
     } else if (range->last > this->last) {
         emit beginInsertRows(toExternalIdx(this->last + 1), toExternalIdx(range->last));
@@ -392,14 +553,14 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         if (auto redaction =
               std::get_if<mtx::events::RedactionEvent<mtx::events::msg::Redaction>>(&event)) {
             // fixup reactions
-            auto redacted = events_by_id_.object({room_id_, redaction->redacts});
+            auto redacted = windowCache_.eventById(redaction->redacts);
             if (redacted) {
                 auto id = mtx::accessors::relations(*redacted);
                 if (id.annotates()) {
                     auto idx = idToIndex(id.annotates()->event_id);
                     if (idx) {
-                        events_by_id_.remove({room_id_, redaction->redacts});
-                        events_.remove({room_id_, toInternalIdx(*idx)});
+                        windowCache_.removeEventById(redaction->redacts);
+                        windowCache_.removeEvent(toInternalIdx(*idx));
                         emit dataChanged(*idx, *idx);
                     }
                 }
@@ -418,18 +579,21 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         for (const auto &relates_to_id : relates_to) {
             auto idx = cache::client()->getTimelineIndex(room_id_, relates_to_id);
             if (idx) {
-                events_by_id_.remove({room_id_, relates_to_id});
-                decryptedEvents_.remove({room_id_, relates_to_id});
-                events_.remove({room_id_, *idx});
+                windowCache_.removeEventById(relates_to_id);
+                windowCache_.removeDecrypted(relates_to_id);
+                windowCache_.removeEvent(*idx);
                 emit dataChanged(toExternalIdx(*idx), toExternalIdx(*idx));
             }
         }
 
         if (auto txn_id = mtx::accessors::transaction_id(event); !txn_id.empty()) {
+            // the remote echo replaces the pending message, even if sending it seemed to fail
+            if (send_failures_.erase(txn_id))
+                emit processPending();
+
             auto idx = cache::client()->getTimelineIndex(room_id_, mtx::accessors::event_id(event));
             if (idx) {
-                Index index{room_id_, *idx};
-                events_.remove(index);
+                windowCache_.removeEvent(*idx);
                 emit dataChanged(toExternalIdx(*idx), toExternalIdx(*idx));
             }
         }
@@ -447,7 +611,14 @@ EventStore::handleSync(const mtx::responses::Timeline &events)
         // decrypting and checking some encrypted messages
         if (auto encrypted =
               std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&event)) {
-            auto d_event = decryptEvent({room_id_, encrypted->event_id}, *encrypted);
+            IdIndex idx{room_id_, encrypted->event_id};
+            auto d_event = windowCache_.decrypted(idx.id);
+            if (d_event)
+                decrypted.insert(encrypted->event_id, *d_event);
+            else
+                d_event = handleDecryptionResult(
+                  idx, *encrypted, olm::DecryptionResult(decrypted.decrypt(*encrypted)));
+
             if (d_event->event &&
                 std::visit([](auto e) { return (e.sender != utils::localUser().toStdString()); },
                            *d_event->event)) {
@@ -509,107 +680,78 @@ EventStore::handle_room_verification(mtx::events::collections::TimelineEvents ev
       event);
 }
 
-std::vector<mtx::events::collections::TimelineEvents>
-EventStore::edits(const std::string &event_id)
+std::optional<mtx::events::collections::TimelineEvents>
+EventStore::latestEdit(const std::string &event_id)
 {
-    auto event_ids = cache::client()->relatedEvents(room_id_, event_id);
+    auto aggregation = cache::client()->relationAggregation(room_id_, event_id);
+    if (aggregation.edits.empty())
+        return std::nullopt;
 
     auto original_event = get(event_id, "", false, false);
     if (!original_event ||
         std::holds_alternative<mtx::events::RoomEvent<mtx::events::msg::Redacted>>(*original_event))
-        return {};
+        return std::nullopt;
 
     const auto &original_sender    = mtx::accessors::sender(*original_event);
     const auto &original_relations = mtx::accessors::relations(*original_event);
 
-    std::vector<mtx::events::collections::TimelineEvents> edits;
-    for (const auto &id : event_ids) {
-        auto related_event = get(id, event_id, false, false);
+    for (auto edit = aggregation.edits.rbegin(); edit != aggregation.edits.rend(); ++edit) {
+        if (edit->sender != original_sender)
+            continue;
+
+        auto related_event = get(edit->event_id, event_id, false, false);
         if (!related_event)
             continue;
 
         const auto &edit_rel = mtx::accessors::relations(*related_event);
-        if (edit_rel.replaces() == event_id &&
-            original_sender == mtx::accessors::sender(*related_event)) {
-            auto related_ev = *related_event;
-            if (edit_rel.synthesized && original_relations.reply_to() && !edit_rel.reply_to()) {
-                auto edit_rel_copy = edit_rel;
-                edit_rel_copy.relations.push_back(
-                  {mtx::common::RelationType::InReplyTo, original_relations.reply_to().value()});
-                mtx::accessors::set_relations(related_ev, std::move(edit_rel_copy));
-            }
-            edits.push_back(std::move(related_ev));
+        if (edit_rel.replaces() != event_id)
+            continue;
+
+        auto related_ev = *related_event;
+        if (edit_rel.synthesized && original_relations.reply_to() && !edit_rel.reply_to()) {
+            auto edit_rel_copy = edit_rel;
+            edit_rel_copy.relations.push_back(
+              {mtx::common::RelationType::InReplyTo, original_relations.reply_to().value()});
+            mtx::accessors::set_relations(related_ev, std::move(edit_rel_copy));
         }
+        return related_ev;
     }
 
-    auto c = cache::client();
-    std::sort(edits.begin(),
-              edits.end(),
-              [this, c](const mtx::events::collections::TimelineEvents &a,
-                        const mtx::events::collections::TimelineEvents &b) {
-                  return c->getArrivalIndex(this->room_id_, mtx::accessors::event_id(a)) <
-                         c->getArrivalIndex(this->room_id_, mtx::accessors::event_id(b));
-              });
-
-    return edits;
+    return std::nullopt;
 }
 
 QVariantList
 EventStore::reactions(const std::string &event_id)
 {
-    auto event_ids = cache::client()->relatedEvents(room_id_, event_id);
-
-    struct TempReaction
-    {
-        int count = 0;
-        std::vector<std::string> users;
-        std::string reactedBySelf;
-    };
-    std::map<std::string, TempReaction> aggregation;
-    std::vector<Reaction> reactions;
+    auto aggregation = cache::client()->relationAggregation(room_id_, event_id);
 
     auto self = http::client()->user_id().to_string();
-    for (const auto &id : event_ids) {
-        auto related_event = get(id, event_id);
-        if (!related_event)
-            continue;
-
-        if (auto reaction =
-              std::get_if<mtx::events::RoomEvent<mtx::events::msg::Reaction>>(related_event);
-            reaction && reaction->content.relations.annotates() &&
-            reaction->content.relations.annotates()->key) {
-            auto key  = reaction->content.relations.annotates()->key.value();
-            auto &agg = aggregation[key];
-
-            if (agg.count == 0) {
-                Reaction temp{};
-                temp.key_ = QString::fromStdString(key);
-                reactions.push_back(temp);
-            }
-
-            agg.count++;
-            agg.users.push_back(cache::displayName(room_id_, reaction->sender));
-            if (reaction->sender == self)
-                agg.reactedBySelf = reaction->event_id;
-        }
-    }
 
     QVariantList temp;
-    temp.reserve(static_cast<int>(reactions.size()));
-    for (auto &reaction : reactions) {
-        const auto &agg            = aggregation[reaction.key_.toStdString()];
-        reaction.count_            = agg.count;
-        reaction.selfReactedEvent_ = QString::fromStdString(agg.reactedBySelf);
+    temp.reserve(static_cast<int>(aggregation.reactions.size()));
+    for (const auto &reactions : aggregation.reactions) {
+        Reaction reaction{};
+        reaction.key_ = QString::fromStdString(reactions.key);
 
+        // a sender may have reacted several times with the same key, count them once
+        std::set<std::string_view> senders;
         bool firstReaction = true;
-        for (const auto &user : agg.users) {
+        for (const auto &[sender, reaction_id] : reactions.senders) {
+            // the newest one is the one to redact
+            if (sender == self)
+                reaction.selfReactedEvent_ = QString::fromStdString(reaction_id);
+
+            if (!senders.insert(sender).second)
+                continue;
+
             if (firstReaction)
                 firstReaction = false;
             else
                 reaction.users_ += QLatin1String(", ");
 
-            reaction.users_ += QString::fromStdString(user);
+            reaction.users_ += QString::fromStdString(cache::displayName(room_id_, sender));
         }
+        reaction.count_ = static_cast<int>(senders.size());
 
         temp.append(QVariant::fromValue(reaction));
     }
@@ -627,29 +769,32 @@ EventStore::get(int idx, bool decrypt)
     if (index.idx > last || index.idx < first)
         return nullptr;
 
-    auto event_ptr = events_.object(index);
+    windowCache_.setFocus(index.idx);
+    auto event_ptr = windowCache_.event(index.idx);
     if (!event_ptr) {
         auto event_id = cache::client()->getTimelineEventId(room_id_, index.idx);
         if (!event_id)
             return nullptr;
 
         std::optional<mtx::events::collections::TimelineEvent> event;
-        auto edits_ = edits(*event_id);
-        if (edits_.empty())
-            event = cache::client()->getEvent(room_id_, *event_id);
+        if (auto edit = latestEdit(*event_id))
+            event = {std::move(*edit)};
         else
-            event = {edits_.back()};
+            event = cache::client()->getEvent(room_id_, *event_id);
 
         if (!event)
             return nullptr;
-        else
-            event_ptr = new mtx::events::collections::TimelineEvents(std::move(event->data));
-        events_.insert(index, event_ptr);
+        event_ptr = windowCache_.insertEvent(index.idx, std::move(event->data));
     }
 
     if (decrypt) {
         if (auto encrypted =
               std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(event_ptr)) {
+            // still being decrypted in the background, dataChanged is emitted once done
+            if (decrypting_.count(encrypted->event_id) &&
+                !windowCache_.hasDecrypted(encrypted->event_id))
+                return event_ptr;
+
             auto decrypted = decryptEvent({room_id_, encrypted->event_id}, *encrypted);
             if (decrypted->event)
                 return &*decrypted->event;
@@ -684,18 +829,24 @@ olm::DecryptionResult *
 EventStore::decryptEvent(const IdIndex &idx,
                          const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e)
 {
-    if (auto cachedEvent = decryptedEvents_.object(idx))
+    if (auto cachedEvent = windowCache_.decrypted(idx.id))
         return cachedEvent;
 
     MegolmSessionIndex index(room_id_, e.content);
 
-    auto asCacheEntry = [&idx](olm::DecryptionResult &&event) {
-        auto event_ptr = new olm::DecryptionResult(std::move(event));
-        decryptedEvents_.insert(idx, event_ptr);
-        return event_ptr;
-    };
+    return handleDecryptionResult(idx, e, olm::decryptEvent(index, e));
+}
+
+olm::DecryptionResult *
+EventStore::handleDecryptionResult(const IdIndex &idx,
+                                   const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e,
+                                   olm::DecryptionResult &&decryptionResult)
+{
+    MegolmSessionIndex index(room_id_, e.content);
 
-    auto decryptionResult = olm::decryptEvent(index, e);
+    auto asCacheEntry = [this, &idx](olm::DecryptionResult &&event) {
+        return windowCache_.insertDecrypted(idx.id, std::move(event));
+    };
 
     if (decryptionResult.error) {
         switch (decryptionResult.error) {
@@ -746,6 +897,49 @@ EventStore::decryptEvent(const IdIndex &idx,
     return asCacheEntry(std::move(decryptionResult));
 }
 
+void
+EventStore::decryptInBackground(const std::vector<mtx::events::collections::TimelineEvents> &events)
+{
+    std::vector<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>> encrypted;
+    for (const auto &event : events) {
+        if (auto e = std::get_if<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(&event);
+            e && !decrypting_.count(e->event_id) &&
+            !windowCache_.hasDecrypted(e->event_id))
+            encrypted.push_back(*e);
+    }
+
+    if (encrypted.empty())
+        return;
+
+    for (const auto &e : encrypted)
+        decrypting_.insert(e.event_id);
+
+    DecryptionPool::instance()->decrypt(
+      this,
+      room_id_,
+      encrypted,
+      [this, encrypted](std::vector<olm::DecryptionResult> results) {
+          std::optional<int> from, to;
+          for (std::size_t i = 0; i < encrypted.size(); i++) {
+              const auto &e = encrypted[i];
+              if (!decrypting_.erase(e.event_id))
+                  continue; // timeline was cleared in the mean time
+
+              // the event may have been decrypted on demand in the mean time
+              if (!windowCache_.hasDecrypted(e.event_id))
+                  handleDecryptionResult({room_id_, e.event_id}, e, std::move(results[i]));
+
+              if (auto idx = idToIndex(e.event_id)) {
+                  from = std::min(from.value_or(*idx), *idx);
+                  to   = std::max(to.value_or(*idx), *idx);
+              }
+          }
+
+          if (from)
+              emit dataChanged(*from, *to);
+      });
+}
+
 void
 EventStore::requestSession(const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &ev,
                            bool manual)
@@ -780,10 +974,7 @@ void
 EventStore::enableKeyRequests(bool suppressKeyRequests_)
 {
     if (!suppressKeyRequests_) {
-        auto keys = decryptedEvents_.keys();
-        for (const auto &key : qAsConst(keys))
-            if (key.room == this->room_id_)
-                decryptedEvents_.remove(key);
+        windowCache_.clearDecrypted();
         suppressKeyRequests = false;
     } else
         suppressKeyRequests = true;
@@ -803,15 +994,13 @@ EventStore::get(const std::string &id,
 
     IdIndex index{room_id_, id};
     if (resolve_edits) {
-        auto edits_ = edits(index.id);
-        if (!edits_.empty()) {
-            index.id       = mtx::accessors::event_id(edits_.back());
-            auto event_ptr = new mtx::events::collections::TimelineEvents(std::move(edits_.back()));
-            events_by_id_.insert(index, event_ptr);
+        if (auto edit = latestEdit(index.id)) {
+            index.id = mtx::accessors::event_id(*edit);
+            windowCache_.insertEventById(index.id, std::move(*edit));
         }
     }
 
-    auto event_ptr = events_by_id_.object(index);
+    auto event_ptr = windowCache_.eventById(index.id);
     if (!event_ptr) {
         auto event = cache::client()->getEvent(room_id_, index.id);
         if (!event) {
@@ -832,8 +1021,7 @@ EventStore::get(const std::string &id,
                                       });
             return nullptr;
         }
-        event_ptr = new mtx::events::collections::TimelineEvents(std::move(event->data));
-        events_by_id_.insert(index, event_ptr);
+        event_ptr = windowCache_.insertEventById(index.id, std::move(event->data));
     }
 
     if (decrypt) {
@@ -858,21 +1046,18 @@ EventStore::decryptionError(std::string id)
         return olm::DecryptionErrorCode::NoError;
 
     IdIndex index{room_id_, std::move(id)};
-    auto edits_ = edits(index.id);
-    if (!edits_.empty()) {
-        index.id       = mtx::accessors::event_id(edits_.back());
-        auto event_ptr = new mtx::events::collections::TimelineEvents(std::move(edits_.back()));
-        events_by_id_.insert(index, event_ptr);
+    if (auto edit = latestEdit(index.id)) {
+        index.id = mtx::accessors::event_id(*edit);
+        windowCache_.insertEventById(index.id, std::move(*edit));
     }
 
-    auto event_ptr = events_by_id_.object(index);
+    auto event_ptr = windowCache_.eventById(index.id);
     if (!event_ptr) {
         auto event = cache::client()->getEvent(room_id_, index.id);
         if (!event) {
             return olm::DecryptionErrorCode::NoError;
         }
-        event_ptr = new mtx::events::collections::TimelineEvents(std::move(event->data));
-        events_by_id_.insert(index, event_ptr);
+        event_ptr = windowCache_.insertEventById(index.id, std::move(event->data));
     }
 
     if (auto encrypted =
@@ -892,31 +1077,101 @@ EventStore::fetchMore()
         return;
     }
 
+    // a prefetch in flight answers this request as well
+    fetch_requested_ = true;
+    if (!paginating_)
+        paginate();
+}
+
+void
+EventStore::scrolledTo(int idx)
+{
+    viewport_ = toInternalIdx(idx);
+    prefetch();
+
+    // the sessions of the room in view are the most useful ones while restoring a backup
+    if (KeyBackupRestore::instance()->running())
+        KeyBackupRestore::instance()->prioritize(room_id_);
+}
+
+void
+EventStore::prefetch()
+{
+    auto pages = UserSettings::instance()->prefetchPages();
+    if (pages <= 0 || paginating_ || noMoreMessages || !viewport_)
+        return;
+
+    // decrypted events of prefetched pages end up in the window cache, so stop before it has
+    // to evict the visible ones
+    if (windowCache_.residentBytes() > windowCache_.budget() / 4 * 3) {
+        nhlog::ui()->debug("Not prefetching {}, cache is at {} bytes",
+                           room_id_,
+                           windowCache_.residentBytes());
+        return;
+    }
+
+    const uint64_t pageSize = mtx::http::MessagesOpts{}.limit;
+    if (size() && *viewport_ >= first && *viewport_ - first >= pages * pageSize)
+        return;
+
+    paginate();
+}
+
+void
+EventStore::cancelPrefetch()
+{
+    // without a position, nothing is prefetched until the view scrolls again
+    viewport_.reset();
+    if (!paginating_ || fetch_requested_)
+        return;
+
+    *pagination_cancelled_ = true;
+    pagination_cancelled_  = std::make_shared<std::atomic<bool>>(false);
+    paginating_            = false;
+}
+
+void
+EventStore::paginate()
+{
     mtx::http::MessagesOpts opts;
     opts.room_id = room_id_;
     opts.from    = cache::client()->previousBatchToken(room_id_);
 
     nhlog::ui()->debug("Paginating room {}, token {}", opts.room_id, opts.from);
 
+    paginating_ = true;
     http::client()->messages(
-      opts, [this, opts](const mtx::responses::Messages &res, mtx::http::RequestErr err) {
-          if (cache::client()->previousBatchToken(room_id_) != opts.from) {
+      opts,
+      [store = QPointer<EventStore>(this), opts, cancelled = pagination_cancelled_](
+        const mtx::responses::Messages &res, mtx::http::RequestErr err) {
+          if (*cancelled)
+              return;
+
+          bool cleared = cache::client()->previousBatchToken(opts.room_id) != opts.from;
+          if (cleared) {
               nhlog::net()->warn("Cache cleared while fetching more messages, dropping "
                                  "/messages response");
-              if (!opts.to.empty())
-                  emit fetchedMore();
-              return;
-          }
-          if (err) {
+          } else if (err) {
               nhlog::net()->error("failed to call /messages ({}): {} - {} - {}",
                                   opts.room_id,
                                   mtx::errors::to_string(err->matrix_error.errcode),
                                   err->matrix_error.error,
                                   err->parse_error);
-              emit fetchedMore();
-              return;
           }
-
-          emit oldMessagesRetrieved(std::move(res));
+          bool failed = cleared || err;
+
+          // The store may be destroyed at any time on its thread, so only look at it there.
+          QMetaObject::invokeMethod(
+            QCoreApplication::instance(),
+            [store, cancelled, failed, res]() mutable {
+                if (!store || *cancelled)
+                    return;
+
+                if (failed)
+                    emit store->paginationFailed();
+                else
+                    emit store->oldMessagesRetrieved(std::move(res));
+            },
+            Qt::QueuedConnection);
       });
 }
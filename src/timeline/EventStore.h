@@ -5,10 +5,14 @@
 
 #pragma once
 
+#include <atomic>
 #include <limits>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
 
-#include <QCache>
+#include <QHash>
 #include <QObject>
 #include <QVariant>
 
@@ -17,6 +21,7 @@
 #include <mtx/responses/sync.hpp>
 
 #include "Reaction.h"
+#include "TimelineWindowCache.h"
 #include "../encryption/Olm.h"
 
 class EventStore : public QObject
@@ -25,6 +30,7 @@ class EventStore : public QObject
 
 public:
     EventStore(std::string room_id, QObject *parent);
+    ~EventStore() override;
 
     // taken from QtPrivate::QHashCombine
     static uint hashCombine(uint hash, uint seed)
@@ -66,7 +72,11 @@ public:
     };
 
     void fetchMore();
-    void handleSync(const mtx::responses::Timeline &events);
+    //! Tells the store the topmost row the view shows. With UserSettings::prefetchPages, that
+    //! many pages of history are kept loaded and decrypted above it.
+    void scrolledTo(int idx);
+    //! Decrypted events are recorded in `decrypted`, for later consumers of the same sync.
+    void handleSync(const mtx::responses::Timeline &events, olm::SyncDecryptionBatch &decrypted);
 
     // optionally returns the event or nullptr and fetches it, after which it emits a
     // relatedFetched event
@@ -78,7 +88,9 @@ public:
     mtx::events::collections::TimelineEvents *get(int idx, bool decrypt = true);
 
     QVariantList reactions(const std::string &event_id);
-    std::vector<mtx::events::collections::TimelineEvents> edits(const std::string &event_id);
+    //! The edit that currently replaces the event, if any.
+    std::optional<mtx::events::collections::TimelineEvents>
+    latestEdit(const std::string &event_id);
     olm::DecryptionErrorCode decryptionError(std::string id);
     void
     requestSession(const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &ev, bool manual);
@@ -92,6 +104,9 @@ public:
     int toExternalIdx(uint64_t idx) const { return static_cast<int>(idx - first); }
     uint64_t toInternalIdx(int idx) const { return first + idx; }
 
+    //! Cached events of this room, i.e. to inspect its hit rate and resident size.
+    const TimelineWindowCache &windowCache() const { return windowCache_; }
+
     std::optional<int> idToIndex(std::string_view id) const;
     std::optional<std::string> indexToId(int idx) const;
 
@@ -108,6 +123,7 @@ signals:
                       mtx::events::collections::TimelineEvents timeline);
     void oldMessagesRetrieved(const mtx::responses::Messages &);
     void fetchedMore();
+    void paginationFailed();
 
     void processPending();
     void messageSent(std::string txn_id, std::string event_id);
@@ -121,21 +137,40 @@ public slots:
     void receivedSessionKey(const std::string &session_id);
     void clearTimeline();
     void enableKeyRequests(bool suppressKeyRequests_);
+    //! Stops prefetching until the next scrolledTo() and drops a prefetch in flight. Pages,
+    //! that were requested with fetchMore(), are still loaded.
+    void cancelPrefetch();
     
 private:
     olm::DecryptionResult *
     decryptEvent(const IdIndex &idx,
       const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e);
+    olm::DecryptionResult *
+    handleDecryptionResult(const IdIndex &idx,
+                           const mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> &e,
+                           olm::DecryptionResult &&decryptionResult);
+    //! Starts sending a pending message. Its result is reported by messageSent or
+    //! messageFailed.
+    void sendPending(const mtx::events::collections::TimelineEvents &event);
+    //! Forgets the failures of messages, that are no longer pending.
+    void dropStaleSendFailures();
+    //! Reads the timeline range from the cache again and drops the cached events.
+    void reloadRange();
+    //! Decrypts the encrypted events of a backfilled page on the decryption pool.
+    void decryptInBackground(const std::vector<mtx::events::collections::TimelineEvents> &events);
     void handle_room_verification(mtx::events::collections::TimelineEvents event);
+    //! Requests the page before the oldest stored one. Its result is reported by
+    //! oldMessagesRetrieved or paginationFailed.
+    void paginate();
+    //! Paginates, if fewer pages than configured are loaded above the viewport.
+    void prefetch();
 
     std::string room_id_;
 
     uint64_t first = std::numeric_limits<uint64_t>::max(),
              last  = std::numeric_limits<uint64_t>::max();
 
-    static QCache<IdIndex, olm::DecryptionResult> decryptedEvents_;
-    static QCache<Index, mtx::events::collections::TimelineEvents> events_;
-    static QCache<IdIndex, mtx::events::collections::TimelineEvents> events_by_id_;
+    TimelineWindowCache windowCache_;
 
     struct PendingKeyRequests
     {
@@ -145,8 +180,27 @@ private:
     };
     std::map<std::string, PendingKeyRequests> pending_key_requests;
 
-    std::string current_txn;
-    int current_txn_error_count = 0;
+    //! event ids currently decrypted in the background
+    std::set<std::string> decrypting_;
+
+    //! transaction ids of the messages being sent, in queue order
+    std::vector<std::string> in_flight_;
+    //! transaction id of the message in flight, that later messages wait for
+    std::string ordered_in_flight_;
+    struct SendFailure
+    {
+        int count       = 0;
+        qint64 retry_at = 0;
+    };
+    std::map<std::string, SendFailure> send_failures_;
     bool noMoreMessages         = false;
+    //! a /messages request is in flight
+    bool paginating_ = false;
+    //! fetchMore was called and waits for the request in flight
+    bool fetch_requested_ = false;
+    std::optional<uint64_t> viewport_;
+    //! set, when the response of the request in flight should be dropped
+    std::shared_ptr<std::atomic<bool>> pagination_cancelled_ =
+      std::make_shared<std::atomic<bool>>(false);
     bool suppressKeyRequests    = true;
 };
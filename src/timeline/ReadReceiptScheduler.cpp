@@ -0,0 +1,102 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "ReadReceiptScheduler.h"
+
+#include <QTimer>
+
+#include <algorithm>
+
+#include "Logging.h"
+#include "MatrixClient.h"
+#include "UserSettings.h"
+
+ReadReceiptScheduler *ReadReceiptScheduler::instance_ = nullptr;
+
+ReadReceiptScheduler *
+ReadReceiptScheduler::instance()
+{
+    if (!instance_)
+        instance_ = new ReadReceiptScheduler();
+    return instance_;
+}
+
+void
+ReadReceiptScheduler::markAsRead(const std::string &room_id,
+                                 const std::string &event_id,
+                                 uint64_t index)
+{
+    auto &room = rooms_[room_id];
+
+    if ((room.sent && index <= room.sent_index) || (room.pending && index <= room.pending_index)) {
+        suppressed_++;
+        return;
+    }
+
+    if (room.pending)
+        suppressed_++;
+
+    room.pending_event_id = event_id;
+    room.pending_index    = index;
+    room.pending          = true;
+
+    if (room.scheduled)
+        return;
+
+    room.scheduled = true;
+    QTimer::singleShot(std::max(UserSettings::instance()->readReceiptDelay(), 0),
+                       this,
+                       [this, room_id]() { send(room_id); });
+}
+
+void
+ReadReceiptScheduler::reset(const std::string &room_id)
+{
+    auto room = rooms_.find(room_id);
+    if (room == rooms_.end())
+        return;
+
+    room->second.sent    = false;
+    room->second.pending = false;
+    room->second.pending_event_id.clear();
+}
+
+void
+ReadReceiptScheduler::send(const std::string &room_id)
+{
+    auto &room     = rooms_[room_id];
+    room.scheduled = false;
+    if (!room.pending)
+        return;
+
+    auto event_id = std::move(room.pending_event_id);
+    auto index    = room.pending_index;
+    room.pending  = false;
+    room.pending_event_id.clear();
+
+    room.sent_index = index;
+    room.sent       = true;
+    sent_++;
+
+    http::client()->read_event(
+      room_id,
+      event_id,
+      [this, room_id, event_id, index](mtx::http::RequestErr err) {
+          if (!err)
+              return;
+
+          nhlog::net()->warn("failed to read_event ({}, {})", room_id, event_id);
+
+          // allow the same event to be marked as read again
+          QMetaObject::invokeMethod(
+            this,
+            [this, room_id, index]() {
+                auto room = rooms_.find(room_id);
+                if (room != rooms_.end() && room->second.sent && room->second.sent_index == index)
+                    room->second.sent = false;
+            },
+            Qt::QueuedConnection);
+      },
+      !UserSettings::instance()->readReceipts());
+}
@@ -0,0 +1,60 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <QObject>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+
+//! Coalesces read receipts and read markers per room.
+//!
+//! Only the newest event of a room is sent, at most once per delay window (see
+//! UserSettings::readReceiptDelay). Events older than the last one sent are dropped, so the
+//! read marker never moves backwards. The fully read marker and the receipt are sent in one
+//! request to /read_markers.
+class ReadReceiptScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    static ReadReceiptScheduler *instance();
+
+    //! Marks `event_id` as read. `index` is the internal (EventStore) index of the event and
+    //! used to find the newest event of a room.
+    void markAsRead(const std::string &room_id, const std::string &event_id, uint64_t index);
+    //! Forgets the last sent receipt of a room, i.e. after its timeline was reset.
+    void reset(const std::string &room_id);
+
+    //! Number of read_event requests sent.
+    uint64_t sentCount() const { return sent_; }
+    //! Number of receipts, that were coalesced into another request or dropped.
+    uint64_t suppressedCount() const { return suppressed_; }
+
+private:
+    ReadReceiptScheduler(QObject *parent = nullptr)
+      : QObject(parent)
+    {}
+
+    void send(const std::string &room_id);
+
+    struct RoomReceipt
+    {
+        std::string pending_event_id;
+        uint64_t pending_index = 0;
+        bool pending           = false;
+        bool scheduled         = false;
+
+        uint64_t sent_index = 0;
+        bool sent           = false;
+    };
+
+    std::map<std::string, RoomReceipt> rooms_;
+    std::atomic<uint64_t> sent_{0}, suppressed_{0};
+
+    static ReadReceiptScheduler *instance_;
+};
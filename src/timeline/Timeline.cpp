@@ -8,6 +8,7 @@
 #include "Client.h"
 #include "Cache_p.h"
 #include "MatrixClient.h"
+#include "ReadReceiptScheduler.h"
 #include "../Utils.h"
 
 
@@ -253,6 +254,9 @@ Timeline::Timeline(const QString &roomId, QObject *parent):
     connect(&_events, &EventStore::updateFlowEventId, this, [this](std::string event_id) {
         this->updateFlowEventId(event_id);
     });
+    connect(&_events, &EventStore::beginResetModel, this, [this]() {
+        ReadReceiptScheduler::instance()->reset(_roomId.toStdString());
+    });
 }
 
 template<typename T>
@@ -436,9 +440,9 @@ Timeline::addPendingMessage(mtx::events::collections::TimelineEvents event)
     std::visit(SendMessageVisitor{this}, event);
 }
 
-void Timeline::sync(const mtx::responses::JoinedRoom &room){
+void Timeline::sync(const mtx::responses::JoinedRoom &room, olm::SyncDecryptionBatch &decrypted){
     // this->syncState(room.state);
-    addEvents(room.timeline);
+    addEvents(room.timeline, decrypted);
     if (room.unread_notifications.highlight_count != _highlightCount ||
         room.unread_notifications.notification_count != _notificationCount) {
         _notificationCount = room.unread_notifications.notification_count;
@@ -475,19 +479,19 @@ bool Timeline::canFetchMore()const {
         return false;
 }
 
-void Timeline::addEvents(const mtx::responses::Timeline &timeline){
+void Timeline::addEvents(const mtx::responses::Timeline &timeline,
+                         olm::SyncDecryptionBatch &decrypted){
     if (timeline.events.empty())
         return;
 
-    _events.handleSync(timeline);
+    // decrypted when the sync was stored, the store and the checks below reuse the results
+    _events.handleSync(timeline, decrypted);
 
     using namespace mtx::events;
 
     for (auto e : timeline.events) {
         if (auto encryptedEvent = std::get_if<EncryptedEvent<msg::Encrypted>>(&e)) {
-            MegolmSessionIndex index(_roomId.toStdString(), encryptedEvent->content);
-
-            auto result = olm::decryptEvent(index, *encryptedEvent);
+            const auto &result = decrypted.decrypt(*encryptedEvent);
             if (result.event)
                 e = result.event.value();
         }
@@ -589,6 +593,25 @@ isMessage(const mtx::events::RoomEvent<mtx::events::voip::CallHangUp> &)
     return true;
 }
 
+//! Types of events, that can be shown by isMessage or isYourJoin.
+bool
+mayBeLastMessage(mtx::events::EventType type)
+{
+    using mtx::events::EventType;
+    switch (type) {
+    case EventType::RoomMessage:
+    case EventType::RoomEncrypted:
+    case EventType::Sticker:
+    case EventType::CallInvite:
+    case EventType::CallAnswer:
+    case EventType::CallHangUp:
+    case EventType::RoomMember:
+        return true;
+    default:
+        return false;
+    }
+}
+
 DescInfo
 Timeline::lastMessage() const
 {
@@ -604,6 +627,12 @@ Timeline::updateLastMessage()
     // only try to generate a preview for the last 1000 messages
     auto end = std::max(_events.size() - 1001, 0);
     for (auto it = _events.size() - 1; it >= end; --it) {
+        // skip what can't be shown without decoding or decrypting it
+        if (auto type = cache::client()->getTimelineEventType(_roomId.toStdString(),
+                                                              _events.toInternalIdx(it));
+            type && !mayBeLastMessage(*type))
+            continue;
+
         auto event = _events.get(it, _decryptDescription);
         if (!event)
             continue;
@@ -648,8 +677,9 @@ Timeline::updateLastMessage()
 }
 
 QVector<DescInfo> Timeline::getEvents(int from, int len, bool markAsRead){
+    _events.scrolledTo(from);
     QVector<DescInfo> events;
-    QStringList eventIds;
+    std::optional<int> newest;
     for(int i = from; i < from + len && i < _events.size(); i++){
         auto e = _events.get(i,true);
         if(e) {
@@ -657,23 +687,28 @@ QVector<DescInfo> Timeline::getEvents(int from, int len, bool markAsRead){
                     utils::localUser(), 
                     cache::displayName(_roomId, QString::fromStdString(mtx::accessors::sender(*e))));
             events.push_back(descMsg);
-            eventIds << descMsg.event_id;
+            newest = i;
         }
     }
-    if(markAsRead){
-        markEventsAsRead(eventIds);
+    if(markAsRead && newest){
+        // only the newest event matters, older ones are covered by its receipt
+        ReadReceiptScheduler::instance()->markAsRead(_roomId.toStdString(),
+                                                     events.back().event_id.toStdString(),
+                                                     _events.toInternalIdx(*newest));
     }
     return events;
 }
 
 void Timeline::markEventsAsRead(const QStringList &event_ids){
     for(auto const &id: event_ids){
-        http::client()->read_event(_roomId.toStdString(), id.toStdString(), [this, id](mtx::http::RequestErr err) {
-            if (err) {
-                nhlog::net()->warn(
-                    "failed to read_event ({}, {})", _roomId.toStdString(), id.toStdString());
-            }
-        });
+        auto idx = _events.idToIndex(id.toStdString());
+        if (!idx) {
+            nhlog::net()->warn(
+                "failed to read_event ({}, {}), not in timeline", _roomId.toStdString(), id.toStdString());
+            continue;
+        }
+        ReadReceiptScheduler::instance()->markAsRead(
+          _roomId.toStdString(), id.toStdString(), _events.toInternalIdx(*idx));
     }
 }
 
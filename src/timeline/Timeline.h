@@ -257,10 +257,15 @@ class Timeline : public QObject {
 Q_OBJECT
 public:
     Timeline(const QString &roomId, QObject *parent = nullptr);
-    void sync(const mtx::responses::JoinedRoom &room);
+    //! `decrypted` may already hold results for the events of this sync.
+    void sync(const mtx::responses::JoinedRoom &room, olm::SyncDecryptionBatch &decrypted);
     void initialSync();
     QString escapeEmoji(QString str) const;
     QString id() {return _roomId;};    
+    //! The view must call this, when it stops showing the room, i.e. on a room switch. It stops
+    //! loading history ahead of the last getEvents() position, the next getEvents() call
+    //! resumes it.
+    Q_INVOKABLE void closed() { _events.cancelPrefetch(); }
     using UserReceipts = std::multimap<uint64_t, std::string, std::greater<uint64_t>>;
 
 signals:
@@ -339,7 +344,7 @@ public:
     void sendMessageEvent(const T &content, mtx::events::EventType eventType);
 
 private:
-    void addEvents(const mtx::responses::Timeline &timeline);
+    void addEvents(const mtx::responses::Timeline &timeline, olm::SyncDecryptionBatch &decrypted);
 
     template<typename T>
     void sendEncryptedMessage(mtx::events::RoomEvent<T> msg, mtx::events::EventType eventType);
@@ -0,0 +1,241 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "TimelineWindowCache.h"
+
+#include <iterator>
+
+#include "EventAccessors.h"
+
+namespace {
+// content fields not covered by the accessors below, i.e. state event content and mxc urls
+constexpr std::size_t contentOverhead = 256;
+
+std::size_t
+estimateSize(const mtx::events::collections::TimelineEvents &event)
+{
+    return sizeof(event) + contentOverhead + mtx::accessors::event_id(event).size() +
+           mtx::accessors::sender(event).size() + mtx::accessors::room_id(event).size() +
+           mtx::accessors::body(event).size() + mtx::accessors::formatted_body(event).size() +
+           mtx::accessors::relations(event).relations.size() * sizeof(mtx::common::Relation);
+}
+
+std::size_t
+estimateSize(const olm::DecryptionResult &result)
+{
+    return sizeof(result) + (result.error_message ? result.error_message->size() : 0) +
+           (result.event ? estimateSize(*result.event) : 0);
+}
+}
+
+mtx::events::collections::TimelineEvents *
+TimelineWindowCache::event(uint64_t idx)
+{
+    auto slot = window_.find(idx);
+    if (slot == window_.end()) {
+        misses_++;
+        return nullptr;
+    }
+
+    hits_++;
+    return slot->second.event.get();
+}
+
+mtx::events::collections::TimelineEvents *
+TimelineWindowCache::insertEvent(uint64_t idx, mtx::events::collections::TimelineEvents &&event)
+{
+    if (auto slot = window_.find(idx); slot != window_.end())
+        erase(slot);
+
+    Slot slot;
+    slot.size  = sizeof(idx) + estimateSize(event);
+    slot.event = std::make_unique<mtx::events::collections::TimelineEvents>(std::move(event));
+    auto ptr   = slot.event.get();
+
+    bytes_ += slot.size;
+    inserted_ = idx;
+    window_.emplace(idx, std::move(slot));
+    evict();
+
+    return ptr;
+}
+
+void
+TimelineWindowCache::removeEvent(uint64_t idx)
+{
+    if (auto slot = window_.find(idx); slot != window_.end())
+        erase(slot);
+}
+
+mtx::events::collections::TimelineEvents *
+TimelineWindowCache::eventById(const std::string &id)
+{
+    auto it = by_id_.find(id);
+    if (it == by_id_.end()) {
+        misses_++;
+        return nullptr;
+    }
+
+    hits_++;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->event.get();
+}
+
+mtx::events::collections::TimelineEvents *
+TimelineWindowCache::insertEventById(const std::string &id,
+                                     mtx::events::collections::TimelineEvents &&event)
+{
+    erase(by_id_, id);
+
+    Item item;
+    item.id    = id;
+    item.size  = sizeof(Item) + id.size() + estimateSize(event);
+    item.event = std::make_unique<mtx::events::collections::TimelineEvents>(std::move(event));
+    auto ptr   = item.event.get();
+
+    bytes_ += item.size;
+    lru_.push_front(std::move(item));
+    by_id_.emplace(id, lru_.begin());
+    evict();
+
+    return ptr;
+}
+
+void
+TimelineWindowCache::removeEventById(const std::string &id)
+{
+    erase(by_id_, id);
+}
+
+olm::DecryptionResult *
+TimelineWindowCache::decrypted(const std::string &id)
+{
+    auto it = decrypted_.find(id);
+    if (it == decrypted_.end()) {
+        misses_++;
+        return nullptr;
+    }
+
+    hits_++;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->decrypted.get();
+}
+
+olm::DecryptionResult *
+TimelineWindowCache::insertDecrypted(const std::string &id, olm::DecryptionResult &&result)
+{
+    erase(decrypted_, id);
+
+    Item item;
+    item.id        = id;
+    item.size      = sizeof(Item) + id.size() + estimateSize(result);
+    item.decrypted = std::make_unique<olm::DecryptionResult>(std::move(result));
+    auto ptr       = item.decrypted.get();
+
+    bytes_ += item.size;
+    lru_.push_front(std::move(item));
+    decrypted_.emplace(id, lru_.begin());
+    evict();
+
+    return ptr;
+}
+
+void
+TimelineWindowCache::removeDecrypted(const std::string &id)
+{
+    erase(decrypted_, id);
+}
+
+void
+TimelineWindowCache::clearDecrypted()
+{
+    while (!decrypted_.empty())
+        erase(decrypted_, decrypted_.begin()->first);
+}
+
+void
+TimelineWindowCache::clear()
+{
+    window_.clear();
+    by_id_.clear();
+    decrypted_.clear();
+    lru_.clear();
+    bytes_ = 0;
+}
+
+void
+TimelineWindowCache::setBudget(std::size_t budget)
+{
+    budget_ = budget;
+    evict();
+}
+
+void
+TimelineWindowCache::erase(std::unordered_map<std::string, Lru::iterator> &table,
+                           const std::string &id)
+{
+    auto it = table.find(id);
+    if (it == table.end())
+        return;
+
+    auto item = it->second;
+    table.erase(it);
+    bytes_ -= item->size;
+    lru_.erase(item);
+}
+
+void
+TimelineWindowCache::erase(std::map<uint64_t, Slot>::iterator slot)
+{
+    bytes_ -= slot->second.size;
+    window_.erase(slot);
+}
+
+std::map<uint64_t, TimelineWindowCache::Slot>::iterator
+TimelineWindowCache::farthestFromFocus()
+{
+    auto farthest     = window_.end();
+    uint64_t distance = 0;
+
+    // the focus and the last inserted event are kept, so look at two entries from each end
+    auto consider = [&](std::map<uint64_t, Slot>::iterator slot) {
+        if (slot->first == focus_ || slot->first == inserted_)
+            return;
+        auto d = slot->first > focus_ ? slot->first - focus_ : focus_ - slot->first;
+        if (farthest == window_.end() || d > distance) {
+            farthest = slot;
+            distance = d;
+        }
+    };
+
+    auto front = window_.begin();
+    for (int i = 0; i < 2 && front != window_.end(); i++, ++front)
+        consider(front);
+    auto back = window_.end();
+    for (int i = 0; i < 2 && back != window_.begin(); i++)
+        consider(--back);
+
+    return farthest;
+}
+
+void
+TimelineWindowCache::evict()
+{
+    while (bytes_ > budget_) {
+        auto farthest = farthestFromFocus();
+        uint64_t distance =
+          farthest == window_.end()
+            ? 0
+            : (farthest->first > focus_ ? farthest->first - focus_ : focus_ - farthest->first);
+
+        if (farthest != window_.end() && distance > ViewportRadius)
+            erase(farthest);
+        else if (lru_.size() > 2)
+            erase(lru_.back().event ? by_id_ : decrypted_, lru_.back().id);
+        else if (farthest != window_.end())
+            erase(farthest);
+        else
+            break;
+    }
+}
@@ -0,0 +1,105 @@
+// SPDX-FileCopyrightText: 2022 Nheko Contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <mtx/events/collections.hpp>
+
+#include "../encryption/Olm.h"
+
+//! Memory bounded cache of the events of one timeline.
+//!
+//! Events looked up by their timeline index form a window around the focus, the index the view
+//! requested last. When the byte budget is exceeded, indexed events outside of the viewport
+//! radius are evicted first, starting with the one farthest from the focus, then events looked
+//! up by id and decryption results in least recently used order and only then the rest of the
+//! viewport. Returned pointers stay valid until the entry is removed or evicted. The focus, the
+//! last inserted indexed event and the two most recently used id entries are never evicted, so
+//! a pointer survives inserting the decryption result of its event.
+//!
+//! Not thread safe, only use it from the thread of the owning EventStore.
+class TimelineWindowCache
+{
+public:
+    //! Per room budget used by EventStore.
+    static constexpr std::size_t DefaultBudget = 2 * 1024 * 1024;
+    //! Indexed events this close to the focus are considered visible.
+    static constexpr uint64_t ViewportRadius = 50;
+
+    explicit TimelineWindowCache(std::size_t budget = DefaultBudget)
+      : budget_(budget)
+    {}
+
+    mtx::events::collections::TimelineEvents *event(uint64_t idx);
+    mtx::events::collections::TimelineEvents *
+    insertEvent(uint64_t idx, mtx::events::collections::TimelineEvents &&event);
+    void removeEvent(uint64_t idx);
+
+    mtx::events::collections::TimelineEvents *eventById(const std::string &id);
+    mtx::events::collections::TimelineEvents *
+    insertEventById(const std::string &id, mtx::events::collections::TimelineEvents &&event);
+    void removeEventById(const std::string &id);
+
+    olm::DecryptionResult *decrypted(const std::string &id);
+    //! Like decrypted(), but does not count as a use.
+    bool hasDecrypted(const std::string &id) const { return decrypted_.count(id) != 0; }
+    olm::DecryptionResult *insertDecrypted(const std::string &id, olm::DecryptionResult &&result);
+    void removeDecrypted(const std::string &id);
+    void clearDecrypted();
+
+    //! Moves the viewport, usually to the index the view requested last.
+    void setFocus(uint64_t idx) { focus_ = idx; }
+    void clear();
+
+    std::size_t budget() const { return budget_; }
+    void setBudget(std::size_t budget);
+    //! Estimated memory used by the cached events in bytes.
+    std::size_t residentBytes() const { return bytes_; }
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    //! Share of lookups, that were answered from the cache.
+    double hitRate() const
+    {
+        return hits_ + misses_ ? static_cast<double>(hits_) / (hits_ + misses_) : 0.;
+    }
+
+private:
+    struct Slot
+    {
+        std::unique_ptr<mtx::events::collections::TimelineEvents> event;
+        std::size_t size = 0;
+    };
+    struct Item
+    {
+        std::string id;
+        //! exactly one of both is set
+        std::unique_ptr<mtx::events::collections::TimelineEvents> event;
+        std::unique_ptr<olm::DecryptionResult> decrypted;
+        std::size_t size = 0;
+    };
+    using Lru = std::list<Item>;
+
+    void erase(std::unordered_map<std::string, Lru::iterator> &table, const std::string &id);
+    void erase(std::map<uint64_t, Slot>::iterator slot);
+    std::map<uint64_t, Slot>::iterator farthestFromFocus();
+    void evict();
+
+    std::map<uint64_t, Slot> window_;
+    Lru lru_;
+    std::unordered_map<std::string, Lru::iterator> by_id_, decrypted_;
+
+    uint64_t focus_ = 0, inserted_ = 0;
+    std::size_t budget_;
+    std::size_t bytes_ = 0;
+    uint64_t hits_ = 0, misses_ = 0;
+};
@@ -0,0 +1,122 @@
+#include <QtTest/QtTest>
+#include <QSemaphore>
+
+#include <thread>
+#include <vector>
+
+#include "../src/Cache.h"
+#include "../src/Cache_p.h"
+#include "testrunner.h"
+
+// Runs the read only query paths, while another thread holds the write transaction of a
+// saveState open. Readers must not wait for the writer.
+class CacheContentionTest: public QObject
+{
+    Q_OBJECT
+    const std::string userId = "@bench:localhost";
+    const std::string curveKey = "bench_curve25519_key";
+    std::vector<std::string> rooms;
+
+    //! With `fullyRead` the first room gets a fully read marker, which saveState reports with
+    //! removeNotification while its write transaction is open.
+    mtx::responses::Sync makeSync(int batch, bool fullyRead = false){
+        using namespace mtx::events;
+        mtx::responses::Sync sync;
+        sync.next_batch = "bench_batch_" + std::to_string(batch);
+
+        for(const auto &room_id: rooms){
+            mtx::responses::JoinedRoom room;
+            const auto prefix = "$" + std::to_string(batch) + "_" + room_id;
+
+            StateEvent<state::Name> name;
+            name.type = EventType::RoomName;
+            name.event_id = prefix + "_name";
+            name.sender = userId;
+            name.content.name = "Room " + room_id + " " + std::to_string(batch);
+            room.state.events.push_back(name);
+
+            StateEvent<state::Member> member;
+            member.type = EventType::RoomMember;
+            member.event_id = prefix + "_member";
+            member.sender = userId;
+            member.state_key = userId;
+            member.content.membership = state::Membership::Join;
+            room.state.events.push_back(member);
+
+            StateEvent<state::PowerLevels> powerLevels;
+            powerLevels.type = EventType::RoomPowerLevels;
+            powerLevels.event_id = prefix + "_power_levels";
+            powerLevels.sender = userId;
+            powerLevels.content.users[userId] = 100;
+            room.state.events.push_back(powerLevels);
+
+            for(int i = 0; i < 20; i++){
+                RoomEvent<msg::Text> text;
+                text.type = EventType::RoomMessage;
+                text.event_id = prefix + "_msg_" + std::to_string(i);
+                text.sender = userId;
+                text.origin_server_ts = 1660000000000 + batch * 100 + i;
+                text.content.body = "message " + std::to_string(i);
+                room.timeline.events.push_back(text);
+            }
+
+            if(fullyRead && room_id == rooms.front()){
+                AccountDataEvent<account_data::FullyRead> marker;
+                marker.type = EventType::FullyRead;
+                marker.content.event_id = prefix + "_msg_19";
+                room.account_data.events.push_back(marker);
+            }
+
+            sync.rooms.join[room_id] = room;
+        }
+        return sync;
+    }
+
+private slots:
+    void initTestCase(){
+        openThrowawayCache("cache_contention_", userId);
+        for(int i = 0; i < 50; i++)
+            rooms.push_back("!bench" + std::to_string(i) + ":localhost");
+        cache::client()->saveState(makeSync(0));
+    }
+
+    void readersDuringSaveState(){
+        QSemaphore writing, release, readDone;
+        auto hook = connect(
+          cache::client(),
+          &Cache::removeNotification,
+          cache::client(),
+          [&](const QString &, const QString &){
+              writing.release();
+              release.acquire();
+          },
+          Qt::DirectConnection);
+
+        std::thread writer([&](){ cache::client()->saveState(makeSync(1, true)); });
+        // from here on saveState holds its write transaction open, until it is released
+        bool writerBlocked = writing.tryAcquire(1, 10'000);
+
+        std::thread reader([&](){
+            cache::getRoomInfo(rooms);
+            cache::hasEnoughPowerLevel({mtx::events::EventType::RoomMessage}, rooms.front(), userId);
+            cache::getOlmSessions(curveKey);
+            // the first lookup of a key opens its db
+            cache::getOlmSession(curveKey, "unknown_session");
+            readDone.release();
+        });
+        bool readerDone = readDone.tryAcquire(1, 10'000);
+
+        // don't leave the threads hanging, if the reads waited for the writer
+        release.release();
+        writer.join();
+        reader.join();
+        disconnect(hook);
+
+        QVERIFY(writerBlocked);
+        QVERIFY2(readerDone, "reads waited for the write transaction");
+        QVERIFY(cache::hasEnoughPowerLevel({mtx::events::EventType::RoomMessage}, rooms.front(), userId));
+        QCOMPARE(cache::getRoomInfo(rooms).size(), static_cast<int>(rooms.size()));
+    }
+
+    void cleanupTestCase(){ closeThrowawayCache(); }
+};
@@ -0,0 +1,129 @@
+#include <QtTest/QtTest>
+
+#include <mtxclient/crypto/client.hpp>
+
+#include "../src/Cache.h"
+#include "../src/Cache_p.h"
+#include "../src/encryption/DecryptionPool.h"
+#include "testrunner.h"
+
+// Decrypts events of several megolm sessions, that are interleaved in one batch.
+class DecryptionPoolTest: public QObject
+{
+    Q_OBJECT
+    const std::string userId = "@decryption:localhost";
+    const std::string roomId = "!decryption:localhost";
+    static constexpr std::size_t eventCount = 12;
+
+    mtx::crypto::OlmClient olmClient;
+    std::vector<mtx::crypto::OutboundGroupSessionPtr> outbound;
+    std::vector<DecryptionPool::EncryptedEvent> events;
+
+    static std::string body(std::size_t idx){ return "message " + std::to_string(idx); }
+
+    //! Stores the inbound side of a new session and returns the outbound side.
+    mtx::crypto::OutboundGroupSessionPtr makeSession(){
+        auto session = olmClient.init_outbound_group_session();
+        auto inbound = olmClient.init_inbound_group_session(mtx::crypto::session_key(session.get()));
+
+        MegolmSessionIndex index;
+        index.room_id = roomId;
+        index.session_id = mtx::crypto::session_id(session.get());
+        GroupSessionData data;
+        data.sender_key = "decryption_curve25519_key";
+        cache::saveInboundMegolmSession(index, std::move(inbound), data);
+        return session;
+    }
+
+    DecryptionPool::EncryptedEvent encrypt(mtx::crypto::OutboundGroupSessionPtr &session,
+                                           std::size_t idx){
+        nlohmann::json plaintext = {{"type", "m.room.message"},
+                                    {"room_id", roomId},
+                                    {"content", {{"msgtype", "m.text"}, {"body", body(idx)}}}};
+        auto payload = olmClient.encrypt_group_message(session.get(), plaintext.dump());
+
+        DecryptionPool::EncryptedEvent event;
+        event.type = mtx::events::EventType::RoomEncrypted;
+        event.event_id = "$decryption" + std::to_string(idx);
+        event.sender = userId;
+        event.origin_server_ts = idx;
+        event.content.algorithm = "m.megolm.v1.aes-sha2";
+        event.content.ciphertext = std::string((char *)payload.data(), payload.size());
+        event.content.sender_key = "decryption_curve25519_key";
+        event.content.session_id = mtx::crypto::session_id(session.get());
+        event.content.device_id = "DECRYPTION";
+        return event;
+    }
+
+    //! Whether `result` is the decrypted event number `idx`.
+    static bool isMessage(const olm::DecryptionResult &result, std::size_t idx){
+        if(result.error != olm::DecryptionErrorCode::NoError || !result.event)
+            return false;
+        auto text = std::get_if<mtx::events::RoomEvent<mtx::events::msg::Text>>(&*result.event);
+        return text && text->content.body == body(idx);
+    }
+
+private slots:
+    void initTestCase(){
+        openThrowawayCache("decryption_pool_", userId);
+        cache::client()->pickleSecret();
+
+        for(int i = 0; i < 3; i++)
+            outbound.push_back(makeSession());
+        // round robin over the sessions, so that no session is contiguous in the batch
+        for(std::size_t i = 0; i < eventCount; i++)
+            events.push_back(encrypt(outbound[i % outbound.size()], i));
+    }
+
+    void decryptsInSubmissionOrder(){
+        auto results = DecryptionPool::decryptBatch(roomId, events);
+        QCOMPARE(results.size(), events.size());
+        for(std::size_t i = 0; i < results.size(); i++)
+            QVERIFY2(isMessage(results[i], i), qPrintable(QString::fromStdString(body(i))));
+    }
+
+    void reportsUnknownSessions(){
+        // a session, that was never stored, between the known ones
+        auto unknown = olmClient.init_outbound_group_session();
+        auto batch = events;
+        batch.insert(batch.begin() + 1, encrypt(unknown, eventCount));
+
+        auto results = DecryptionPool::decryptBatch(roomId, batch);
+        QCOMPARE(results.size(), batch.size());
+        QCOMPARE(results[1].error, olm::DecryptionErrorCode::MissingSession);
+        QVERIFY(!results[1].event);
+        QVERIFY(isMessage(results[0], 0));
+        for(std::size_t i = 2; i < results.size(); i++)
+            QVERIFY(isMessage(results[i], i - 1));
+    }
+
+    void deliversBatchesInOrder(){
+        DecryptionPool pool(2);
+        QObject context;
+        std::vector<std::size_t> delivered;
+        std::vector<std::vector<olm::DecryptionResult>> results;
+
+        // the largest batch first, so that it is likely to finish last
+        const std::vector<std::size_t> sizes = {eventCount, 1, 4};
+        for(std::size_t batch = 0; batch < sizes.size(); batch++){
+            std::vector<DecryptionPool::EncryptedEvent> chunk(events.begin(),
+                                                              events.begin() + sizes[batch]);
+            pool.decrypt(&context, roomId, std::move(chunk),
+                         [&, batch](std::vector<olm::DecryptionResult> r){
+                             delivered.push_back(batch);
+                             results.push_back(std::move(r));
+                         });
+        }
+
+        pool.waitForDone();
+        QTRY_COMPARE(delivered.size(), sizes.size());
+        QCOMPARE(delivered, (std::vector<std::size_t>{0, 1, 2}));
+        for(std::size_t batch = 0; batch < sizes.size(); batch++){
+            QCOMPARE(results[batch].size(), sizes[batch]);
+            for(std::size_t i = 0; i < sizes[batch]; i++)
+                QVERIFY(isMessage(results[batch][i], i));
+        }
+    }
+
+    void cleanupTestCase(){ closeThrowawayCache(); }
+};
@@ -0,0 +1,152 @@
+#include <QtTest/QtTest>
+
+#include <limits>
+#include <set>
+
+#include <mtxclient/crypto/client.hpp>
+
+#include "../src/Cache.h"
+#include "../src/Cache_p.h"
+#include "testrunner.h"
+
+// Exports and imports megolm sessions in several chunks through the streaming session key API.
+class SessionKeyTransferTest: public QObject
+{
+    Q_OBJECT
+    const std::string userId = "@transfer:localhost";
+    const std::string roomId = "!transfer:localhost";
+    static constexpr std::size_t sessionCount = 25;
+    static constexpr std::size_t chunkSize = 10;
+
+    mtx::crypto::OlmClient olmClient;
+    mtx::crypto::ExportedSessionKeys keys;
+
+    mtx::crypto::ExportedSession makeSession(){
+        auto outbound = olmClient.init_outbound_group_session();
+        auto inbound = olmClient.init_inbound_group_session(mtx::crypto::session_key(outbound.get()));
+
+        mtx::crypto::ExportedSession session;
+        session.room_id = roomId;
+        session.sender_key = "transfer_curve25519_key";
+        session.sender_claimed_keys["ed25519"] = "transfer_ed25519_key";
+        session.session_id = mtx::crypto::session_id(outbound.get());
+        session.session_key = mtx::crypto::export_session(inbound.get(), 0);
+        return session;
+    }
+
+    //! The same session, but only known from message `index` on.
+    static mtx::crypto::ExportedSession laterSession(const mtx::crypto::ExportedSession &session, uint32_t index){
+        auto later = session;
+        auto inbound = mtx::crypto::import_session(session.session_key);
+        later.session_key = mtx::crypto::export_session(inbound.get(), index);
+        return later;
+    }
+
+    uint32_t storedFirstKnownIndex(const std::string &session_id){
+        auto session = cache::client()->getInboundMegolmSession({roomId, session_id});
+        if(!session)
+            return std::numeric_limits<uint32_t>::max();
+        return olm_inbound_group_session_first_known_index(session.get());
+    }
+
+    //! Feeds `sessions` to the importer in chunks of chunkSize.
+    SessionKeyTransferStats importInChunks(const std::vector<mtx::crypto::ExportedSession> &sessions){
+        std::size_t next = 0;
+        return cache::importSessionKeys([&](mtx::crypto::ExportedSessionKeys &chunk){
+            if(next >= sessions.size())
+                return false;
+            auto end = std::min(next + chunkSize, sessions.size());
+            chunk.sessions.assign(sessions.begin() + next, sessions.begin() + end);
+            next = end;
+            return true;
+        });
+    }
+
+private slots:
+    void initTestCase(){
+        openThrowawayCache("session_key_transfer_", userId);
+        cache::client()->pickleSecret();
+
+        for(std::size_t i = 0; i < sessionCount; i++)
+            keys.sessions.push_back(makeSession());
+    }
+
+    void importsInChunks(){
+        auto stats = importInChunks(keys.sessions);
+        QCOMPARE(stats.sessions, sessionCount);
+        QCOMPARE(stats.skipped, std::size_t(0));
+        QCOMPARE(stats.chunks, (sessionCount + chunkSize - 1) / chunkSize);
+    }
+
+    void exportsInChunks(){
+        std::vector<mtx::crypto::ExportedSessionKeys> chunks;
+        auto stats = cache::client()->exportSessionKeys(
+          [&chunks](mtx::crypto::ExportedSessionKeys &&chunk){
+              chunks.push_back(std::move(chunk));
+              return true;
+          },
+          chunkSize);
+
+        QCOMPARE(stats.sessions, sessionCount);
+        QCOMPARE(stats.chunks, chunks.size());
+        QCOMPARE(chunks.size(), (sessionCount + chunkSize - 1) / chunkSize);
+
+        std::set<std::string> exported;
+        for(const auto &chunk: chunks){
+            QVERIFY(chunk.sessions.size() <= chunkSize);
+            for(const auto &session: chunk.sessions){
+                QVERIFY(session.room_id == roomId);
+                QVERIFY(session.sender_claimed_keys.at("ed25519") == "transfer_ed25519_key");
+                exported.insert(session.session_id);
+            }
+        }
+        QCOMPARE(exported.size(), sessionCount);
+        for(const auto &session: keys.sessions)
+            QVERIFY(exported.count(session.session_id));
+    }
+
+    void stopsWhenTheSinkDoes(){
+        std::size_t chunks = 0;
+        auto stats = cache::client()->exportSessionKeys(
+          [&](mtx::crypto::ExportedSessionKeys &&){ return ++chunks < 2; }, chunkSize);
+        QCOMPARE(chunks, std::size_t(2));
+        QCOMPARE(stats.sessions, 2 * chunkSize);
+    }
+
+    void roundTripsExportedKeys(){
+        auto exported = cache::exportSessionKeys();
+        QCOMPARE(exported.sessions.size(), sessionCount);
+
+        // the same sessions again don't have a lower first known index, so nothing is stored
+        auto stats = importInChunks(exported.sessions);
+        QCOMPARE(stats.sessions, std::size_t(0));
+        QCOMPARE(stats.skipped, sessionCount);
+    }
+
+    void keepsTheOlderSession(){
+        auto older = makeSession();
+        auto newer = laterSession(older, 2);
+
+        // a session starting at a later message index can't replace the stored one
+        QCOMPARE(importInChunks({older}).sessions, std::size_t(1));
+        QCOMPARE(storedFirstKnownIndex(older.session_id), uint32_t(0));
+
+        auto stats = importInChunks({newer});
+        QCOMPARE(stats.sessions, std::size_t(0));
+        QCOMPARE(stats.skipped, std::size_t(1));
+        QCOMPARE(storedFirstKnownIndex(older.session_id), uint32_t(0));
+    }
+
+    void replacesANewerSession(){
+        auto older = makeSession();
+        auto newer = laterSession(older, 2);
+
+        QCOMPARE(importInChunks({newer}).sessions, std::size_t(1));
+        QCOMPARE(storedFirstKnownIndex(older.session_id), uint32_t(2));
+
+        QCOMPARE(importInChunks({older}).sessions, std::size_t(1));
+        QCOMPARE(storedFirstKnownIndex(older.session_id), uint32_t(0));
+    }
+
+    void cleanupTestCase(){ closeThrowawayCache(); }
+};
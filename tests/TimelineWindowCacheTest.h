@@ -0,0 +1,53 @@
+#include <QtTest/QtTest>
+
+#include "../src/timeline/TimelineWindowCache.h"
+
+class TimelineWindowCacheTest: public QObject
+{
+    Q_OBJECT
+
+    static mtx::events::collections::TimelineEvents makeText(uint64_t idx){
+        mtx::events::RoomEvent<mtx::events::msg::Text> text;
+        text.type = mtx::events::EventType::RoomMessage;
+        text.event_id = "$event" + std::to_string(idx);
+        text.sender = "@test:localhost";
+        text.content.body = std::string(200, 'x');
+        return text;
+    }
+
+private slots:
+    void staysWithinBudget(){
+        TimelineWindowCache cache(64 * 1024);
+        for(uint64_t i = 0; i < 1000; i++){
+            cache.setFocus(i);
+            QVERIFY(cache.insertEvent(i, makeText(i)));
+        }
+        QVERIFY(cache.residentBytes() <= cache.budget());
+        QVERIFY(cache.residentBytes() > 0);
+    }
+
+    void keepsWindowAroundFocus(){
+        TimelineWindowCache cache(64 * 1024);
+        for(uint64_t i = 0; i < 1000; i++)
+            cache.insertEvent(i, makeText(i));
+
+        // the focus stayed at 0, so the newer events were evicted, except the last inserted one
+        QVERIFY(cache.event(0));
+        QVERIFY(cache.event(1));
+        QVERIFY(!cache.event(500));
+        QVERIFY(cache.event(999));
+    }
+
+    void countsHitsAndMisses(){
+        TimelineWindowCache cache;
+        cache.insertEventById("$a", makeText(1));
+        QVERIFY(cache.eventById("$a"));
+        QVERIFY(!cache.eventById("$b"));
+        QCOMPARE(cache.hits(), uint64_t(1));
+        QCOMPARE(cache.misses(), uint64_t(1));
+        QCOMPARE(cache.hitRate(), 0.5);
+
+        cache.clear();
+        QCOMPARE(cache.residentBytes(), std::size_t(0));
+    }
+};
@@ -4,7 +4,11 @@
 #include "testrunner.h"
 
 #include "AuthenticationTest.h"
+#include "CacheContentionTest.h"
 #include "ClientTest.h"
+#include "DecryptionPoolTest.h"
+#include "SessionKeyTransferTest.h"
+#include "TimelineWindowCacheTest.h"
 #include "UserSettingsTest.h"
 
 int main(int argc, char *argv[])
@@ -15,6 +19,10 @@ int main(int argc, char *argv[])
     runTests<UserSettingsTest>(argc, argv, &status);
     runTests<AuthenticationTest>(argc, argv, &status);
     runTests<ClientTest>(argc, argv, &status);
+    runTests<CacheContentionTest>(argc, argv, &status);
+    runTests<TimelineWindowCacheTest>(argc, argv, &status);
+    runTests<SessionKeyTransferTest>(argc, argv, &status);
+    runTests<DecryptionPoolTest>(argc, argv, &status);
     // --------------------------------------------------------------------------------------------------- 
     raise(SIGINT);
     return app.exec();     
@@ -3,6 +3,12 @@
 
 #include <QtTest>
 #include <QDebug>
+#include <QStandardPaths>
+#include <QUuid>
+
+#include "../src/Cache.h"
+#include "../src/UserSettings.h"
+
 template <typename TestClass>
 void runTests(int argc, char* argv[], int* status)
 {
@@ -12,4 +18,20 @@ void runTests(int argc, char* argv[], int* status)
     QThread::sleep(1);
 }
 
+//! Opens the cache of `userId` in a new profile within the test mode locations, so that tests
+//! never touch the data of a real profile.
+inline void openThrowawayCache(const QString &profilePrefix, const std::string &userId)
+{
+    QStandardPaths::setTestModeEnabled(true);
+    UserSettings::initialize(profilePrefix + QUuid::createUuid().toString(QUuid::Id128));
+    cache::init(QString::fromStdString(userId));
+}
+
+//! Deletes the cache opened by openThrowawayCache().
+inline void closeThrowawayCache()
+{
+    cache::deleteData();
+    QStandardPaths::setTestModeEnabled(false);
+}
+
 #endif // TESTRUNNER_H
\ No newline at end of file